@@ -156,6 +156,7 @@ int pn_message_save_json(pn_message_t *msg, char *OUTPUT, size_t *OUTPUT_SIZE);
 
 ssize_t pn_link_send(pn_link_t *transport, char *STRING, size_t LENGTH);
 %ignore pn_link_send;
+%ignore pn_link_send_ref;
 
 %rename(pn_link_recv) wrap_pn_link_recv;
 %inline %{
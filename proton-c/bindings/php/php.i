@@ -112,6 +112,7 @@
 // allow pn_link_send/pn_input's input buffer to be binary safe
 ssize_t pn_link_send(pn_link_t *transport, char *STRING, size_t LENGTH);
 %ignore pn_link_send;
+%ignore pn_link_send_ref;
 ssize_t pn_transport_input(pn_transport_t *transport, char *STRING, size_t LENGTH);
 %ignore pn_transport_input;
 
@@ -168,7 +168,7 @@ class Messenger(object):
       del self._mng
 
   def _check(self, err):
-    if err < 0:
+    if err < 0 and err != PN_INPROGRESS:
       exc = EXCEPTIONS.get(err, MessengerException)
       raise exc("[%s]: %s" % (err, pn_messenger_error(self._mng)))
     else:
@@ -238,6 +238,31 @@ peer on an SSL/TLS connection. If this property is None, then the peer
 will not be verified.
 """)
 
+  def _get_ssl_resume(self):
+    return pn_messenger_get_ssl_resume(self._mng)
+
+  def _set_ssl_resume(self, value):
+    self._check(pn_messenger_set_ssl_resume(self._mng, value))
+
+  ssl_resume = property(_get_ssl_resume, _set_ssl_resume,
+                        doc="""
+When True, outgoing SSL/TLS connections to the same host and port as
+the same user may resume the session of an earlier connection rather
+than negotiate a new one. Defaults to False.
+""")
+
+  def ssl_resume_status(self, address):
+    """
+    Checks whether the SSL/TLS session of the connection to the given
+    address was resumed.
+
+    @type address: string
+    @param address: an amqps address the L{Messenger} is connected to
+
+    @return: one of SSL.RESUME_UNKNOWN, SSL.RESUME_NEW or SSL.RESUME_REUSED
+    """
+    return pn_messenger_ssl_resume_status(self._mng, address)
+
   def _get_timeout(self):
     return pn_messenger_get_timeout(self._mng)
 
@@ -248,6 +273,19 @@ will not be verified.
                      doc="""
 The timeout property contains the default timeout for blocking
 operations performed by the L{Messenger}.
+""")
+
+  def _is_blocking(self):
+    return pn_messenger_is_blocking(self._mng)
+
+  def _set_blocking(self, value):
+    self._check(pn_messenger_set_blocking(self._mng, value))
+
+  blocking = property(_is_blocking, _set_blocking,
+                      doc="""
+When False, L{send}, L{recv} and L{stop} do whatever I/O is ready and
+return at once rather than waiting to finish, and the L{Messenger} is
+driven on by calling L{work}. Defaults to True.
 """)
 
   def _get_incoming_window(self):
@@ -296,6 +334,28 @@ send. Defaults to zero.
     """
     self._check(pn_messenger_stop(self._mng))
 
+  @property
+  def stopped(self):
+    """
+    True once every connection of a stopped L{Messenger} has closed.
+    """
+    return pn_messenger_stopped(self._mng)
+
+  def work(self, timeout):
+    """
+    Waits up to I{timeout} milliseconds for I/O and processes whatever
+    is ready. A timeout of zero never waits.
+    """
+    self._check(pn_messenger_work(self._mng, timeout))
+
+  @property
+  def deadline(self):
+    """
+    The time, in milliseconds since the epoch, by which L{work} must be
+    called even if no I/O is ready, or zero if there is none.
+    """
+    return pn_messenger_deadline(self._mng)
+
   def subscribe(self, source):
     """
     Subscribes the L{Messenger} to messages originating from the
@@ -333,6 +393,38 @@ send. Defaults to zero.
     self._check(pn_messenger_put(self._mng, message._msg))
     return pn_messenger_outgoing_tracker(self._mng)
 
+  def put_async(self, message):
+    """
+    Places the content contained in the message onto the outgoing
+    queue of the L{Messenger} from any thread, including while another
+    thread is blocked in L{send}, L{recv} or L{work}. The message is
+    encoded by the calling thread, and the thread running the
+    L{Messenger} takes it over the next time it does any work.
+
+    @type message: Message
+    @param message: the message to place in the outgoing queue
+    """
+    message._pre_encode()
+    err = pn_messenger_put_async(self._mng, message._msg)
+    if err < 0:
+      exc = EXCEPTIONS.get(err, MessengerException)
+      raise exc("[%s]: put_async failed" % err)
+
+  def put_batch(self, messages):
+    """
+    Places a sequence of messages onto the outgoing queue of the
+    L{Messenger} in a single call, then sends whatever can be sent
+    without blocking.
+
+    @type messages: sequence of Message
+    @param messages: the messages to place in the outgoing queue
+    @return: the tracker of the last message
+    """
+    for message in messages:
+      message._pre_encode()
+    self._check(pn_messenger_put_batch(self._mng, [m._msg for m in messages]))
+    return pn_messenger_outgoing_tracker(self._mng)
+
   def status(self, tracker):
     """
     Gets the last known remote state of the delivery associated with
@@ -389,6 +481,23 @@ send. Defaults to zero.
       message._post_decode()
     return pn_messenger_incoming_tracker(self._mng)
 
+  def get_batch(self, messages):
+    """
+    Moves messages from the head of the incoming message queue into
+    the supplied message objects, filling them in order.
+
+    @type messages: sequence of Message
+    @param messages: the destination message objects
+    @return: the number of messages filled in
+    """
+    n = pn_messenger_get_batch(self._mng, [m._msg for m in messages])
+    if n == PN_EOS:
+      return 0
+    self._check(n)
+    for message in messages[:n]:
+      message._post_decode()
+    return n
+
   def accept(self, tracker=None):
     """
     Accepts messages retreived from the incoming message queue.
@@ -1677,6 +1786,55 @@ class Data:
 class ConnectionException(ProtonException):
   pass
 
+class Histogram(object):
+  """
+  Latency samples in microseconds, counted in power of two buckets.
+  """
+
+  def __init__(self, impl, snapshot):
+    self._impl = impl
+    # the histogram lives inside the snapshot struct
+    self._snapshot = snapshot
+    self.count = impl.count
+    self.sum = impl.sum
+    self.max = impl.max
+
+  def percentile(self, percentile):
+    """
+    Estimates the given percentile (0 to 100) of the samples. The
+    estimate is at most twice the true value and never more than the
+    longest sample.
+    """
+    return pn_histogram_percentile(self._impl, percentile)
+
+class LinkMetrics(object):
+
+  def __init__(self, impl, snapshot=None):
+    self.deliveries_sent = impl.deliveries_sent
+    self.deliveries_received = impl.deliveries_received
+    self.bytes_sent = impl.bytes_sent
+    self.bytes_received = impl.bytes_received
+    self.credit_starved = impl.credit_starved
+    self.unsettled = impl.unsettled
+    self.send_latency = Histogram(impl.send_latency, snapshot or impl)
+    self.settle_latency = Histogram(impl.settle_latency, snapshot or impl)
+
+class ConnectionMetrics(object):
+
+  def __init__(self, impl):
+    self.bytes_input = impl.bytes_input
+    self.bytes_output = impl.bytes_output
+    self.frames_input = impl.frames_input
+    self.frames_output = impl.frames_output
+    self.window_stalled = impl.window_stalled
+    self.links = LinkMetrics(impl.links, impl)
+
+def _snapshot(fn, impl, obj):
+  err = fn(obj, impl)
+  if err:
+    raise ProtonException("[%s]: metrics are not available" % err)
+  return impl
+
 class Endpoint(object):
 
   LOCAL_UNINIT = PN_LOCAL_UNINIT
@@ -1739,6 +1897,11 @@ def wrap_connection(conn):
 
 class Connection(Endpoint):
 
+  SCHED_FIFO = PN_SCHED_FIFO
+  SCHED_PRIORITY = PN_SCHED_PRIORITY
+  SCHED_MESSAGE_PRIORITY = PN_SCHED_MESSAGE_PRIORITY
+  SCHED_WEIGHTED = PN_SCHED_WEIGHTED
+
   def __init__(self, _conn=None):
     Endpoint.__init__(self)
     if _conn:
@@ -1779,6 +1942,29 @@ class Connection(Endpoint):
 
   hostname = property(_get_hostname, _set_hostname)
 
+  def _get_delivery_pool(self):
+    return pn_connection_get_delivery_pool(self._conn)
+  def _set_delivery_pool(self, value):
+    pn_connection_set_delivery_pool(self._conn, value)
+
+  delivery_pool = property(_get_delivery_pool, _set_delivery_pool)
+
+  @property
+  def pooled(self):
+    return pn_connection_pooled(self._conn)
+
+  def _get_scheduler(self):
+    return pn_connection_get_scheduler(self._conn)
+  def _set_scheduler(self, value):
+    pn_connection_set_scheduler(self._conn, value)
+
+  scheduler = property(_get_scheduler, _set_scheduler)
+
+  @property
+  def metrics(self):
+    return ConnectionMetrics(_snapshot(pn_connection_metrics,
+                                       pn_connection_metrics_t(), self._conn))
+
   @property
   def remote_container(self):
     return pn_connection_remote_container(self._conn)
@@ -1818,6 +2004,18 @@ class Connection(Endpoint):
   def writable(self):
     return pn_connection_writable(self._conn)
 
+  @property
+  def outgoing(self):
+    return pn_connection_outgoing(self._conn)
+
+  @property
+  def incoming(self):
+    return pn_connection_incoming(self._conn)
+
+  @property
+  def unresolved(self):
+    return pn_connection_unresolved(self._conn)
+
   def session(self):
     return wrap_session(pn_session(self._conn))
 
@@ -1876,6 +2074,35 @@ class Session(Endpoint):
   def connection(self):
     return wrap_connection(pn_session_connection(self._ssn))
 
+  def _get_incoming_capacity(self):
+    return pn_session_get_incoming_capacity(self._ssn)
+  def _set_incoming_capacity(self, capacity):
+    pn_session_set_incoming_capacity(self._ssn, capacity)
+
+  incoming_capacity = property(_get_incoming_capacity, _set_incoming_capacity)
+
+  def _get_outgoing_capacity(self):
+    return pn_session_get_outgoing_capacity(self._ssn)
+  def _set_outgoing_capacity(self, capacity):
+    pn_session_set_outgoing_capacity(self._ssn, capacity)
+
+  outgoing_capacity = property(_get_outgoing_capacity, _set_outgoing_capacity)
+
+  def _get_incoming_low_water(self):
+    return pn_session_get_incoming_low_water(self._ssn)
+  def _set_incoming_low_water(self, low_water):
+    pn_session_set_incoming_low_water(self._ssn, low_water)
+
+  incoming_low_water = property(_get_incoming_low_water, _set_incoming_low_water)
+
+  @property
+  def window_stalled(self):
+    """
+    Microseconds transfers have waited for the peer's incoming window.
+    """
+    return _snapshot(pn_session_metrics, pn_session_metrics_t(),
+                     self._ssn).window_stalled
+
   def sender(self, name):
     return wrap_link(pn_sender(self._ssn, name))
 
@@ -1900,6 +2127,10 @@ def wrap_link(link):
 
 class Link(Endpoint):
 
+  SND_UNSETTLED = PN_SND_UNSETTLED
+  SND_SETTLED = PN_SND_SETTLED
+  SND_MIXED = PN_SND_MIXED
+
   def __init__(self, link):
     Endpoint.__init__(self)
     self._link = link
@@ -1978,6 +2209,32 @@ class Link(Endpoint):
   def queued(self):
     return pn_link_queued(self._link)
 
+  def _get_snd_settle_mode(self):
+    return pn_link_get_snd_settle_mode(self._link)
+  def _set_snd_settle_mode(self, mode):
+    pn_link_set_snd_settle_mode(self._link, mode)
+  snd_settle_mode = property(_get_snd_settle_mode, _set_snd_settle_mode)
+
+  @property
+  def remote_snd_settle_mode(self):
+    return pn_link_remote_snd_settle_mode(self._link)
+
+  def _get_priority(self):
+    return pn_link_get_priority(self._link)
+  def _set_priority(self, priority):
+    pn_link_set_priority(self._link, priority)
+  priority = property(_get_priority, _set_priority)
+
+  def _get_weight(self):
+    return pn_link_get_weight(self._link)
+  def _set_weight(self, weight):
+    pn_link_set_weight(self._link, weight)
+  weight = property(_get_weight, _set_weight)
+
+  @property
+  def metrics(self):
+    return LinkMetrics(_snapshot(pn_link_metrics, pn_link_metrics_t(), self._link))
+
   def next(self, mask):
     return wrap_link(pn_link_next(self._link, mask))
 
@@ -2066,6 +2323,13 @@ class Sender(Link):
   def send(self, bytes):
     return self._check(pn_link_send(self._link, bytes))
 
+  def send_ref(self, bytes):
+    """
+    Sends a string without copying it, the string is referenced until
+    it has been written out.
+    """
+    return self._check(pn_link_send_ref(self._link, bytes))
+
   def drained(self):
     pn_link_drained(self._link)
 
@@ -2085,6 +2349,31 @@ class Receiver(Link):
   def drain(self, n):
     pn_link_drain(self._link, n)
 
+  def _get_credit_low_water(self):
+    return pn_link_get_credit_low_water(self._link)
+  def _set_credit_low_water(self, low_water):
+    pn_link_set_credit_low_water(self._link, low_water)
+
+  credit_low_water = property(_get_credit_low_water, _set_credit_low_water)
+
+  @property
+  def credit_window(self):
+    return pn_link_get_credit_window(self._link)
+
+  def set_credit_window(self, window, low_water):
+    pn_link_set_credit_window(self._link, window, low_water)
+
+  @property
+  def buffered(self):
+    return pn_link_buffered(self._link)
+
+  def _get_max_buffered(self):
+    return pn_link_get_max_buffered(self._link)
+  def _set_max_buffered(self, max_buffered):
+    pn_link_set_max_buffered(self._link, max_buffered)
+
+  max_buffered = property(_get_max_buffered, _set_max_buffered)
+
 def wrap_delivery(dlv):
   if not dlv: return None
   ctx = pn_delivery_get_context(dlv)
@@ -2096,6 +2385,7 @@ def wrap_delivery(dlv):
 class Delivery(object):
 
   ACCEPTED = PN_ACCEPTED
+  REJECTED = PN_REJECTED
 
   def __init__(self, dlv):
     self._dlv = dlv
@@ -2112,6 +2402,16 @@ class Delivery(object):
   def readable(self):
     return pn_delivery_readable(self._dlv)
 
+  @property
+  def partial(self):
+    return pn_delivery_partial(self._dlv)
+
+  def _get_priority(self):
+    return pn_delivery_get_priority(self._dlv)
+  def _set_priority(self, priority):
+    pn_delivery_set_priority(self._dlv, priority)
+  priority = property(_get_priority, _set_priority)
+
   @property
   def updated(self):
     return pn_delivery_updated(self._dlv)
@@ -2202,6 +2502,38 @@ Sets the maximum size for received frames (in bytes).
   def remote_max_frame_size(self):
     return pn_transport_get_remote_max_frame(self._trans)
 
+  def _get_output_quantum(self):
+    return pn_transport_get_output_quantum(self._trans)
+
+  def _set_output_quantum(self, value):
+    pn_transport_set_output_quantum(self._trans, value)
+
+  output_quantum = property(_get_output_quantum, _set_output_quantum,
+                            doc="""
+The transfer payload a link may write before the next link with
+pending transfers gets a turn (in bytes, zero for unlimited).
+""")
+
+  def _get_trace_records(self):
+    return pn_transport_get_trace_records(self._trans)
+
+  def _set_trace_records(self, value):
+    self._check(pn_transport_set_trace_records(self._trans, value))
+
+  trace_records = property(_get_trace_records, _set_trace_records,
+                           doc="""
+The number of most recent frames the transport keeps a record of
+(rounded up to a power of two, zero turns recording off).
+""")
+
+  def trace_dump(self):
+    """
+    Returns the recorded frames in the binary format read by proton-dump.
+    """
+    cd, out = pn_transport_trace_dump(self._trans, 16 + 32*self.trace_records)
+    self._check(cd)
+    return out
+
   # AMQP 1.0 idle-time-out
   def _get_idle_timeout(self):
     return pn_transport_get_idle_timeout(self._trans)
@@ -2324,6 +2656,16 @@ class SSLDomain(object):
   def allow_unsecured_client(self):
     return self._check( pn_ssl_domain_allow_unsecured_client(self._domain) )
 
+  def set_session_cache_size(self, size):
+    return self._check( pn_ssl_domain_set_session_cache_size(self._domain,
+                                                             size) )
+
+  @property
+  def session_cache_stats(self):
+    stats = pn_ssl_cache_stats_t()
+    self._check( pn_ssl_domain_get_session_cache_stats(self._domain, stats) )
+    return stats
+
 class SSL(object):
 
   def _check(self, err):
@@ -2396,11 +2738,14 @@ __all__ = [
            "Array",
            "Condition",
            "Connection",
+           "ConnectionMetrics",
            "Data",
            "Delivery",
            "Described",
            "Endpoint",
+           "Histogram",
            "Link",
+           "LinkMetrics",
            "Message",
            "MessageException",
            "Messenger",
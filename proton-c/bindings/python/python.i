@@ -70,6 +70,34 @@
   $result = PyString_FromStringAndSize($1.bytes, 16);
 }
 
+%typemap(in) (pn_message_t **MESSAGES, size_t COUNT) {
+  $1 = NULL;
+  if (!PySequence_Check($input)) {
+    SWIG_exception_fail(SWIG_TypeError, "expected a sequence of messages");
+  }
+  $2 = PySequence_Size($input);
+  $1 = (pn_message_t **) calloc($2 ? $2 : 1, sizeof(pn_message_t *));
+  for (size_t i = 0; i < $2; i++) {
+    PyObject *item = PySequence_GetItem($input, i);
+    int res = item == Py_None ? SWIG_OK :
+      SWIG_ConvertPtr(item, (void **) &$1[i], SWIGTYPE_p_pn_message_t, 0);
+    Py_XDECREF(item);
+    if (!SWIG_IsOK(res)) {
+      SWIG_exception_fail(SWIG_ArgError(res), "expected a sequence of messages");
+    }
+  }
+}
+
+%typemap(freearg) (pn_message_t **MESSAGES, size_t COUNT) {
+  free($1);
+}
+
+int pn_messenger_put_batch(pn_messenger_t *messenger, pn_message_t **MESSAGES, size_t COUNT);
+%ignore pn_messenger_put_batch;
+
+int pn_messenger_get_batch(pn_messenger_t *messenger, pn_message_t **MESSAGES, size_t COUNT);
+%ignore pn_messenger_get_batch;
+
 int pn_message_load(pn_message_t *msg, char *STRING, size_t LENGTH);
 %ignore pn_message_load;
 
@@ -106,6 +134,29 @@ int pn_message_save_json(pn_message_t *msg, char *OUTPUT, size_t *OUTPUT_SIZE);
 ssize_t pn_link_send(pn_link_t *transport, char *STRING, size_t LENGTH);
 %ignore pn_link_send;
 
+%{
+  static void wrap_pn_link_send_ref_release(void *context) {
+    Py_XDECREF((PyObject *) context);
+  }
+%}
+%rename(pn_link_send_ref) wrap_pn_link_send_ref;
+%inline {
+  ssize_t wrap_pn_link_send_ref(pn_link_t *link, PyObject *bytes) {
+    char *start;
+    Py_ssize_t size;
+    if (PyString_AsStringAndSize(bytes, &start, &size)) {
+      PyErr_Clear();
+      return PN_ARG_ERR;
+    }
+    // the string is held until the engine releases it
+    Py_INCREF(bytes);
+    ssize_t n = pn_link_send_ref(link, start, size, wrap_pn_link_send_ref_release, bytes);
+    if (n < 0) Py_DECREF(bytes);
+    return n;
+  }
+}
+%ignore pn_link_send_ref;
+
 %rename(pn_link_recv) wrap_pn_link_recv;
 %inline %{
   int wrap_pn_link_recv(pn_link_t *link, char *OUTPUT, size_t *OUTPUT_SIZE) {
@@ -137,6 +188,20 @@ ssize_t pn_transport_input(pn_transport_t *transport, char *STRING, size_t LENGT
 %}
 %ignore pn_transport_output;
 
+%rename(pn_transport_trace_dump) wrap_pn_transport_trace_dump;
+%inline %{
+  int wrap_pn_transport_trace_dump(pn_transport_t *transport, char *OUTPUT, size_t *OUTPUT_SIZE) {
+    ssize_t sz = pn_transport_trace_dump(transport, OUTPUT, *OUTPUT_SIZE);
+    if (sz >= 0) {
+      *OUTPUT_SIZE = sz;
+    } else {
+      *OUTPUT_SIZE = 0;
+    }
+    return sz;
+  }
+%}
+%ignore pn_transport_trace_dump;
+
 %rename(pn_delivery) wrap_pn_delivery;
 %inline %{
   pn_delivery_t *wrap_pn_delivery(pn_link_t *link, char *STRING, size_t LENGTH) {
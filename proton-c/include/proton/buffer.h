@@ -43,6 +43,7 @@ int pn_buffer_trim(pn_buffer_t *buf, size_t left, size_t right);
 void pn_buffer_clear(pn_buffer_t *buf);
 int pn_buffer_defrag(pn_buffer_t *buf);
 pn_bytes_t pn_buffer_bytes(pn_buffer_t *buf);
+pn_bytes_t pn_buffer_head_bytes(pn_buffer_t *buf);
 int pn_buffer_print(pn_buffer_t *buf);
 
 #ifdef __cplusplus
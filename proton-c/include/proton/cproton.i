@@ -582,6 +582,29 @@ typedef long long int int64_t;
 
 %include "proton/engine.h"
 
+%contract pn_link_metrics(pn_link_t *link, pn_link_metrics_t *metrics)
+{
+ require:
+  link != NULL;
+  metrics != NULL;
+}
+
+%contract pn_session_metrics(pn_session_t *session, pn_session_metrics_t *metrics)
+{
+ require:
+  session != NULL;
+  metrics != NULL;
+}
+
+%contract pn_connection_metrics(pn_connection_t *connection, pn_connection_metrics_t *metrics)
+{
+ require:
+  connection != NULL;
+  metrics != NULL;
+}
+
+%include "proton/metrics.h"
+
 %contract pn_message_free(pn_message_t *msg)
 {
  require:
@@ -60,6 +60,41 @@ pn_listener_t *pn_listener_fd(pn_driver_t *driver, pn_socket_t fd, void *context
  */
 pn_connector_t *pn_connector_fd(pn_driver_t *driver, pn_socket_t fd, void *context);
 
+#define PN_FD_READABLE (1)
+#define PN_FD_WRITABLE (2)
+
+/** A descriptor the driver is waiting on and the events it is
+ * interested in, a combination of PN_FD_READABLE and PN_FD_WRITABLE.
+ */
+typedef struct {
+  pn_socket_t fd;
+  int events;
+} pn_fd_t;
+
+/** Get the descriptors the driver would wait on in pn_driver_wait().
+ *
+ * This allows the driver to be run from an application's own event
+ * loop: wait on the descriptors until one is ready or the deadline
+ * passes, then call pn_driver_wait() with a timeout of zero to pick
+ * up the ready listeners and connectors.
+ *
+ * @param[in] driver the driver
+ * @param[out] fds filled in with up to capacity descriptors
+ * @param[in] capacity the number of entries in fds
+ * @return the number of descriptors, which may exceed capacity, in
+ *         which case only the first capacity are filled in
+ */
+size_t pn_driver_fds(pn_driver_t *driver, pn_fd_t *fds, size_t capacity);
+
+/** Get the time by which the driver needs pn_driver_wait() called
+ * again regardless of I/O, for instance to send heartbeats.
+ *
+ * @param[in] driver the driver
+ * @return the deadline in milliseconds since the epoch, zero if there
+ *         is none
+ */
+pn_timestamp_t pn_driver_deadline(pn_driver_t *driver);
+
 
 #ifdef __cplusplus
 }
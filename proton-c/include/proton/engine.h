@@ -62,6 +62,17 @@ typedef enum {
   PN_CONNECTION_CLOSE,
   PN_NEVER
 } pn_expiry_policy_t;
+typedef enum {
+  PN_SND_UNSETTLED = 0, /**< the sender will send all deliveries unsettled */
+  PN_SND_SETTLED = 1,   /**< the sender will send all deliveries settled */
+  PN_SND_MIXED = 2      /**< the sender may send a mixture of both */
+} pn_snd_settle_mode_t;
+typedef enum {
+  PN_SCHED_FIFO = 0,             /**< deliveries are written in the order they became ready */
+  PN_SCHED_PRIORITY = 1,         /**< links with a higher priority are served first */
+  PN_SCHED_MESSAGE_PRIORITY = 2, /**< deliveries with a higher priority are served first */
+  PN_SCHED_WEIGHTED = 3          /**< links share the output in proportion to their weight */
+} pn_sched_t;
 typedef struct pn_delivery_t pn_delivery_t;
 
 typedef struct pn_delivery_tag_t {
@@ -104,6 +115,7 @@ typedef int pn_trace_t;
 #define PN_TRACE_DRV (4)
 
 #define PN_SESSION_WINDOW (1024)
+#define PN_TRACE_RECORDS (256)
 
 // connection
 
@@ -164,6 +176,18 @@ pn_delivery_t *pn_work_head(pn_connection_t *connection);
  */
 pn_delivery_t *pn_work_next(pn_delivery_t *delivery);
 
+/** Take the next incoming delivery that has arrived in full.
+ *
+ * Each incoming delivery is returned once, in the order the last of
+ * its transfers arrived, so that a caller can find newly complete
+ * deliveries without walking the work list. Deliveries that are freed
+ * before they are taken are skipped.
+ *
+ * @param[in] connection the connection
+ * @return the delivery that arrived in full longest ago, else NULL
+ */
+pn_delivery_t *pn_connection_arrived(pn_connection_t *connection);
+
 /** Factory for creating a new session on the connection.
  *
  * A new session is created for the connection, and is added to the
@@ -275,6 +299,76 @@ void *pn_connection_get_context(pn_connection_t *connection);
  */
 void pn_connection_set_context(pn_connection_t *connection, void *context);
 
+/** Access the maximum number of idle deliveries a connection retains
+ * for reuse.
+ *
+ * @param[in] connection the connection
+ * @return the delivery pool limit
+ */
+size_t pn_connection_get_delivery_pool(pn_connection_t *connection);
+
+/** Limit the number of idle deliveries a connection retains for
+ * reuse. Deliveries are allocated in blocks, blocks that are entirely
+ * idle are released while the pool exceeds this limit.
+ *
+ * @param[in] connection the connection
+ * @param[in] max the delivery pool limit
+ */
+void pn_connection_set_delivery_pool(pn_connection_t *connection, size_t max);
+
+/** Access the number of idle deliveries a connection currently
+ * retains for reuse.
+ *
+ * @param[in] connection the connection
+ * @return the number of pooled deliveries
+ */
+size_t pn_connection_pooled(pn_connection_t *connection);
+
+/** Access the policy a connection uses to order outbound transfers.
+ *
+ * @param[in] connection the connection
+ * @return the scheduling policy
+ */
+pn_sched_t pn_connection_get_scheduler(pn_connection_t *connection);
+
+/** Choose the order in which the transport writes deliveries from
+ * different links of a connection. Deliveries on the same link are
+ * always written in the order they were created, so a link is only
+ * ever overtaken as a whole. Defaults to PN_SCHED_FIFO.
+ *
+ * @param[in] connection the connection
+ * @param[in] scheduler the scheduling policy
+ */
+void pn_connection_set_scheduler(pn_connection_t *connection, pn_sched_t scheduler);
+
+/** Access the number of deliveries queued on the senders of a
+ * connection, the sum of ::pn_link_queued over its senders that have
+ * not been closed, without visiting each of them.
+ *
+ * @param[in] connection the connection
+ * @return the number of outgoing deliveries not yet written
+ */
+int pn_connection_outgoing(pn_connection_t *connection);
+
+/** Access the number of deliveries queued on the receivers of a
+ * connection, the sum of ::pn_link_queued over its receivers that have
+ * not been closed.
+ *
+ * @param[in] connection the connection
+ * @return the number of incoming deliveries not yet read
+ */
+int pn_connection_incoming(pn_connection_t *connection);
+
+/** Access the number of deliveries on the senders of a connection that
+ * are still waiting for an outcome. A delivery stops counting once the
+ * peer updates or settles it, or once it is settled locally. Senders
+ * that have been closed are not counted.
+ *
+ * @param[in] connection the connection
+ * @return the number of outgoing deliveries without an outcome
+ */
+int pn_connection_unresolved(pn_connection_t *connection);
+
 
 // transport
 pn_error_t *pn_transport_error(pn_transport_t *transport);
@@ -299,12 +393,68 @@ void pn_transport_trace(pn_transport_t *transport, pn_trace_t trace);
 uint32_t pn_transport_get_max_frame(pn_transport_t *transport);
 void pn_transport_set_max_frame(pn_transport_t *transport, uint32_t size);
 uint32_t pn_transport_get_remote_max_frame(pn_transport_t *transport);
+/** Access the transfer payload a link may write per turn.
+ *
+ * @param[in] transport the transport
+ * @return the output quantum in bytes, zero if unlimited
+ */
+size_t pn_transport_get_output_quantum(pn_transport_t *transport);
+/** Set the transfer payload a link may write before the transport
+ * moves on to the next link with pending transfers. Transfers are
+ * always only generated to fill the buffer passed to
+ * ::pn_transport_output, so a busy link cannot queue up more output
+ * than the caller drains. With a quantum, links also share that room
+ * in turns of at most this many bytes. A delivery cut short by the
+ * room or its turn is continued in later frames. Defaults to zero, in
+ * which case the link at the front keeps the room to itself.
+ *
+ * @param[in] transport the transport
+ * @param[in] quantum the output quantum in bytes, zero for unlimited
+ */
+void pn_transport_set_output_quantum(pn_transport_t *transport, size_t quantum);
 /* timeout of zero means "no timeout" */
 pn_millis_t pn_transport_get_idle_timeout(pn_transport_t *transport);
 void pn_transport_set_idle_timeout(pn_transport_t *transport, pn_millis_t timeout);
 pn_millis_t pn_transport_get_remote_idle_timeout(pn_transport_t *transport);
 uint64_t pn_transport_get_frames_output(const pn_transport_t *transport);
 uint64_t pn_transport_get_frames_input(const pn_transport_t *transport);
+
+/** Access the number of frames the transport keeps a record of.
+ *
+ * @param[in] transport the transport
+ * @return the number of records kept, zero if recording is off
+ */
+size_t pn_transport_get_trace_records(pn_transport_t *transport);
+
+/** Set the number of most recent frames the transport keeps a record
+ * of. Each record is a small fixed size summary of a frame, its time,
+ * channel, performative, sizes and key fields such as handle and
+ * delivery id, written without any formatting so recording can stay on
+ * in production. The number is rounded up to a power of two, zero
+ * turns recording off, and any records already kept are discarded.
+ * Defaults to PN_TRACE_RECORDS, or to zero if a new transport cannot
+ * allocate that many.
+ *
+ * If the PN_TRACE_DUMP environment variable names a file, the records
+ * are appended to it the first time the transport fails.
+ *
+ * @param[in] transport the transport
+ * @param[in] records the number of records to keep
+ * @return zero on success or an error code
+ */
+int pn_transport_set_trace_records(pn_transport_t *transport, size_t records);
+
+/** Write the recorded frames, oldest first, in the binary format
+ * decoded by proton-dump. A dump takes 16 bytes plus 32 bytes per
+ * record.
+ *
+ * @param[in] transport the transport
+ * @param[out] bytes the buffer to write the dump to
+ * @param[in] size the size of the buffer
+ * @return the number of bytes written, or PN_OVERFLOW if the buffer is
+ * too small
+ */
+ssize_t pn_transport_trace_dump(pn_transport_t *transport, char *bytes, size_t size);
 void pn_transport_free(pn_transport_t *transport);
 
 // session
@@ -317,6 +467,57 @@ void pn_session_free(pn_session_t *session);
 void *pn_session_get_context(pn_session_t *session);
 void pn_session_set_context(pn_session_t *session, void *context);
 
+/** Access the maximum number of unsettled incoming deliveries the
+ * session will track, this is the incoming window advertised to the
+ * peer. Defaults to PN_SESSION_WINDOW.
+ *
+ * @param[in] session the session
+ * @return the incoming capacity in deliveries
+ */
+size_t pn_session_get_incoming_capacity(pn_session_t *session);
+
+/** Set the maximum number of unsettled incoming deliveries the
+ * session will track. Storage grows on demand, so a large capacity
+ * costs nothing until it is used.
+ *
+ * @param[in] session the session
+ * @param[in] capacity the incoming capacity in deliveries
+ */
+void pn_session_set_incoming_capacity(pn_session_t *session, size_t capacity);
+
+/** Access the maximum number of unsettled outgoing deliveries the
+ * session will track. Defaults to PN_SESSION_WINDOW.
+ *
+ * @param[in] session the session
+ * @return the outgoing capacity in deliveries
+ */
+size_t pn_session_get_outgoing_capacity(pn_session_t *session);
+
+/** Set the maximum number of unsettled outgoing deliveries the
+ * session will track.
+ *
+ * @param[in] session the session
+ * @param[in] capacity the outgoing capacity in deliveries
+ */
+void pn_session_set_outgoing_capacity(pn_session_t *session, size_t capacity);
+
+/** Access the incoming window low water mark of a session.
+ *
+ * @param[in] session the session
+ * @return the low water mark in deliveries
+ */
+size_t pn_session_get_incoming_low_water(pn_session_t *session);
+
+/** Set the incoming window low water mark of a session. Once the
+ * window the peer holds falls to this mark the session reopens it with
+ * a single flow update per pass of the engine, rather than waiting for
+ * the window to be exhausted. Defaults to PN_SESSION_WINDOW/2.
+ *
+ * @param[in] session the session
+ * @param[in] low_water the low water mark in deliveries
+ */
+void pn_session_set_incoming_low_water(pn_session_t *session, size_t low_water);
+
 // link
 pn_link_t *pn_sender(pn_session_t *session, const char *name);
 pn_link_t *pn_receiver(pn_session_t *session, const char *name);
@@ -336,6 +537,67 @@ int pn_link_credit(pn_link_t *link);
 int pn_link_queued(pn_link_t *link);
 int pn_link_available(pn_link_t *link);
 
+/** Access the settlement mode a link requests for its sender.
+ * Defaults to PN_SND_MIXED.
+ *
+ * @param[in] link the link
+ * @return the local sender settle mode
+ */
+pn_snd_settle_mode_t pn_link_get_snd_settle_mode(pn_link_t *link);
+
+/** Set the sender settlement mode sent in the attach of a link. When
+ * a sender attaches with PN_SND_SETTLED every delivery is sent
+ * pre-settled: neither end tracks it in the session's unsettled state
+ * and no disposition is ever exchanged for it. The sender recycles a
+ * delivery as soon as its transfer has been written and it has been
+ * settled locally, the receiver as soon as it is settled after being
+ * read. Must be set before the link is opened.
+ *
+ * @param[in] link the link
+ * @param[in] mode the sender settle mode
+ */
+void pn_link_set_snd_settle_mode(pn_link_t *link, pn_snd_settle_mode_t mode);
+
+/** Access the sender settlement mode requested by the peer.
+ *
+ * @param[in] link the link
+ * @return the remote sender settle mode, PN_SND_MIXED until attached
+ */
+pn_snd_settle_mode_t pn_link_remote_snd_settle_mode(pn_link_t *link);
+
+/** Access the priority of a link.
+ *
+ * @param[in] link the link
+ * @return the link priority
+ */
+uint8_t pn_link_get_priority(pn_link_t *link);
+
+/** Set the priority of a link. When the connection uses
+ * PN_SCHED_PRIORITY, transfers of a link are written before those of
+ * any link with a lower priority. Defaults to zero.
+ *
+ * @param[in] link the link
+ * @param[in] priority the link priority
+ */
+void pn_link_set_priority(pn_link_t *link, uint8_t priority);
+
+/** Access the weight of a link.
+ *
+ * @param[in] link the link
+ * @return the link weight
+ */
+uint32_t pn_link_get_weight(pn_link_t *link);
+
+/** Set the weight of a link. When the connection uses
+ * PN_SCHED_WEIGHTED, links with pending transfers take turns, each
+ * writing as many deliveries per turn as its weight. Defaults to one,
+ * a weight of zero is ignored.
+ *
+ * @param[in] link the link
+ * @param[in] weight the link weight
+ */
+void pn_link_set_weight(pn_link_t *link, uint32_t weight);
+
 int pn_link_unsettled(pn_link_t *link);
 pn_delivery_t *pn_unsettled_head(pn_link_t *link);
 pn_delivery_t *pn_unsettled_next(pn_delivery_t *delivery);
@@ -349,12 +611,108 @@ void pn_link_set_context(pn_link_t *link, void *context);
 // sender
 void pn_link_offered(pn_link_t *sender, int credit);
 ssize_t pn_link_send(pn_link_t *sender, const char *bytes, size_t n);
+
+/** Send bytes on the current delivery of a sender without copying
+ * them. The engine refers to the caller's memory until the bytes have
+ * been framed into the transport's output, then calls release with the
+ * given context, after which the caller may reuse or free the memory.
+ * If the delivery is discarded first, release is called when it is.
+ * Bytes sent with ::pn_link_send and ::pn_link_send_ref go out in the
+ * order they were given.
+ *
+ * @param[in] sender the sender
+ * @param[in] bytes the bytes to send, which must remain valid and
+ *                  unchanged until released
+ * @param[in] n the number of bytes
+ * @param[in] release called once the bytes are no longer referenced,
+ *                    may be NULL
+ * @param[in] context passed to release
+ * @return n, or an error code, PN_EOS if there is no current delivery;
+ *         release is not called on error and the caller keeps the bytes
+ */
+ssize_t pn_link_send_ref(pn_link_t *sender, const char *bytes, size_t n,
+                         void (*release)(void *context), void *context);
 void pn_link_drained(pn_link_t *sender);
 //void pn_link_abort(pn_sender_t *sender);
 
 // receiver
 void pn_link_flow(pn_link_t *receiver, int credit);
 void pn_link_drain(pn_link_t *receiver, int credit);
+
+/** Access the credit low water mark of a receiver.
+ *
+ * @param[in] receiver the receiver
+ * @return the low water mark, negative if disabled
+ */
+int pn_link_get_credit_low_water(pn_link_t *receiver);
+
+/** Set the credit low water mark of a receiver. Credit granted with
+ * pn_link_flow() is held back until the credit the sender holds falls
+ * to this mark and is then issued in a single flow update. A negative
+ * mark, the default, issues credit as soon as it is granted.
+ *
+ * @param[in] receiver the receiver
+ * @param[in] low_water the low water mark
+ */
+void pn_link_set_credit_low_water(pn_link_t *receiver, int low_water);
+
+/** Access the credit window of a receiver.
+ *
+ * @param[in] receiver the receiver
+ * @return the credit window, zero if disabled
+ */
+int pn_link_get_credit_window(pn_link_t *receiver);
+
+/** Have the engine manage the credit of a receiver. Whenever
+ * pn_link_advance() leaves the receiver with credit at or below
+ * low_water, the credit is topped back up to window and issued on the
+ * next pass of the engine. A window of zero disables this.
+ *
+ * @param[in] receiver the receiver
+ * @param[in] window the credit to maintain
+ * @param[in] low_water the credit at which to replenish
+ */
+void pn_link_set_credit_window(pn_link_t *receiver, int window, int low_water);
+
+/** Access the number of bytes a receiver has buffered that have not
+ * yet been read with ::pn_link_recv, including those of deliveries
+ * that are still partial.
+ *
+ * @param[in] receiver the receiver
+ * @return the number of unread bytes
+ */
+size_t pn_link_buffered(pn_link_t *receiver);
+
+/** Access the byte budget of a receiver.
+ *
+ * @param[in] receiver the receiver
+ * @return the byte budget, zero if unbounded
+ */
+size_t pn_link_get_max_buffered(pn_link_t *receiver);
+
+/** Bound the bytes a receiver buffers ahead of the application. While
+ * the unread bytes of the receiver exceed the budget the engine grants
+ * no session window, so the peer stops sending even in the middle of a
+ * delivery. The window is further limited to the number of frames
+ * that fit within the budget left across the budgeted receivers of the
+ * session, so together they buffer at most one frame beyond their
+ * combined budgets. Large deliveries can then be streamed by reading
+ * the current delivery with ::pn_link_recv while it is still partial.
+ *
+ * Memory is only bounded if a max frame size has been set on the
+ * transport with ::pn_transport_set_max_frame. Without one the window
+ * is opened a single frame at a time, but the peer may put a whole
+ * delivery of any size into that frame.
+ *
+ * Since the window is shared, a receiver over budget stalls every link
+ * on its session, and a receiver that only reads complete deliveries
+ * must not be given a budget smaller than its largest delivery.
+ * Defaults to zero, meaning unbounded.
+ *
+ * @param[in] receiver the receiver
+ * @param[in] max_buffered the byte budget, zero for none
+ */
+void pn_link_set_max_buffered(pn_link_t *receiver, size_t max_buffered);
 ssize_t pn_link_recv(pn_link_t *receiver, char *bytes, size_t n);
 
 // terminus
@@ -399,6 +757,24 @@ void pn_delivery_dump(pn_delivery_t *delivery);
 void *pn_delivery_get_context(pn_delivery_t *delivery);
 void pn_delivery_set_context(pn_delivery_t *delivery, void *context);
 
+/** Access the priority of a delivery.
+ *
+ * @param[in] delivery the delivery
+ * @return the delivery priority
+ */
+uint8_t pn_delivery_get_priority(pn_delivery_t *delivery);
+
+/** Set the priority of a delivery, normally that of the message it
+ * carries. Used when the connection schedules with
+ * PN_SCHED_MESSAGE_PRIORITY, where a delivery waits behind earlier
+ * deliveries on its link and so lends them its priority. Defaults to
+ * PN_DEFAULT_PRIORITY.
+ *
+ * @param[in] delivery the delivery
+ * @param[in] priority the delivery priority
+ */
+void pn_delivery_set_priority(pn_delivery_t *delivery, uint8_t priority);
+
 pn_condition_t *pn_connection_condition(pn_connection_t *connection);
 pn_condition_t *pn_connection_remote_condition(pn_connection_t *connection);
 
@@ -23,6 +23,9 @@
  */
 
 #include <proton/message.h>
+#include <proton/driver.h>
+#include <proton/driver_extras.h>
+#include <proton/ssl.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -130,6 +133,39 @@ int pn_messenger_set_trusted_certificates(pn_messenger_t *messenger, const char
  */
 const char *pn_messenger_get_trusted_certificates(pn_messenger_t *messenger);
 
+/** Sets whether a Messenger resumes SSL sessions. When on, outgoing
+ * amqps connections to the same host and port as the same user may
+ * resume the SSL session of an earlier connection rather than
+ * negotiate a new one. Sessions are only shared while the
+ * certificates of the Messenger stay the same. Off by default.
+ *
+ * @param[in] messenger the messenger
+ * @param[in] resume true to resume SSL sessions
+ *
+ * @return an error code or zero if there is no error
+ */
+int pn_messenger_set_ssl_resume(pn_messenger_t *messenger, bool resume);
+
+/** Retrieves whether a Messenger resumes SSL sessions.
+ *
+ * @param[in] messenger the messenger
+ *
+ * @return true if the messenger resumes SSL sessions
+ */
+bool pn_messenger_get_ssl_resume(pn_messenger_t *messenger);
+
+/** Checks whether the SSL session of a Messenger's outgoing connection
+ * was resumed.
+ *
+ * @param[in] messenger the messenger
+ * @param[in] address an amqps address the messenger is connected to
+ *
+ * @return the resume status of the connection to the address, or
+ *         PN_SSL_RESUME_UNKNOWN if there is no such connection
+ */
+pn_ssl_resume_status_t pn_messenger_ssl_resume_status(pn_messenger_t *messenger,
+                                                      const char *address);
+
 /** Sets the timeout for a Messenger. A negative timeout means
  * infinite.
  *
@@ -148,6 +184,29 @@ int pn_messenger_set_timeout(pn_messenger_t *messenger, int timeout);
  */
 int pn_messenger_get_timeout(pn_messenger_t *messenger);
 
+/** Sets whether a Messenger blocks. A messenger is blocking by
+ * default. A non-blocking messenger never waits: ::pn_messenger_send,
+ * ::pn_messenger_recv and ::pn_messenger_stop do whatever I/O is
+ * ready and return PN_INPROGRESS if they could not finish, in which
+ * case the application drives the messenger on with
+ * ::pn_messenger_work, typically from its own event loop using
+ * ::pn_messenger_fds and ::pn_messenger_deadline.
+ *
+ * @param[in] messenger the messenger
+ * @param[in] blocking true for blocking, false for non-blocking
+ *
+ * @return an error code or zero if there is no error
+ */
+int pn_messenger_set_blocking(pn_messenger_t *messenger, bool blocking);
+
+/** Retrieves whether a Messenger blocks.
+ *
+ * @param[in] messenger the messenger
+ *
+ * @return true if the messenger is blocking
+ */
+bool pn_messenger_is_blocking(pn_messenger_t *messenger);
+
 /** Frees a Messenger.
  *
  * @param[in] messenger the messenger to free, no longer valid on
@@ -262,6 +321,55 @@ int pn_messenger_start(pn_messenger_t *messenger);
  */
 int pn_messenger_stop(pn_messenger_t *messenger);
 
+/** Checks whether a messenger has finished stopping, that is whether
+ * all its connections have been closed.
+ *
+ * @param[in] messenger the messenger
+ *
+ * @return true if the messenger is stopped
+ */
+bool pn_messenger_stopped(pn_messenger_t *messenger);
+
+/** Waits for I/O for up to timeout milliseconds and processes
+ * whatever is ready. A timeout of zero never waits, a negative timeout
+ * waits until something happens.
+ *
+ * @param[in] messenger the messenger
+ * @param[in] timeout the maximum time to wait, in milliseconds
+ *
+ * @return an error code or zero on success
+ * @see error.h
+ */
+int pn_messenger_work(pn_messenger_t *messenger, int timeout);
+
+/** Gets the descriptors a messenger needs watched, so that an
+ * application can wait on them in its own event loop and call
+ * ::pn_messenger_work with a timeout of zero when one is ready.
+ * Outstanding local changes such as puts are pushed to the transports
+ * first, so the events asked for are current. The set changes as
+ * connections come and go, so it should be fetched again after every
+ * call that does work.
+ *
+ * @param[in] messenger the messenger
+ * @param[out] fds filled in with up to capacity descriptors
+ * @param[in] capacity the number of entries in fds
+ *
+ * @return the number of descriptors, which may exceed capacity, in
+ *         which case only the first capacity are filled in
+ */
+size_t pn_messenger_fds(pn_messenger_t *messenger, pn_fd_t *fds, size_t capacity);
+
+/** Gets the time by which ::pn_messenger_work must be called even if
+ * none of the descriptors are ready, for instance to keep idle
+ * connections alive.
+ *
+ * @param[in] messenger the messenger
+ *
+ * @return the deadline in milliseconds since the epoch, zero if there
+ *         is none
+ */
+pn_timestamp_t pn_messenger_deadline(pn_messenger_t *messenger);
+
 /** Subscribes a messenger to messages from the specified source.
  *
  * @param[in] messenger the messenger to subscribe
@@ -285,6 +393,51 @@ void pn_subscription_set_context(pn_subscription_t *sub, void *context);
  */
 int pn_messenger_put(pn_messenger_t *messenger, pn_message_t *msg);
 
+/** Puts an array of messages on the outgoing message queue for a
+ * messenger. Consecutive messages with the same address share a
+ * single address lookup, each message is encoded straight into memory
+ * its delivery takes over rather than being copied, and once all of
+ * them are queued every connection is processed once to push out the
+ * resulting transfers.
+ *
+ * If an error occurs, the messages before the one that failed have
+ * been queued, and ::pn_messenger_outgoing_tracker identifies the last
+ * of them.
+ *
+ * @param[in] messenger the messenger
+ * @param[in] messages the messages to put on the outgoing queue
+ * @param[in] count the number of messages
+ *
+ * @return an error code or zero on success
+ * @see error.h
+ */
+int pn_messenger_put_batch(pn_messenger_t *messenger, pn_message_t **messages, size_t count);
+
+/** Puts a message on the outgoing message queue for a messenger from
+ * any thread. Unlike every other messenger function this one may be
+ * called concurrently with the thread that runs the messenger, and
+ * from any number of threads at once. The message is encoded on the
+ * calling thread and handed to the messenger without locking, and the
+ * messenger's driver is woken so that the thread running it gives the
+ * message its delivery the next time it sends, receives or works.
+ * Until then the message is not counted by ::pn_messenger_outgoing and
+ * has no tracker.
+ *
+ * Failures are only reported by the return code, since the
+ * messenger's error belongs to the thread running it. A failure to
+ * resolve the address is reported later by the call that takes the
+ * message over.
+ *
+ * @param[in] messenger the messenger, which must not be freed while
+ *                      this is in progress
+ * @param[in] msg the message, which must not be used by another
+ *                thread for the duration of the call
+ *
+ * @return an error code or zero on success
+ * @see error.h
+ */
+int pn_messenger_put_async(pn_messenger_t *messenger, pn_message_t *msg);
+
 /** Gets the last known remote state of the delivery associated with
  * the given tracker.
  *
@@ -351,6 +504,21 @@ int pn_messenger_recv(pn_messenger_t *messenger, int n);
  */
 int pn_messenger_get(pn_messenger_t *messenger, pn_message_t *msg);
 
+/** Gets up to count messages from the head of the incoming message
+ * queue of a messenger. The incoming tracker afterwards identifies the
+ * last message fetched.
+ *
+ * @param[in] messenger the messenger
+ * @param[out] messages upon return the first messages contain those
+ *                      fetched, entries may be NULL to discard them
+ * @param[in] count the maximum number of messages to fetch
+ *
+ * @return the number of messages fetched, PN_EOS if the queue is
+ *         empty, or an error code
+ * @see error.h
+ */
+int pn_messenger_get_batch(pn_messenger_t *messenger, pn_message_t **messages, size_t count);
+
 /** Gets the tracker for the message most recently fetched by
  * pn_messenger_get.
  *
@@ -0,0 +1,132 @@
+#ifndef PROTON_METRICS_H
+#define PROTON_METRICS_H 1
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <proton/engine.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @file
+ * API for the Engine Metrics.
+ *
+ * The engine counts what passes over each link and times how long
+ * deliveries and sessions spend waiting. Intervals are taken from a
+ * monotonic clock and reported in microseconds. The snapshot functions
+ * copy the current values into a struct owned by the caller, so an
+ * exporter can scrape them as often as it likes.
+ *
+ * Collection is only compiled into the library when it is built with
+ * ENABLE_METRICS, otherwise the snapshot functions fail with PN_ERR.
+ */
+
+#define PN_HISTOGRAM_BUCKETS (32)
+
+/** A latency histogram with power of two buckets. Bucket zero counts
+ * samples of zero, bucket i counts samples of at least 2^(i-1) and
+ * less than 2^i microseconds, and the last bucket also counts every
+ * longer sample.
+ */
+typedef struct {
+  uint64_t count;   /**< number of samples */
+  uint64_t sum;     /**< sum of all samples in microseconds */
+  uint64_t max;     /**< longest sample in microseconds */
+  uint64_t buckets[PN_HISTOGRAM_BUCKETS];
+} pn_histogram_t;
+
+/** Metrics of a single link. */
+typedef struct {
+  uint64_t deliveries_sent;     /**< deliveries completely written */
+  uint64_t deliveries_received; /**< deliveries completely read */
+  uint64_t bytes_sent;          /**< transfer payload written */
+  uint64_t bytes_received;      /**< transfer payload read */
+  uint64_t credit_starved;      /**< microseconds a sender had deliveries waiting for credit */
+  size_t unsettled;             /**< deliveries not yet settled locally */
+  pn_histogram_t send_latency;   /**< from creation to the first transfer frame */
+  pn_histogram_t settle_latency; /**< from the first transfer frame to the peer settling */
+} pn_link_metrics_t;
+
+/** Metrics of a single session. */
+typedef struct {
+  uint64_t window_stalled; /**< microseconds transfers waited for the peer's incoming window */
+} pn_session_metrics_t;
+
+/** Metrics of a connection and its transport. */
+typedef struct {
+  uint64_t bytes_input;
+  uint64_t bytes_output;
+  uint64_t frames_input;
+  uint64_t frames_output;
+  uint64_t window_stalled;  /**< the window_stalled of all sessions added up */
+  pn_link_metrics_t links;  /**< the metrics of all links added up */
+} pn_connection_metrics_t;
+
+/** Estimate a percentile of a histogram.
+ *
+ * The estimate is the upper bound of the bucket holding the
+ * percentile, so it is never more than twice the true value, and it
+ * never exceeds the longest sample.
+ *
+ * @param[in] histogram the histogram
+ * @param[in] percentile the percentile, from 0 to 100
+ * @return the estimate in microseconds, zero if there are no samples
+ */
+uint64_t pn_histogram_percentile(const pn_histogram_t *histogram, double percentile);
+
+/** Take a snapshot of the metrics of a link.
+ *
+ * An interval that is still in progress, such as a sender currently
+ * without credit, is counted up to the time of the snapshot.
+ *
+ * @param[in] link the link
+ * @param[out] metrics filled in with the link's metrics
+ * @return zero on success, PN_ERR if metrics are not compiled in
+ */
+int pn_link_metrics(pn_link_t *link, pn_link_metrics_t *metrics);
+
+/** Take a snapshot of the metrics of a session.
+ *
+ * @param[in] session the session
+ * @param[out] metrics filled in with the session's metrics
+ * @return zero on success, PN_ERR if metrics are not compiled in
+ */
+int pn_session_metrics(pn_session_t *session, pn_session_metrics_t *metrics);
+
+/** Take a snapshot of the metrics of a connection, adding up those of
+ * all its sessions and links. The byte and frame counts are those of
+ * the bound transport, if any.
+ *
+ * @param[in] connection the connection
+ * @param[out] metrics filled in with the connection's metrics
+ * @return zero on success, PN_ERR if metrics are not compiled in
+ */
+int pn_connection_metrics(pn_connection_t *connection, pn_connection_metrics_t *metrics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* metrics.h */
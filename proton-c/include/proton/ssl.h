@@ -207,6 +207,37 @@ int pn_ssl_domain_set_peer_authentication(pn_ssl_domain_t *domain,
  */
 int pn_ssl_domain_allow_unsecured_client(pn_ssl_domain_t *domain);
 
+/** Statistics of the session cache of a client domain. */
+typedef struct {
+  uint64_t hits;        /**< lookups that found a session to resume */
+  uint64_t misses;      /**< lookups that found none, or only an expired one */
+  uint64_t evictions;   /**< sessions dropped to stay within the cache size */
+  uint64_t expirations; /**< sessions dropped because they had expired */
+  size_t size;          /**< sessions currently cached */
+} pn_ssl_cache_stats_t;
+
+/** Bound the number of sessions a client domain caches for resumption.
+ *
+ * Sessions are saved under the session_id given to ::pn_ssl_init when
+ * a connection shuts down. Once the cache is full, saving a session
+ * evicts the least recently saved one. A size of zero disables the
+ * cache. Expired sessions are dropped when they are looked up, and
+ * from the old end of the cache whenever a session is saved.
+ *
+ * @param[in] domain the client domain
+ * @param[in] size the maximum number of sessions to cache
+ * @return 0 on success
+ */
+int pn_ssl_domain_set_session_cache_size(pn_ssl_domain_t *domain, size_t size);
+
+/** Take a snapshot of the statistics of a domain's session cache.
+ *
+ * @param[in] domain the domain
+ * @param[out] stats filled in with the cache statistics
+ * @return 0 on success
+ */
+int pn_ssl_domain_get_session_cache_stats(pn_ssl_domain_t *domain, pn_ssl_cache_stats_t *stats);
+
 /** Create a new SSL session object associated with a transport.
  *
  * A transport must have an SSL object in order to "speak" SSL over its connection. This
@@ -271,6 +271,16 @@ pn_bytes_t pn_buffer_bytes(pn_buffer_t *buf)
   }
 }
 
+// the content up to where it wraps around, without moving it
+pn_bytes_t pn_buffer_head_bytes(pn_buffer_t *buf)
+{
+  if (buf && buf->size) {
+    return pn_bytes(pn_buffer_head_size(buf), buf->bytes + pn_buffer_head(buf));
+  } else {
+    return pn_bytes(0, NULL);
+  }
+}
+
 int pn_buffer_print(pn_buffer_t *buf)
 {
   printf("pn_buffer(\"");
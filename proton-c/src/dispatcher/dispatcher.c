@@ -28,6 +28,7 @@
 #include "dispatcher.h"
 #include "protocol.h"
 #include "../util.h"
+#include "../platform.h"
 
 pn_dispatcher_t *pn_dispatcher(uint8_t frame_type, void *context)
 {
@@ -56,6 +57,8 @@ pn_dispatcher_t *pn_dispatcher(uint8_t frame_type, void *context)
   disp->halt = false;
   disp->batch = true;
 
+  pn_recorder_init(&disp->recorder);
+
   return disp;
 }
 
@@ -67,6 +70,7 @@ void pn_dispatcher_free(pn_dispatcher_t *disp)
     pn_data_free(disp->output_args);
     pn_buffer_free(disp->frame);
     free(disp->output);
+    pn_recorder_tini(&disp->recorder);
     free(disp);
   }
 }
@@ -80,6 +84,72 @@ void pn_dispatcher_action(pn_dispatcher_t *disp, uint8_t code, const char *name,
 
 typedef enum {IN, OUT} pn_dir_t;
 
+// pulls the fields worth keeping out of a performative, only transfers
+// are recorded often enough for this to matter and outgoing transfers
+// are recorded from what the caller passed in instead
+static void pn_record_keys(pn_frame_record_t *record, pn_data_t *args)
+{
+  bool present[3] = {true, true, true};
+  uint32_t *key = record->key;
+  uint32_t skip;
+  uint16_t channel = 0;
+  bool init, flag = false, settled = false, more = false;
+
+  switch (record->code) {
+  case BEGIN:
+    pn_data_scan(args, "D.[?HII]", &present[0], &channel, &key[1], &key[2]);
+    key[0] = channel;
+    break;
+  case ATTACH:
+    pn_data_scan(args, "D.[.Io]", &key[0], &flag);
+    key[1] = flag;
+    present[2] = false;
+    break;
+  case FLOW:
+    pn_data_scan(args, "D.[?IIII?I?II]", &init, &skip, &skip, &skip, &skip,
+                 &present[0], &key[0], &present[1], &key[1], &key[2]);
+    break;
+  case TRANSFER:
+    pn_data_scan(args, "D.[I?I..oo]", &key[0], &present[1], &key[1], &settled, &more);
+    present[2] = false;
+    break;
+  case DISPOSITION:
+    pn_data_scan(args, "D.[oI?Io]", &flag, &key[0], &present[1], &key[1], &settled);
+    key[2] = flag;
+    break;
+  case DETACH:
+    pn_data_scan(args, "D.[Io]", &key[0], &flag);
+    key[1] = flag;
+    present[2] = false;
+    break;
+  default:
+    present[0] = present[1] = present[2] = false;
+    break;
+  }
+
+  for (int k = 0; k < 3; k++) {
+    if (present[k]) record->flags |= PN_RECORD_KEY0 << k;
+    else key[k] = 0;
+  }
+  if (settled) record->flags |= PN_RECORD_SETTLED;
+  if (more) record->flags |= PN_RECORD_MORE;
+}
+
+static pn_frame_record_t *pn_record(pn_dispatcher_t *disp, uint16_t ch, pn_dir_t dir,
+                                    uint8_t code, size_t size, size_t payload)
+{
+  pn_frame_record_t *record = pn_recorder_next(&disp->recorder);
+  if (record) {
+    record->time = pn_i_clock();
+    record->size = size;
+    record->payload = payload;
+    record->channel = ch;
+    record->code = code;
+    record->flags = dir == OUT ? PN_RECORD_OUT : 0;
+  }
+  return record;
+}
+
 static void pn_do_trace(pn_dispatcher_t *disp, uint16_t ch, pn_dir_t dir,
                         pn_data_t *args, const char *payload, size_t size)
 {
@@ -116,6 +186,8 @@ void pn_dispatcher_trace(pn_dispatcher_t *disp, uint16_t ch, char *fmt, ...)
 int pn_dispatch_frame(pn_dispatcher_t *disp, pn_frame_t frame)
 {
   if (frame.size == 0) { // ignore null frames
+    pn_frame_record_t *record = pn_record(disp, frame.channel, IN, 0, 0, 0);
+    if (record) pn_record_keys(record, NULL);
     if (disp->trace & PN_TRACE_FRM)
       pn_dispatcher_trace(disp, frame.channel, "<- (EMPTY FRAME)\n");
     return 0;
@@ -149,6 +221,9 @@ int pn_dispatch_frame(pn_dispatcher_t *disp, pn_frame_t frame)
   if (disp->size)
     disp->payload = frame.payload + dsize;
 
+  pn_frame_record_t *record = pn_record(disp, frame.channel, IN, code, frame.size, disp->size);
+  if (record) pn_record_keys(record, disp->args);
+
   pn_do_trace(disp, disp->channel, IN, disp->args, disp->payload, disp->size);
 
   pn_action_t *action = disp->actions[code];
@@ -269,6 +344,14 @@ int pn_post_frame(pn_dispatcher_t *disp, uint16_t ch, const char *fmt, ...)
     return PN_ERR;
   }
 
+  if (disp->recorder.capacity) {
+    uint64_t code64;
+    bool scanned;
+    pn_data_scan(disp->output_args, "D?L.", &scanned, &code64);
+    pn_frame_record_t *record = pn_record(disp, ch, OUT, scanned ? code64 : 0, wr, 0);
+    pn_record_keys(record, disp->output_args);
+  }
+
   pn_frame_t frame = {disp->frame_type};
   frame.channel = ch;
   frame.payload = buf.start;
@@ -301,15 +384,20 @@ ssize_t pn_dispatcher_output(pn_dispatcher_t *disp, char *bytes, size_t size)
 }
 
 
+// writes at most frame_limit frames of the pending payload, whatever
+// does not fit is left in output_size for the caller to resend
 int pn_post_transfer_frame(pn_dispatcher_t *disp, uint16_t ch,
                            uint32_t handle,
                            pn_sequence_t id,
                            const pn_bytes_t *tag,
                            uint32_t message_format,
                            bool settled,
-                           bool more)
+                           bool more,
+                           pn_sequence_t frame_limit,
+                           pn_sequence_t *frame_count)
 {
   bool more_flag = more;
+  *frame_count = 0;
 
   // create preformatives, assuming 'more' flag need not change
 
@@ -371,6 +459,16 @@ int pn_post_transfer_frame(pn_dispatcher_t *disp, uint16_t ch,
     disp->output_size -= available;
     buf.size += available;
 
+    pn_frame_record_t *record = pn_record(disp, ch, OUT, TRANSFER, buf.size, available);
+    if (record) {
+      record->key[0] = handle;
+      record->key[1] = id;
+      record->key[2] = 0;
+      record->flags |= PN_RECORD_KEY0 | (PN_RECORD_KEY0 << 1);
+      if (settled) record->flags |= PN_RECORD_SETTLED;
+      if (more_flag) record->flags |= PN_RECORD_MORE;
+    }
+
     pn_frame_t frame = {disp->frame_type};
     frame.channel = ch;
     frame.payload = buf.start;
@@ -389,7 +487,8 @@ int pn_post_transfer_frame(pn_dispatcher_t *disp, uint16_t ch,
       fprintf(stderr, "\"\n");
     }
     disp->available += n;
-  } while (disp->output_size > 0);
+    (*frame_count)++;
+  } while (disp->output_size > 0 && *frame_count < frame_limit);
 
   disp->output_payload = NULL;
   return 0;
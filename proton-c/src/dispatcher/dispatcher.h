@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <proton/buffer.h>
 #include <proton/codec.h>
+#include "recorder.h"
 
 typedef struct pn_dispatcher_t pn_dispatcher_t;
 
@@ -59,6 +60,7 @@ struct pn_dispatcher_t {
   bool batch;
   uint64_t output_frames_ct;
   uint64_t input_frames_ct;
+  pn_recorder_t recorder;
   char scratch[SCRATCH];
 };
 
@@ -79,5 +81,7 @@ int pn_post_transfer_frame(pn_dispatcher_t *disp,
                            const pn_bytes_t *delivery_tag,
                            uint32_t message_format,
                            bool settled,
-                           bool more);
+                           bool more,
+                           pn_sequence_t frame_limit,
+                           pn_sequence_t *frame_count);
 #endif /* dispatcher.h */
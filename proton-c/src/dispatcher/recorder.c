@@ -0,0 +1,225 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <proton/error.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recorder.h"
+#include "protocol.h"
+
+void pn_recorder_init(pn_recorder_t *recorder)
+{
+  recorder->records = NULL;
+  recorder->capacity = 0;
+  recorder->count = 0;
+}
+
+void pn_recorder_tini(pn_recorder_t *recorder)
+{
+  free(recorder->records);
+  pn_recorder_init(recorder);
+}
+
+int pn_recorder_resize(pn_recorder_t *recorder, size_t capacity)
+{
+  size_t rounded = 0;
+  if (capacity) {
+    rounded = 1;
+    while (rounded < capacity) rounded *= 2;
+  }
+
+  pn_frame_record_t *records = NULL;
+  if (rounded) {
+    records = (pn_frame_record_t *) malloc(rounded * sizeof(pn_frame_record_t));
+    if (!records) return PN_ERR;
+  }
+
+  free(recorder->records);
+  recorder->records = records;
+  recorder->capacity = rounded;
+  recorder->count = 0;
+  return 0;
+}
+
+size_t pn_recorder_size(pn_recorder_t *recorder)
+{
+  size_t records = recorder->count < recorder->capacity ? recorder->count : recorder->capacity;
+  return PN_RECORDER_HEADER + records * PN_RECORD_SIZE;
+}
+
+static char *pn_record_write16(char *bytes, uint16_t value)
+{
+  bytes[0] = 0xFF & (value >> 8);
+  bytes[1] = 0xFF & (value     );
+  return bytes + 2;
+}
+
+static char *pn_record_write32(char *bytes, uint32_t value)
+{
+  bytes = pn_record_write16(bytes, value >> 16);
+  return pn_record_write16(bytes, value);
+}
+
+static char *pn_record_write64(char *bytes, uint64_t value)
+{
+  bytes = pn_record_write32(bytes, value >> 32);
+  return pn_record_write32(bytes, value);
+}
+
+static uint16_t pn_record_read16(const char *bytes)
+{
+  return ((uint16_t) (uint8_t) bytes[0] << 8) | (uint8_t) bytes[1];
+}
+
+static uint32_t pn_record_read32(const char *bytes)
+{
+  return ((uint32_t) pn_record_read16(bytes) << 16) | pn_record_read16(bytes + 2);
+}
+
+static uint64_t pn_record_read64(const char *bytes)
+{
+  return ((uint64_t) pn_record_read32(bytes) << 32) | pn_record_read32(bytes + 4);
+}
+
+ssize_t pn_recorder_dump(pn_recorder_t *recorder, char *bytes, size_t size)
+{
+  size_t total = pn_recorder_size(recorder);
+  if (size < total) return PN_OVERFLOW;
+
+  size_t records = (total - PN_RECORDER_HEADER) / PN_RECORD_SIZE;
+  uint64_t first = recorder->count - records;
+
+  char *pos = bytes;
+  memmove(pos, PN_RECORDER_MAGIC, 4);
+  pos = pn_record_write16(pos + 4, PN_RECORDER_VERSION);
+  pos = pn_record_write16(pos, PN_RECORD_SIZE);
+  pos = pn_record_write32(pos, records);
+  pos = pn_record_write32(pos, first > UINT32_MAX ? UINT32_MAX : first);
+
+  for (uint64_t i = first; i < recorder->count; i++) {
+    pn_frame_record_t *record = &recorder->records[i & (recorder->capacity - 1)];
+    pos = pn_record_write64(pos, record->time);
+    pos = pn_record_write32(pos, record->size);
+    pos = pn_record_write32(pos, record->payload);
+    for (int k = 0; k < 3; k++) {
+      pos = pn_record_write32(pos, record->key[k]);
+    }
+    pos = pn_record_write16(pos, record->channel);
+    *pos++ = record->code;
+    *pos++ = record->flags;
+  }
+
+  return total;
+}
+
+ssize_t pn_recorder_read_header(const char *bytes, size_t available,
+                                size_t *records, uint32_t *overwritten)
+{
+  if (available < PN_RECORDER_HEADER) return 0;
+  if (memcmp(bytes, PN_RECORDER_MAGIC, 4) ||
+      pn_record_read16(bytes + 4) != PN_RECORDER_VERSION ||
+      pn_record_read16(bytes + 6) != PN_RECORD_SIZE) {
+    return PN_ERR;
+  }
+  *records = pn_record_read32(bytes + 8);
+  *overwritten = pn_record_read32(bytes + 12);
+  return PN_RECORDER_HEADER;
+}
+
+void pn_record_decode(pn_frame_record_t *record, const char *bytes)
+{
+  record->time = pn_record_read64(bytes);
+  record->size = pn_record_read32(bytes + 8);
+  record->payload = pn_record_read32(bytes + 12);
+  for (int k = 0; k < 3; k++) {
+    record->key[k] = pn_record_read32(bytes + 16 + 4*k);
+  }
+  record->channel = pn_record_read16(bytes + 28);
+  record->code = (uint8_t) bytes[30];
+  record->flags = (uint8_t) bytes[31];
+}
+
+const char *pn_record_name(uint8_t code)
+{
+  switch (code) {
+  case OPEN: return "open";
+  case BEGIN: return "begin";
+  case ATTACH: return "attach";
+  case FLOW: return "flow";
+  case TRANSFER: return "transfer";
+  case DISPOSITION: return "disposition";
+  case DETACH: return "detach";
+  case END: return "end";
+  case CLOSE: return "close";
+  case SASL_MECHANISMS: return "sasl-mechanisms";
+  case SASL_INIT: return "sasl-init";
+  case SASL_CHALLENGE: return "sasl-challenge";
+  case SASL_RESPONSE: return "sasl-response";
+  case SASL_OUTCOME: return "sasl-outcome";
+  case 0: return "empty";
+  default: return "unknown";
+  }
+}
+
+const char *pn_record_key_name(uint8_t code, int key)
+{
+  static const char *begin[] = {"remote-channel", "next-outgoing-id", "incoming-window"};
+  static const char *attach[] = {"handle", "role", NULL};
+  static const char *flow[] = {"handle", "delivery-count", "link-credit"};
+  static const char *transfer[] = {"handle", "delivery-id", NULL};
+  static const char *disposition[] = {"first", "last", "role"};
+  static const char *detach[] = {"handle", "closed", NULL};
+
+  if (key < 0 || key > 2) return NULL;
+  switch (code) {
+  case BEGIN: return begin[key];
+  case ATTACH: return attach[key];
+  case FLOW: return flow[key];
+  case TRANSFER: return transfer[key];
+  case DISPOSITION: return disposition[key];
+  case DETACH: return detach[key];
+  default: return NULL;
+  }
+}
+
+int pn_record_format(const pn_frame_record_t *record, uint64_t start, char *bytes, size_t size)
+{
+  uint64_t elapsed = record->time > start ? record->time - start : 0;
+  int n = snprintf(bytes, size, "[%" PRIu64 ".%06" PRIu64 "] %u %s %s",
+                   elapsed / 1000000, elapsed % 1000000, record->channel,
+                   record->flags & PN_RECORD_OUT ? "->" : "<-",
+                   pn_record_name(record->code));
+  for (int k = 0; k < 3; k++) {
+    const char *name = pn_record_key_name(record->code, k);
+    if (name && n >= 0 && (size_t) n < size && (record->flags & (PN_RECORD_KEY0 << k))) {
+      n += snprintf(bytes + n, size - n, " %s=%u", name, record->key[k]);
+    }
+  }
+  if (n >= 0 && (size_t) n < size) {
+    n += snprintf(bytes + n, size - n, " size=%u payload=%u%s%s", record->size, record->payload,
+                  record->flags & PN_RECORD_MORE ? " more" : "",
+                  record->flags & PN_RECORD_SETTLED ? " settled" : "");
+  }
+  if (n < 0) return PN_ERR;
+  return (size_t) n < size ? 0 : PN_OVERFLOW;
+}
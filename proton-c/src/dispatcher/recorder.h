@@ -0,0 +1,94 @@
+#ifndef _PROTON_RECORDER_H
+#define _PROTON_RECORDER_H 1
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the flight recorder keeps a fixed size record of each of the most
+// recent frames in a ring, overwriting the oldest, so that there is a
+// history to look at when something goes wrong without paying for
+// formatting every frame
+
+// a dump is a header followed by the records, oldest first, with
+// every field in network byte order:
+//
+//   header: magic "PNTR", u16 version, u16 record size, u32 records,
+//           u32 records overwritten before the dump
+//   record: u64 time (microseconds, monotonic), u32 frame body size,
+//           u32 payload size, u32 key[3], u16 channel, u8 performative,
+//           u8 flags
+
+#define PN_RECORDER_MAGIC ("PNTR")
+#define PN_RECORDER_VERSION (1)
+#define PN_RECORDER_HEADER (16)
+#define PN_RECORD_SIZE (32)
+
+#define PN_RECORD_OUT (1)      // sent rather than received
+#define PN_RECORD_MORE (2)     // transfer with more to follow
+#define PN_RECORD_SETTLED (4)  // transfer or disposition settled
+#define PN_RECORD_KEY0 (8)     // key[i] is present when PN_RECORD_KEY0 << i is set
+
+typedef struct {
+  uint64_t time;
+  uint32_t size;
+  uint32_t payload;
+  uint32_t key[3];
+  uint16_t channel;
+  uint8_t code;
+  uint8_t flags;
+} pn_frame_record_t;
+
+typedef struct {
+  pn_frame_record_t *records;
+  size_t capacity; // a power of two, zero when disabled
+  uint64_t count;  // records ever written
+} pn_recorder_t;
+
+void pn_recorder_init(pn_recorder_t *recorder);
+void pn_recorder_tini(pn_recorder_t *recorder);
+// rounds the capacity up to a power of two and drops what was recorded
+int pn_recorder_resize(pn_recorder_t *recorder, size_t capacity);
+size_t pn_recorder_size(pn_recorder_t *recorder);
+// the dump of the ring, or PN_OVERFLOW if it does not fit
+ssize_t pn_recorder_dump(pn_recorder_t *recorder, char *bytes, size_t size);
+
+// the slot for the next record, NULL when disabled
+static inline pn_frame_record_t *pn_recorder_next(pn_recorder_t *recorder)
+{
+  if (!recorder->capacity) return NULL;
+  return &recorder->records[recorder->count++ & (recorder->capacity - 1)];
+}
+
+// decoding dumps, for proton-dump
+ssize_t pn_recorder_read_header(const char *bytes, size_t available,
+                                size_t *records, uint32_t *overwritten);
+void pn_record_decode(pn_frame_record_t *record, const char *bytes);
+const char *pn_record_name(uint8_t code);
+// the names of the keys of a performative, NULL for unused keys
+const char *pn_record_key_name(uint8_t code, int key);
+int pn_record_format(const pn_frame_record_t *record, uint64_t start, char *bytes, size_t size);
+
+#endif /* recorder.h */
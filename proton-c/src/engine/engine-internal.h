@@ -24,29 +24,29 @@
 
 #include <proton/buffer.h>
 #include <proton/engine.h>
+#include <proton/metrics.h>
 #include <proton/types.h>
 #include "../dispatcher/dispatcher.h"
 #include "../util.h"
+#include "../idmap.h"
 
 typedef enum pn_endpoint_type_t {CONNECTION, SESSION, SENDER, RECEIVER} pn_endpoint_type_t;
 
 typedef struct pn_endpoint_t pn_endpoint_t;
 
-#define COND_NAME_MAX (256)
-#define COND_DESC_MAX (1024)
-
 struct pn_condition_t {
-  char name[COND_NAME_MAX];
-  char description[COND_DESC_MAX];
-  pn_data_t *info;
+  char *name;
+  char *description;
+  pn_data_t *info; // allocated on first use
 };
 
 struct pn_endpoint_t {
   pn_endpoint_type_t type;
   pn_state_t state;
   pn_error_t *error;
-  pn_condition_t condition;
-  pn_condition_t remote_condition;
+  // conditions are only allocated once accessed or received
+  pn_condition_t *condition;
+  pn_condition_t *remote_condition;
   pn_endpoint_t *endpoint_next;
   pn_endpoint_t *endpoint_prev;
   pn_endpoint_t *transport_next;
@@ -60,14 +60,33 @@ typedef struct {
   bool sent;
 } pn_delivery_state_t;
 
+// the ring starts small and grows on demand up to limit, which is the
+// window advertised to the peer
 typedef struct {
   pn_sequence_t next;
   size_t capacity;
+  size_t limit;
   size_t head;
   size_t size;
   pn_delivery_state_t *deliveries;
 } pn_delivery_buffer_t;
 
+// a pending disposition covering the deliveries first through last
+typedef struct {
+  pn_sequence_t first;
+  pn_sequence_t last;
+  uint64_t code;
+  bool settled;
+} pn_disp_range_t;
+
+// dispositions awaiting the next flush, kept as sorted, disjoint
+// ranges so that out of order updates still coalesce
+typedef struct {
+  pn_disp_range_t *ranges;
+  size_t capacity;
+  size_t size;
+} pn_disp_set_t;
+
 typedef struct {
   pn_link_t *link;
   // XXX: stop using negative numbers
@@ -91,22 +110,20 @@ typedef struct {
   pn_sequence_t outgoing_window;
   pn_link_state_t *links;
   size_t link_capacity;
-  pn_link_state_t **handles;
-  size_t handle_capacity;
-
-  uint64_t disp_code;
-  bool disp_settled;
-  bool disp_type;
-  pn_sequence_t disp_first;
-  pn_sequence_t disp_last;
-  bool disp;
-} pn_session_state_t;
+  pn_idmap_t handles;
 
-#define SCRATCH (1024)
+  // indexed by role, false for sender and true for receiver
+  pn_disp_set_t disp[2];
+} pn_session_state_t;
 
 #include <proton/sasl.h>
 #include <proton/ssl.h>
 
+// sched_index of a sender that is not in the heap, or that has been
+// set aside until the end of the current pass
+#define PN_SCHED_NONE ((size_t) -1)
+#define PN_SCHED_PARKED ((size_t) -2)
+
 struct pn_transport_t {
   ssize_t (*process_input)(pn_transport_t *, const char *, size_t);
   ssize_t (*process_output)(pn_transport_t *, char *, size_t);
@@ -126,7 +143,7 @@ struct pn_transport_t {
   pn_data_t *remote_desired_capabilities;
   uint32_t   local_max_frame;
   uint32_t   remote_max_frame;
-  pn_condition_t remote_condition;
+  pn_condition_t *remote_condition;
 
   /* dead remote detection */
   pn_millis_t local_idle_timeout;
@@ -141,15 +158,23 @@ struct pn_transport_t {
   pn_error_t *error;
   pn_session_state_t *sessions;
   size_t session_capacity;
-  pn_session_state_t **channels;
-  size_t channel_capacity;
-  char scratch[SCRATCH];
+  pn_idmap_t channels;
+  size_t output_room; // room the caller has for output this cycle
+  size_t output_given; // handed to the caller so far this cycle
+  size_t output_quantum; // transfer payload a link writes per turn, zero for no limit
+  uint64_t output_round; // links get a fresh turn each round
+  bool trace_dumped; // the records have been written to PN_TRACE_DUMP
 
   /* statistics */
   uint64_t bytes_input;
   uint64_t bytes_output;
+#ifdef PN_METRICS
+  uint64_t clock; // read once per input or output call
+#endif
 };
 
+typedef struct pn_delivery_slab_t pn_delivery_slab_t;
+
 struct pn_connection_t {
   pn_endpoint_t endpoint;
   pn_endpoint_t *endpoint_head;
@@ -164,6 +189,27 @@ struct pn_connection_t {
   pn_delivery_t *work_tail;
   pn_delivery_t *tpwork_head;
   pn_delivery_t *tpwork_tail;
+  pn_delivery_t *arrived_head; // incoming deliveries complete since pn_connection_arrived
+  pn_delivery_t *arrived_tail;
+  pn_delivery_slab_t *slab_head;
+  pn_delivery_slab_t *slab_tail;
+  pn_delivery_slab_t *empty_head; // slabs with no delivery in use
+  pn_delivery_slab_t *empty_tail;
+  pn_delivery_t *pool_head;
+  pn_delivery_t *pool_tail;
+  size_t pool_size;
+  size_t pool_max;
+  pn_sched_t scheduler;
+  uint64_t sched_vtime; // virtual time of the last delivery the weighted scheduler let start
+  // senders with transfers to write, a binary heap in scheduler order
+  pn_link_t **sched_heap;
+  size_t sched_capacity;
+  size_t sched_size;
+  pn_link_t *sched_parked; // senders set aside for the rest of a pass
+  uint64_t sched_seq; // stamps deliveries in the order they came up
+  int outgoing; // the queued deliveries of all open senders
+  int incoming; // the queued deliveries of all open receivers
+  int unresolved; // the unresolved deliveries of all open senders
   char *container;
   char *hostname;
   pn_data_t *offered_capabilities;
@@ -178,6 +224,16 @@ struct pn_session_t {
   size_t link_capacity;
   size_t link_count;
   size_t id;
+  size_t incoming_capacity;
+  size_t outgoing_capacity;
+  size_t incoming_low_water;
+  size_t budgeted;     // receivers with a byte budget
+  size_t over_budget;  // those at or over it
+  size_t budget_room;  // bytes left across those under it
+#ifdef PN_METRICS
+  uint64_t window_stalled;
+  uint64_t stalled_since; // zero while the window is open
+#endif
   void *context;
 };
 
@@ -205,43 +261,121 @@ struct pn_link_t {
   pn_delivery_t *unsettled_head;
   pn_delivery_t *unsettled_tail;
   pn_delivery_t *current;
-  pn_delivery_t *settled_head;
-  pn_delivery_t *settled_tail;
   size_t unsettled_count;
   pn_sequence_t available;
   pn_sequence_t credit;
   pn_sequence_t queued;
+  pn_sequence_t unresolved; // sender only, deliveries still waiting for an outcome
+  int credit_low_water; // receiver only, negative when disabled
+  int credit_window; // receiver only, zero when disabled
+  int credit_window_low;
+  size_t buffered; // receiver only, bytes received but not yet read
+  size_t max_buffered; // receiver only, zero when unbounded
+  pn_snd_settle_mode_t snd_settle_mode;
+  pn_snd_settle_mode_t remote_snd_settle_mode;
+  uint8_t priority;
+  uint32_t weight;
+  uint64_t sched_vtime; // virtual time the link's next delivery is due
+  uint64_t output_round; // round in which output_used was counted
+  size_t output_used; // transfer payload written this round
+  // deliveries with transfers to write, only used by the non FIFO schedulers
+  pn_delivery_t *sched_head;
+  pn_delivery_t *sched_tail;
+  size_t sched_index; // position in the connection's heap
+  pn_link_t *sched_parked_next;
+  uint8_t sched_priority; // highest priority among the scheduled deliveries
+  pn_delivery_t *sched_rank_head; // one scheduled delivery per priority, highest first
   bool drain;
   bool drained; // sender only
   size_t id;
+#ifdef PN_METRICS
+  pn_link_metrics_t metrics;
+  uint64_t starved_since; // zero while not waiting for credit
+#endif
+  void *context;
+};
+
+// caller owned bytes queued on a delivery by pn_link_send_ref
+typedef struct pn_delivery_ref_t pn_delivery_ref_t;
+
+struct pn_delivery_ref_t {
+  pn_delivery_ref_t *ref_next;
+  const char *bytes;
+  size_t size;
+  void (*release)(void *context);
   void *context;
 };
 
+// tags up to the AMQP maximum of 32 bytes are stored in the delivery itself
+#define PN_DELIVERY_TAG_INLINE (32)
+
 struct pn_delivery_t {
   pn_link_t *link;
-  pn_buffer_t *tag;
+  pn_delivery_slab_t *slab;
+  char *tag;
+  size_t tag_size;
+  char tag_inline[PN_DELIVERY_TAG_INLINE];
   int local_state;
   int remote_state;
   bool local_settled;
   bool remote_settled;
+  uint8_t priority;
   bool updated;
   bool settled; // tracks whether we're in the unsettled list or not
+  bool unresolved; // sent without an outcome or settlement from either end
   pn_delivery_t *unsettled_next;
   pn_delivery_t *unsettled_prev;
-  pn_delivery_t *settled_next;
-  pn_delivery_t *settled_prev;
+  pn_delivery_t *pool_next;
+  pn_delivery_t *pool_prev;
   pn_delivery_t *work_next;
   pn_delivery_t *work_prev;
   bool work;
   pn_delivery_t *tpwork_next;
   pn_delivery_t *tpwork_prev;
   bool tpwork;
-  pn_buffer_t *bytes;
+  pn_delivery_t *arrived_next;
+  pn_delivery_t *arrived_prev;
+  bool arrived;
+  // in the link's sched list rather than the connection's tpwork list
+  pn_delivery_t *sched_next;
+  pn_delivery_t *sched_prev;
+  uint64_t sched_seq;
+  // on the link's rank list, or ringed to the delivery of the same
+  // priority that is
+  pn_delivery_t *sched_rank_next;
+  pn_delivery_t *sched_rank_prev;
+  pn_delivery_t *sched_peer_next;
+  pn_delivery_t *sched_peer_prev;
+  bool sched_ranked;
+  bool sched;
+  pn_buffer_t *bytes; // allocated on first use
+  // sent after bytes, which only grows while no refs are queued
+  pn_delivery_ref_t *ref_head;
+  pn_delivery_ref_t *ref_tail;
+  size_t ref_size;
   bool done;
+#ifdef PN_METRICS
+  uint64_t created;
+  uint64_t first_sent; // zero until the first transfer frame is written
+#endif
   void *transport_context;
   void *context;
 };
 
+// deliveries are carved out of per connection slabs, a slab whose
+// deliveries are all idle is released once the pool exceeds pool_max
+#define PN_DELIVERY_SLAB (32)
+#define PN_DELIVERY_POOL (256)
+
+struct pn_delivery_slab_t {
+  pn_delivery_slab_t *slab_next;
+  pn_delivery_slab_t *slab_prev;
+  pn_delivery_slab_t *empty_next;
+  pn_delivery_slab_t *empty_prev;
+  size_t used;
+  pn_delivery_t deliveries[PN_DELIVERY_SLAB];
+};
+
 #define PN_SET_LOCAL(OLD, NEW)                                          \
   (OLD) = ((OLD) & PN_REMOTE_MASK) | (NEW)
 
@@ -251,6 +385,7 @@ struct pn_delivery_t {
 void pn_link_dump(pn_link_t *link);
 
 void pn_dump(pn_connection_t *conn);
+void pn_delivery_pool_trim(pn_connection_t *conn);
 void pn_transport_sasl_init(pn_transport_t *transport);
 
 #endif /* engine-internal.h */
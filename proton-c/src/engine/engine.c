@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <proton/framing.h>
+#include <proton/message.h>
 #include "protocol.h"
 #include <inttypes.h>
 
@@ -30,17 +31,21 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include "../platform.h"
 #include "../sasl/sasl-internal.h"
 #include "../ssl/ssl-internal.h"
 
 // delivery buffers
 
-void pn_delivery_buffer_init(pn_delivery_buffer_t *db, pn_sequence_t next, size_t capacity)
+#define PN_DELIVERY_BUFFER_INITIAL (16)
+
+void pn_delivery_buffer_init(pn_delivery_buffer_t *db, pn_sequence_t next, size_t limit)
 {
   // XXX: error handling
-  db->deliveries = malloc(sizeof(pn_delivery_state_t) * capacity);
+  db->capacity = limit < PN_DELIVERY_BUFFER_INITIAL ? limit : PN_DELIVERY_BUFFER_INITIAL;
+  db->deliveries = malloc(sizeof(pn_delivery_state_t) * db->capacity);
   db->next = next;
-  db->capacity = capacity;
+  db->limit = limit;
   db->head = 0;
   db->size = 0;
 }
@@ -57,7 +62,7 @@ size_t pn_delivery_buffer_size(pn_delivery_buffer_t *db)
 
 size_t pn_delivery_buffer_available(pn_delivery_buffer_t *db)
 {
-  return db->capacity - db->size;
+  return db->size < db->limit ? db->limit - db->size : 0;
 }
 
 bool pn_delivery_buffer_empty(pn_delivery_buffer_t *db)
@@ -89,6 +94,20 @@ pn_sequence_t pn_delivery_buffer_lwm(pn_delivery_buffer_t *db)
   else return db->next;
 }
 
+// pre-settled deliveries take an id without occupying the ring, so
+// the ids in the ring ascend but are not necessarily contiguous, this
+// returns the index of the first entry whose id is at least id
+size_t pn_delivery_buffer_find(pn_delivery_buffer_t *db, pn_sequence_t id)
+{
+  size_t lo = 0, hi = db->size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (pn_delivery_buffer_get(db, mid)->id < id) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
 static void pn_delivery_state_init(pn_delivery_state_t *ds, pn_delivery_t *delivery, pn_sequence_t id)
 {
   ds->delivery = delivery;
@@ -96,10 +115,34 @@ static void pn_delivery_state_init(pn_delivery_state_t *ds, pn_delivery_t *deliv
   ds->sent = false;
 }
 
+// deliveries point back at their state, so they are updated once the
+// ring has been moved
+static int pn_delivery_buffer_grow(pn_delivery_buffer_t *db)
+{
+  size_t capacity = 2*db->capacity;
+  if (capacity > db->limit) capacity = db->limit;
+  pn_delivery_state_t *deliveries = malloc(sizeof(pn_delivery_state_t) * capacity);
+  if (!deliveries) return PN_ERR;
+
+  for (size_t i = 0; i < db->size; i++) {
+    pn_delivery_state_t *ds = deliveries + i;
+    *ds = *pn_delivery_buffer_get(db, i);
+    if (ds->delivery) ds->delivery->transport_context = ds;
+  }
+
+  free(db->deliveries);
+  db->deliveries = deliveries;
+  db->capacity = capacity;
+  db->head = 0;
+  return 0;
+}
+
 pn_delivery_state_t *pn_delivery_buffer_push(pn_delivery_buffer_t *db, pn_delivery_t *delivery)
 {
   if (!pn_delivery_buffer_available(db))
     return NULL;
+  if (db->size == db->capacity && pn_delivery_buffer_grow(db))
+    return NULL;
   db->size++;
   pn_delivery_state_t *ds = pn_delivery_buffer_tail(db);
   pn_delivery_state_init(ds, delivery, db->next++);
@@ -124,6 +167,404 @@ void pn_delivery_buffer_gc(pn_delivery_buffer_t *db)
   }
 }
 
+// disposition ranges
+
+// index of the first range that ends at or after id
+static size_t pn_disp_set_find(pn_disp_set_t *set, pn_sequence_t id)
+{
+  size_t lo = 0, hi = set->size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (set->ranges[mid].last < id) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static int pn_disp_set_insert(pn_disp_set_t *set, size_t index, pn_disp_range_t range)
+{
+  if (set->size == set->capacity) {
+    size_t capacity = set->capacity ? 2*set->capacity : 16;
+    pn_disp_range_t *ranges = realloc(set->ranges, capacity * sizeof(pn_disp_range_t));
+    if (!ranges) return PN_ERR;
+    set->ranges = ranges;
+    set->capacity = capacity;
+  }
+  memmove(set->ranges + index + 1, set->ranges + index,
+          (set->size - index) * sizeof(pn_disp_range_t));
+  set->ranges[index] = range;
+  set->size++;
+  return 0;
+}
+
+static void pn_disp_set_remove(pn_disp_set_t *set, size_t index)
+{
+  memmove(set->ranges + index, set->ranges + index + 1,
+          (set->size - index - 1) * sizeof(pn_disp_range_t));
+  set->size--;
+}
+
+// records the disposition of a single delivery, replacing any earlier
+// pending disposition for it and merging with neighbouring ranges that
+// share the same outcome
+static int pn_disp_set_add(pn_disp_set_t *set, pn_sequence_t id, uint64_t code, bool settled)
+{
+  size_t i = pn_disp_set_find(set, id);
+  if (i < set->size && set->ranges[i].first <= id) {
+    pn_disp_range_t *range = &set->ranges[i];
+    if (range->code == code && range->settled == settled) return 0;
+    if (range->first == range->last) {
+      pn_disp_set_remove(set, i);
+    } else if (range->first == id) {
+      range->first++;
+    } else if (range->last == id) {
+      range->last--;
+      i++;
+    } else {
+      pn_disp_range_t tail = *range;
+      tail.first = id + 1;
+      range->last = id - 1;
+      int err = pn_disp_set_insert(set, i + 1, tail);
+      if (err) return err;
+      i++;
+    }
+  }
+
+  pn_disp_range_t *prev = i > 0 ? &set->ranges[i - 1] : NULL;
+  pn_disp_range_t *next = i < set->size ? &set->ranges[i] : NULL;
+  bool left = prev && prev->last + 1 == id && prev->code == code && prev->settled == settled;
+  bool right = next && next->first == id + 1 && next->code == code && next->settled == settled;
+
+  if (left && right) {
+    prev->last = next->last;
+    pn_disp_set_remove(set, i);
+  } else if (left) {
+    prev->last = id;
+  } else if (right) {
+    next->first = id;
+  } else {
+    pn_disp_range_t range = {.first = id, .last = id, .code = code, .settled = settled};
+    return pn_disp_set_insert(set, i, range);
+  }
+
+  return 0;
+}
+
+// delivery pool
+
+static pn_delivery_t *pn_delivery_alloc(pn_connection_t *conn)
+{
+  if (!conn->pool_tail) {
+    pn_delivery_slab_t *slab = (pn_delivery_slab_t *) malloc(sizeof(pn_delivery_slab_t));
+    if (!slab) return NULL;
+    LL_ADD(conn, slab, slab);
+    LL_ADD(conn, empty, slab);
+    slab->used = 0;
+    for (int i = PN_DELIVERY_SLAB - 1; i >= 0; i--) {
+      pn_delivery_t *d = &slab->deliveries[i];
+      d->slab = slab;
+      d->tag = d->tag_inline;
+      d->tag_size = 0;
+      d->bytes = NULL;
+      d->ref_head = d->ref_tail = NULL;
+      d->ref_size = 0;
+      LL_ADD(conn, pool, d);
+    }
+    conn->pool_size += PN_DELIVERY_SLAB;
+  }
+
+  // most recently released deliveries are at the tail
+  pn_delivery_t *delivery = conn->pool_tail;
+  LL_REMOVE(conn, pool, delivery);
+  conn->pool_size--;
+  pn_delivery_slab_t *slab = delivery->slab;
+  if (!slab->used++) {
+    LL_REMOVE(conn, empty, slab);
+  }
+  return delivery;
+}
+
+static int pn_delivery_ref_push(pn_delivery_t *delivery, const char *bytes, size_t size,
+                                void (*release)(void *), void *context)
+{
+  pn_delivery_ref_t *ref = (pn_delivery_ref_t *) malloc(sizeof(pn_delivery_ref_t));
+  if (!ref) return PN_ERR;
+  ref->ref_next = NULL;
+  ref->bytes = bytes;
+  ref->size = size;
+  ref->release = release;
+  ref->context = context;
+  if (delivery->ref_tail) delivery->ref_tail->ref_next = ref;
+  else delivery->ref_head = ref;
+  delivery->ref_tail = ref;
+  delivery->ref_size += size;
+  return 0;
+}
+
+// drops the first ref, handing its memory back to the caller
+static void pn_delivery_ref_pop(pn_delivery_t *delivery)
+{
+  pn_delivery_ref_t *ref = delivery->ref_head;
+  delivery->ref_head = ref->ref_next;
+  if (!delivery->ref_head) delivery->ref_tail = NULL;
+  delivery->ref_size -= ref->size;
+  if (ref->release) ref->release(ref->context);
+  free(ref);
+}
+
+static void pn_delivery_release(pn_connection_t *conn, pn_delivery_t *delivery)
+{
+  while (delivery->ref_head) {
+    pn_delivery_ref_pop(delivery);
+  }
+  if (delivery->tag != delivery->tag_inline) {
+    free(delivery->tag);
+    delivery->tag = delivery->tag_inline;
+  }
+  delivery->tag_size = 0;
+  if (delivery->bytes) pn_buffer_clear(delivery->bytes);
+  if (delivery->arrived) {
+    LL_REMOVE(conn, arrived, delivery);
+    delivery->arrived = false;
+  }
+  LL_ADD(conn, pool, delivery);
+  conn->pool_size++;
+
+  pn_delivery_slab_t *slab = delivery->slab;
+  if (!--slab->used) {
+    LL_ADD(conn, empty, slab);
+  }
+}
+
+static void pn_delivery_slab_free(pn_connection_t *conn, pn_delivery_slab_t *slab)
+{
+  for (int i = 0; i < PN_DELIVERY_SLAB; i++) {
+    pn_delivery_t *d = &slab->deliveries[i];
+    LL_REMOVE(conn, pool, d);
+    pn_buffer_free(d->bytes);
+  }
+  conn->pool_size -= PN_DELIVERY_SLAB;
+  LL_REMOVE(conn, slab, slab);
+  if (!slab->used) {
+    LL_REMOVE(conn, empty, slab);
+  }
+  free(slab);
+}
+
+// releases idle slabs while the pool holds more than pool_max
+// deliveries, this must not be called while deliveries are being
+// iterated since it frees their memory
+void pn_delivery_pool_trim(pn_connection_t *conn)
+{
+  // the most recently emptied slabs are the likeliest to be reused
+  while (conn->empty_head && conn->pool_size > conn->pool_max) {
+    pn_delivery_slab_free(conn, conn->empty_head);
+  }
+}
+
+static void pn_delivery_tag_set(pn_delivery_t *delivery, pn_delivery_tag_t tag)
+{
+  if (delivery->tag != delivery->tag_inline) {
+    free(delivery->tag);
+    delivery->tag = delivery->tag_inline;
+  }
+  if (tag.size > PN_DELIVERY_TAG_INLINE) {
+    delivery->tag = (char *) malloc(tag.size);
+  }
+  memmove(delivery->tag, tag.bytes, tag.size);
+  delivery->tag_size = tag.size;
+}
+
+// metrics
+
+#ifdef PN_METRICS
+
+static void pn_histogram_add(pn_histogram_t *histogram, uint64_t sample)
+{
+  size_t bucket = 0;
+  while (bucket < PN_HISTOGRAM_BUCKETS - 1 && (sample >> bucket)) bucket++;
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->sum += sample;
+  if (sample > histogram->max) histogram->max = sample;
+}
+
+static void pn_histogram_merge(pn_histogram_t *histogram, const pn_histogram_t *other)
+{
+  for (size_t i = 0; i < PN_HISTOGRAM_BUCKETS; i++) {
+    histogram->buckets[i] += other->buckets[i];
+  }
+  histogram->count += other->count;
+  histogram->sum += other->sum;
+  if (other->max > histogram->max) histogram->max = other->max;
+}
+
+// the engine reads the clock once per input or output call, calls
+// made by the application read it only when they have to
+static uint64_t pn_metrics_clock(pn_transport_t *transport)
+{
+  return transport ? transport->clock : pn_i_clock();
+}
+
+static uint64_t pn_metrics_since(uint64_t now, uint64_t then)
+{
+  return now > then ? now - then : 0;
+}
+
+// a sender is starved while it has advanced deliveries that are
+// waiting for credit, the credit of a sender already has its queued
+// deliveries taken off
+static void pn_metrics_starved(pn_transport_t *transport, pn_link_t *link)
+{
+  bool starved = link->queued > 0 && (pn_sequence_t) (link->credit + link->queued) <= 0;
+  if (starved == (link->starved_since != 0)) return;
+  uint64_t now = pn_metrics_clock(transport);
+  if (starved) {
+    link->starved_since = now;
+  } else {
+    link->metrics.credit_starved += pn_metrics_since(now, link->starved_since);
+    link->starved_since = 0;
+  }
+}
+
+static void pn_metrics_stalled(pn_transport_t *transport, pn_session_t *session, bool stalled)
+{
+  if (stalled == (session->stalled_since != 0)) return;
+  if (stalled) {
+    session->stalled_since = transport->clock;
+  } else {
+    session->window_stalled += pn_metrics_since(transport->clock, session->stalled_since);
+    session->stalled_since = 0;
+  }
+}
+
+static void pn_metrics_written(pn_transport_t *transport, pn_delivery_t *delivery, size_t written)
+{
+  pn_link_t *link = delivery->link;
+  if (!delivery->first_sent) {
+    delivery->first_sent = transport->clock;
+    pn_histogram_add(&link->metrics.send_latency,
+                     pn_metrics_since(transport->clock, delivery->created));
+  }
+  link->metrics.bytes_sent += written;
+}
+
+static void pn_metrics_sent(pn_transport_t *transport, pn_delivery_t *delivery)
+{
+  delivery->link->metrics.deliveries_sent++;
+  pn_metrics_starved(transport, delivery->link);
+}
+
+static void pn_metrics_settled(pn_transport_t *transport, pn_delivery_t *delivery)
+{
+  if (delivery->first_sent && pn_link_is_sender(delivery->link)) {
+    pn_histogram_add(&delivery->link->metrics.settle_latency,
+                     pn_metrics_since(transport->clock, delivery->first_sent));
+  }
+}
+
+static void pn_metrics_received(pn_link_t *link, size_t size, bool done)
+{
+  link->metrics.bytes_received += size;
+  if (done) link->metrics.deliveries_received++;
+}
+
+#else
+
+#define pn_metrics_starved(transport, link) ((void) 0)
+#define pn_metrics_stalled(transport, session, stalled) ((void) 0)
+#define pn_metrics_written(transport, delivery, written) ((void) 0)
+#define pn_metrics_sent(transport, delivery) ((void) 0)
+#define pn_metrics_settled(transport, delivery) ((void) 0)
+#define pn_metrics_received(link, size, done) ((void) 0)
+
+#endif
+
+uint64_t pn_histogram_percentile(const pn_histogram_t *histogram, double percentile)
+{
+  if (!histogram || !histogram->count) return 0;
+  uint64_t rank = (uint64_t) (histogram->count * percentile / 100);
+  if (rank < 1) rank = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < PN_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = i ? (((uint64_t) 1) << i) - 1 : 0;
+      return bound < histogram->max && i < PN_HISTOGRAM_BUCKETS - 1 ? bound : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+int pn_link_metrics(pn_link_t *link, pn_link_metrics_t *metrics)
+{
+  if (!link || !metrics) return PN_ARG_ERR;
+  memset(metrics, 0, sizeof(*metrics));
+#ifdef PN_METRICS
+  *metrics = link->metrics;
+  metrics->unsettled = link->unsettled_count;
+  if (link->starved_since) {
+    metrics->credit_starved += pn_metrics_since(pn_i_clock(), link->starved_since);
+  }
+  return 0;
+#else
+  return PN_ERR;
+#endif
+}
+
+int pn_session_metrics(pn_session_t *session, pn_session_metrics_t *metrics)
+{
+  if (!session || !metrics) return PN_ARG_ERR;
+  memset(metrics, 0, sizeof(*metrics));
+#ifdef PN_METRICS
+  metrics->window_stalled = session->window_stalled;
+  if (session->stalled_since) {
+    metrics->window_stalled += pn_metrics_since(pn_i_clock(), session->stalled_since);
+  }
+  return 0;
+#else
+  return PN_ERR;
+#endif
+}
+
+int pn_connection_metrics(pn_connection_t *connection, pn_connection_metrics_t *metrics)
+{
+  if (!connection || !metrics) return PN_ARG_ERR;
+  memset(metrics, 0, sizeof(*metrics));
+#ifdef PN_METRICS
+  pn_transport_t *transport = connection->transport;
+  if (transport) {
+    metrics->bytes_input = transport->bytes_input;
+    metrics->bytes_output = transport->bytes_output;
+    metrics->frames_input = pn_transport_get_frames_input(transport);
+    metrics->frames_output = pn_transport_get_frames_output(transport);
+  }
+
+  pn_link_metrics_t *links = &metrics->links;
+  for (size_t i = 0; i < connection->session_count; i++) {
+    pn_session_t *session = connection->sessions[i];
+    pn_session_metrics_t ssn;
+    pn_session_metrics(session, &ssn);
+    metrics->window_stalled += ssn.window_stalled;
+    for (size_t j = 0; j < session->link_count; j++) {
+      pn_link_metrics_t link;
+      pn_link_metrics(session->links[j], &link);
+      links->deliveries_sent += link.deliveries_sent;
+      links->deliveries_received += link.deliveries_received;
+      links->bytes_sent += link.bytes_sent;
+      links->bytes_received += link.bytes_received;
+      links->credit_starved += link.credit_starved;
+      links->unsettled += link.unsettled;
+      pn_histogram_merge(&links->send_latency, &link.send_latency);
+      pn_histogram_merge(&links->settle_latency, &link.settle_latency);
+    }
+  }
+  return 0;
+#else
+  return PN_ERR;
+#endif
+}
+
 // endpoints
 
 pn_connection_t *pn_ep_get_connection(pn_endpoint_t *endpoint)
@@ -182,7 +623,10 @@ void pn_connection_free(pn_connection_t *connection)
 
   while (connection->session_count)
     pn_session_free(connection->sessions[connection->session_count - 1]);
+  while (connection->slab_head)
+    pn_delivery_slab_free(connection, connection->slab_head);
   free(connection->sessions);
+  free(connection->sched_heap);
   free(connection->container);
   free(connection->hostname);
   pn_data_free(connection->offered_capabilities);
@@ -202,6 +646,37 @@ void pn_connection_set_context(pn_connection_t *conn, void *context)
         conn->context = context;
 }
 
+size_t pn_connection_get_delivery_pool(pn_connection_t *connection)
+{
+  return connection ? connection->pool_max : 0;
+}
+
+void pn_connection_set_delivery_pool(pn_connection_t *connection, size_t max)
+{
+  if (!connection) return;
+  connection->pool_max = max;
+  pn_delivery_pool_trim(connection);
+}
+
+size_t pn_connection_pooled(pn_connection_t *connection)
+{
+  return connection ? connection->pool_size : 0;
+}
+
+pn_sched_t pn_connection_get_scheduler(pn_connection_t *connection)
+{
+  return connection ? connection->scheduler : PN_SCHED_FIFO;
+}
+
+void pn_sched_reset(pn_connection_t *connection, pn_sched_t scheduler);
+
+void pn_connection_set_scheduler(pn_connection_t *connection, pn_sched_t scheduler)
+{
+  if (connection && connection->scheduler != scheduler) {
+    pn_sched_reset(connection, scheduler);
+  }
+}
+
 void pn_transport_open(pn_transport_t *transport)
 {
   pn_open((pn_endpoint_t *) transport);
@@ -212,16 +687,26 @@ void pn_transport_close(pn_transport_t *transport)
   pn_close((pn_endpoint_t *) transport);
 }
 
-void pn_condition_init(pn_condition_t *condition)
+pn_condition_t *pn_condition_ensure(pn_condition_t **condition)
 {
-  condition->name[0] = '\0';
-  condition->description[0] = '\0';
-  condition->info = pn_data(16);
+  if (!*condition) {
+    *condition = (pn_condition_t *) malloc(sizeof(pn_condition_t));
+    if (!*condition) return NULL;
+    (*condition)->name = NULL;
+    (*condition)->description = NULL;
+    (*condition)->info = NULL;
+  }
+  return *condition;
 }
 
-void pn_condition_tini(pn_condition_t *condition)
+void pn_condition_free(pn_condition_t *condition)
 {
-  pn_data_free(condition->info);
+  if (condition) {
+    free(condition->name);
+    free(condition->description);
+    pn_data_free(condition->info);
+    free(condition);
+  }
 }
 
 void pn_transport_free(pn_transport_t *transport)
@@ -235,16 +720,18 @@ void pn_transport_free(pn_transport_t *transport)
     pn_delivery_buffer_free(&transport->sessions[i].incoming);
     pn_delivery_buffer_free(&transport->sessions[i].outgoing);
     free(transport->sessions[i].links);
-    free(transport->sessions[i].handles);
+    pn_idmap_tini(&transport->sessions[i].handles);
+    free(transport->sessions[i].disp[0].ranges);
+    free(transport->sessions[i].disp[1].ranges);
   }
   free(transport->remote_container);
   free(transport->remote_hostname);
   pn_data_free(transport->remote_offered_capabilities);
   pn_data_free(transport->remote_desired_capabilities);
   pn_error_free(transport->error);
-  pn_condition_tini(&transport->remote_condition);
+  pn_condition_free(transport->remote_condition);
   free(transport->sessions);
-  free(transport->channels);
+  pn_idmap_tini(&transport->channels);
   free(transport);
 }
 
@@ -309,6 +796,36 @@ void pn_session_set_context(pn_session_t *session, void *context)
         session->context = context;
 }
 
+size_t pn_session_get_incoming_capacity(pn_session_t *session)
+{
+  return session ? session->incoming_capacity : 0;
+}
+
+void pn_session_set_incoming_capacity(pn_session_t *session, size_t capacity)
+{
+  if (session && capacity > 0) session->incoming_capacity = capacity;
+}
+
+size_t pn_session_get_outgoing_capacity(pn_session_t *session)
+{
+  return session ? session->outgoing_capacity : 0;
+}
+
+void pn_session_set_outgoing_capacity(pn_session_t *session, size_t capacity)
+{
+  if (session && capacity > 0) session->outgoing_capacity = capacity;
+}
+
+size_t pn_session_get_incoming_low_water(pn_session_t *session)
+{
+  return session ? session->incoming_low_water : 0;
+}
+
+void pn_session_set_incoming_low_water(pn_session_t *session, size_t low_water)
+{
+  if (session) session->incoming_low_water = low_water;
+}
+
 
 void pn_add_link(pn_session_t *ssn, pn_link_t *link)
 {
@@ -332,23 +849,19 @@ void pn_remove_link(pn_session_t *ssn, pn_link_t *link)
   link->session = NULL;
 }
 
-void pn_free_delivery(pn_delivery_t *delivery)
-{
-  if (delivery) {
-    pn_buffer_free(delivery->tag);
-    pn_buffer_free(delivery->bytes);
-    free(delivery);
-  }
-}
-
 void pn_link_open(pn_link_t *link)
 {
   if (link) pn_open((pn_endpoint_t *) link);
 }
 
+static void pn_link_uncount(pn_link_t *link);
+static void pn_link_budget(pn_link_t *link, int sign);
+
 void pn_link_close(pn_link_t *link)
 {
-  if (link) pn_close((pn_endpoint_t *) link);
+  if (!link) return;
+  pn_link_uncount(link);
+  pn_close((pn_endpoint_t *) link);
 }
 
 void pn_terminus_free(pn_terminus_t *terminus)
@@ -360,6 +873,51 @@ void pn_terminus_free(pn_terminus_t *terminus)
   pn_data_free(terminus->filter);
 }
 
+void pn_clear_work(pn_connection_t *connection, pn_delivery_t *delivery);
+void pn_clear_tpwork(pn_delivery_t *delivery);
+
+// the totals of a connection only count links that are not closed, so
+// that nothing left on a closed link holds up a caller waiting on them
+static bool pn_link_counted(pn_link_t *link)
+{
+  return !(link->endpoint.state & PN_LOCAL_CLOSED);
+}
+
+static void pn_link_queue(pn_link_t *link, int delta)
+{
+  link->queued += delta;
+  if (!pn_link_counted(link)) return;
+  if (link->endpoint.type == SENDER) {
+    link->session->connection->outgoing += delta;
+  } else {
+    link->session->connection->incoming += delta;
+  }
+}
+
+static void pn_link_uncount(pn_link_t *link)
+{
+  if (!pn_link_counted(link)) return;
+  pn_connection_t *conn = link->session->connection;
+  if (link->endpoint.type == SENDER) {
+    conn->outgoing -= link->queued;
+    conn->unresolved -= link->unresolved;
+  } else {
+    conn->incoming -= link->queued;
+  }
+}
+
+// counts off a sent delivery once it has an outcome or is settled
+static void pn_delivery_resolve(pn_delivery_t *delivery)
+{
+  if (!delivery->unresolved) return;
+  pn_link_t *link = delivery->link;
+  delivery->unresolved = false;
+  link->unresolved--;
+  if (pn_link_counted(link)) {
+    link->session->connection->unresolved--;
+  }
+}
+
 void pn_link_free(pn_link_t *link)
 {
   if (!link) return;
@@ -368,17 +926,21 @@ void pn_link_free(pn_link_t *link)
   pn_terminus_free(&link->target);
   pn_terminus_free(&link->remote_source);
   pn_terminus_free(&link->remote_target);
-  pn_remove_link(link->session, link);
-  while (link->settled_head) {
-    pn_delivery_t *d = link->settled_head;
-    LL_POP(link, settled);
-    pn_free_delivery(d);
-  }
+  pn_connection_t *conn = link->session->connection;
+  pn_link_uncount(link);
   while (link->unsettled_head) {
     pn_delivery_t *d = link->unsettled_head;
-    LL_POP(link, unsettled);
-    pn_free_delivery(d);
+    LL_REMOVE(link, unsettled, d);
+    pn_clear_work(conn, d);
+    pn_clear_tpwork(d);
+    pn_delivery_release(conn, d);
+  }
+  // settled deliveries that were never sent are still scheduled
+  while (link->sched_head) {
+    pn_clear_tpwork(link->sched_head);
   }
+  pn_link_budget(link, -1);
+  pn_remove_link(link->session, link);
   free(link->name);
   pn_endpoint_tini(&link->endpoint);
   free(link);
@@ -400,8 +962,8 @@ void pn_endpoint_init(pn_endpoint_t *endpoint, int type, pn_connection_t *conn)
   endpoint->type = type;
   endpoint->state = PN_LOCAL_UNINIT | PN_REMOTE_UNINIT;
   endpoint->error = pn_error();
-  pn_condition_init(&endpoint->condition);
-  pn_condition_init(&endpoint->remote_condition);
+  endpoint->condition = NULL;
+  endpoint->remote_condition = NULL;
   endpoint->endpoint_next = NULL;
   endpoint->endpoint_prev = NULL;
   endpoint->transport_next = NULL;
@@ -414,8 +976,8 @@ void pn_endpoint_init(pn_endpoint_t *endpoint, int type, pn_connection_t *conn)
 void pn_endpoint_tini(pn_endpoint_t *endpoint)
 {
   pn_error_free(endpoint->error);
-  pn_condition_tini(&endpoint->remote_condition);
-  pn_condition_tini(&endpoint->condition);
+  pn_condition_free(endpoint->remote_condition);
+  pn_condition_free(endpoint->condition);
 }
 
 pn_connection_t *pn_connection()
@@ -437,6 +999,26 @@ pn_connection_t *pn_connection()
   conn->work_tail = NULL;
   conn->tpwork_head = NULL;
   conn->tpwork_tail = NULL;
+  conn->arrived_head = NULL;
+  conn->arrived_tail = NULL;
+  conn->slab_head = NULL;
+  conn->slab_tail = NULL;
+  conn->empty_head = NULL;
+  conn->empty_tail = NULL;
+  conn->pool_head = NULL;
+  conn->pool_tail = NULL;
+  conn->pool_size = 0;
+  conn->pool_max = PN_DELIVERY_POOL;
+  conn->scheduler = PN_SCHED_FIFO;
+  conn->sched_vtime = 0;
+  conn->sched_heap = NULL;
+  conn->sched_capacity = 0;
+  conn->sched_size = 0;
+  conn->sched_parked = NULL;
+  conn->sched_seq = 0;
+  conn->outgoing = 0;
+  conn->incoming = 0;
+  conn->unresolved = 0;
   conn->container = NULL;
   conn->hostname = NULL;
   conn->offered_capabilities = pn_data(16);
@@ -529,6 +1111,15 @@ pn_delivery_t *pn_work_next(pn_delivery_t *delivery)
     return pn_work_head(delivery->link->session->connection);
 }
 
+pn_delivery_t *pn_connection_arrived(pn_connection_t *connection)
+{
+  if (!connection || !connection->arrived_head) return NULL;
+  pn_delivery_t *delivery = connection->arrived_head;
+  LL_REMOVE(connection, arrived, delivery);
+  delivery->arrived = false;
+  return delivery;
+}
+
 void pn_add_work(pn_connection_t *connection, pn_delivery_t *delivery)
 {
   if (!delivery->work)
@@ -568,12 +1159,199 @@ void pn_work_update(pn_connection_t *connection, pn_delivery_t *delivery)
   }
 }
 
+// the virtual time it takes a link of weight one to start a delivery
+#define PN_SCHED_TURN (((uint64_t) 1) << 32)
+
+// whether a link goes ahead of another under the connection's
+// scheduler, ties go to the link whose next delivery came up first
+static bool pn_sched_before(pn_connection_t *conn, pn_link_t *a, pn_link_t *b)
+{
+  switch (conn->scheduler) {
+  case PN_SCHED_PRIORITY:
+    if (a->priority != b->priority) return a->priority > b->priority;
+    break;
+  case PN_SCHED_MESSAGE_PRIORITY:
+    if (a->sched_priority != b->sched_priority) return a->sched_priority > b->sched_priority;
+    break;
+  case PN_SCHED_WEIGHTED:
+    {
+      // work already under way keeps going ahead of anything new
+      bool started_a = a->sched_head->transport_context;
+      bool started_b = b->sched_head->transport_context;
+      if (started_a != started_b) return started_a;
+      if (a->sched_vtime != b->sched_vtime) return (int64_t) (a->sched_vtime - b->sched_vtime) < 0;
+    }
+    break;
+  default:
+    break;
+  }
+  return (int64_t) (a->sched_head->sched_seq - b->sched_head->sched_seq) < 0;
+}
+
+static void pn_sched_place(pn_connection_t *conn, size_t index, pn_link_t *link)
+{
+  conn->sched_heap[index] = link;
+  link->sched_index = index;
+}
+
+static void pn_sched_up(pn_connection_t *conn, size_t index)
+{
+  pn_link_t *link = conn->sched_heap[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (!pn_sched_before(conn, link, conn->sched_heap[parent])) break;
+    pn_sched_place(conn, index, conn->sched_heap[parent]);
+    index = parent;
+  }
+  pn_sched_place(conn, index, link);
+}
+
+static void pn_sched_down(pn_connection_t *conn, size_t index)
+{
+  pn_link_t *link = conn->sched_heap[index];
+  while (true) {
+    size_t child = 2*index + 1;
+    if (child >= conn->sched_size) break;
+    if (child + 1 < conn->sched_size &&
+        pn_sched_before(conn, conn->sched_heap[child + 1], conn->sched_heap[child])) {
+      child++;
+    }
+    if (!pn_sched_before(conn, conn->sched_heap[child], link)) break;
+    pn_sched_place(conn, index, conn->sched_heap[child]);
+    index = child;
+  }
+  pn_sched_place(conn, index, link);
+}
+
+static void pn_sched_push(pn_connection_t *conn, pn_link_t *link)
+{
+  // a link that sat idle starts level with the busy ones rather than
+  // catching up on the turns it missed
+  if ((int64_t) (link->sched_vtime - conn->sched_vtime) < 0) {
+    link->sched_vtime = conn->sched_vtime;
+  }
+  PN_ENSURE(conn->sched_heap, conn->sched_capacity, conn->sched_size + 1);
+  pn_sched_place(conn, conn->sched_size++, link);
+  pn_sched_up(conn, link->sched_index);
+}
+
+static void pn_sched_remove(pn_connection_t *conn, pn_link_t *link)
+{
+  size_t index = link->sched_index;
+  link->sched_index = PN_SCHED_NONE;
+  pn_link_t *last = conn->sched_heap[--conn->sched_size];
+  if (last != link) {
+    pn_sched_place(conn, index, last);
+    pn_sched_up(conn, index);
+    pn_sched_down(conn, last->sched_index);
+  }
+}
+
+// puts a link back in its place after its key or its work changed, a
+// parked link is sorted out when the pass that parked it ends
+void pn_sched_update(pn_connection_t *conn, pn_link_t *link)
+{
+  if (link->sched_index == PN_SCHED_PARKED) return;
+  if (!link->sched_head) {
+    if (link->sched_index != PN_SCHED_NONE) pn_sched_remove(conn, link);
+  } else if (link->sched_index == PN_SCHED_NONE) {
+    pn_sched_push(conn, link);
+  } else {
+    pn_sched_up(conn, link->sched_index);
+    pn_sched_down(conn, link->sched_index);
+  }
+}
+
+// a link's scheduled deliveries are ranked by priority: the first of
+// each priority sits on the rank list, highest first, and the rest
+// are ringed to it, so the highest priority is always at the head and
+// a delivery leaving never needs the others looked at
+static void pn_sched_count(pn_link_t *link, pn_delivery_t *delivery)
+{
+  pn_delivery_t *prev = NULL;
+  pn_delivery_t *rank = link->sched_rank_head;
+  while (rank && rank->priority > delivery->priority) {
+    prev = rank;
+    rank = rank->sched_rank_next;
+  }
+
+  if (rank && rank->priority == delivery->priority) {
+    delivery->sched_peer_next = rank;
+    delivery->sched_peer_prev = rank->sched_peer_prev;
+    rank->sched_peer_prev->sched_peer_next = delivery;
+    rank->sched_peer_prev = delivery;
+  } else {
+    delivery->sched_peer_next = delivery;
+    delivery->sched_peer_prev = delivery;
+    delivery->sched_rank_next = rank;
+    delivery->sched_rank_prev = prev;
+    if (prev) prev->sched_rank_next = delivery;
+    else link->sched_rank_head = delivery;
+    if (rank) rank->sched_rank_prev = delivery;
+    delivery->sched_ranked = true;
+  }
+
+  link->sched_priority = link->sched_rank_head->priority;
+}
+
+static void pn_sched_uncount(pn_link_t *link, pn_delivery_t *delivery)
+{
+  if (delivery->sched_ranked) {
+    pn_delivery_t *next = delivery->sched_rank_next;
+    pn_delivery_t *prev = delivery->sched_rank_prev;
+    pn_delivery_t *peer = delivery->sched_peer_next;
+    if (peer != delivery) {
+      // the next of the same priority takes its place
+      peer->sched_rank_next = next;
+      peer->sched_rank_prev = prev;
+      peer->sched_ranked = true;
+      if (prev) prev->sched_rank_next = peer;
+      else link->sched_rank_head = peer;
+      if (next) next->sched_rank_prev = peer;
+    } else {
+      if (prev) prev->sched_rank_next = next;
+      else link->sched_rank_head = next;
+      if (next) next->sched_rank_prev = prev;
+    }
+    delivery->sched_rank_next = NULL;
+    delivery->sched_rank_prev = NULL;
+    delivery->sched_ranked = false;
+  }
+
+  delivery->sched_peer_prev->sched_peer_next = delivery->sched_peer_next;
+  delivery->sched_peer_next->sched_peer_prev = delivery->sched_peer_prev;
+  delivery->sched_peer_next = NULL;
+  delivery->sched_peer_prev = NULL;
+
+  link->sched_priority = link->sched_rank_head ? link->sched_rank_head->priority : 0;
+}
+
+// the deliveries the non FIFO schedulers order are those with
+// transfers still to write, everything else is worked through in the
+// order it came up
+static bool pn_sched_wanted(pn_connection_t *conn, pn_delivery_t *delivery)
+{
+  if (conn->scheduler == PN_SCHED_FIFO) return false;
+  if (!pn_link_is_sender(delivery->link) || delivery->remote_settled) return false;
+  pn_delivery_state_t *state = (pn_delivery_state_t *) delivery->transport_context;
+  return !state || !state->sent;
+}
+
 void pn_add_tpwork(pn_delivery_t *delivery)
 {
   pn_connection_t *connection = delivery->link->session->connection;
   if (!delivery->tpwork)
   {
-    LL_ADD(connection, tpwork, delivery);
+    if (pn_sched_wanted(connection, delivery)) {
+      pn_link_t *link = delivery->link;
+      delivery->sched_seq = connection->sched_seq++;
+      LL_ADD(link, sched, delivery);
+      delivery->sched = true;
+      pn_sched_count(link, delivery);
+      pn_sched_update(connection, link);
+    } else {
+      LL_ADD(connection, tpwork, delivery);
+    }
     delivery->tpwork = true;
   }
   pn_modified(connection, &connection->endpoint);
@@ -584,11 +1362,57 @@ void pn_clear_tpwork(pn_delivery_t *delivery)
   pn_connection_t *connection = delivery->link->session->connection;
   if (delivery->tpwork)
   {
-    LL_REMOVE(connection, tpwork, delivery);
+    if (delivery->sched) {
+      pn_link_t *link = delivery->link;
+      LL_REMOVE(link, sched, delivery);
+      delivery->sched = false;
+      pn_sched_uncount(link, delivery);
+      pn_sched_update(connection, link);
+    } else {
+      LL_REMOVE(connection, tpwork, delivery);
+    }
     delivery->tpwork = false;
   }
 }
 
+void pn_sched_set_priority(pn_delivery_t *delivery, uint8_t priority)
+{
+  if (delivery->sched) {
+    pn_link_t *link = delivery->link;
+    pn_sched_uncount(link, delivery);
+    delivery->priority = priority;
+    pn_sched_count(link, delivery);
+    pn_sched_update(link->session->connection, link);
+  } else {
+    delivery->priority = priority;
+  }
+}
+
+// moves all transport work over to a new scheduler, keeping the order
+// it came up in on each link
+void pn_sched_reset(pn_connection_t *conn, pn_sched_t scheduler)
+{
+  while (conn->sched_size) {
+    pn_link_t *link = conn->sched_heap[0];
+    while (link->sched_head) {
+      pn_delivery_t *delivery = link->sched_head;
+      pn_clear_tpwork(delivery);
+      LL_ADD(conn, tpwork, delivery);
+      delivery->tpwork = true;
+    }
+  }
+
+  conn->scheduler = scheduler;
+  pn_delivery_t *tail = conn->tpwork_tail;
+  pn_delivery_t *delivery = conn->tpwork_head;
+  while (delivery) {
+    pn_delivery_t *next = delivery == tail ? NULL : delivery->tpwork_next;
+    pn_clear_tpwork(delivery);
+    pn_add_tpwork(delivery);
+    delivery = next;
+  }
+}
+
 void pn_dump(pn_connection_t *conn)
 {
   pn_endpoint_t *endpoint = conn->transport_head;
@@ -703,6 +1527,16 @@ pn_session_t *pn_session(pn_connection_t *conn)
   ssn->links = NULL;
   ssn->link_capacity = 0;
   ssn->link_count = 0;
+  ssn->incoming_capacity = PN_SESSION_WINDOW;
+  ssn->outgoing_capacity = PN_SESSION_WINDOW;
+  ssn->incoming_low_water = PN_SESSION_WINDOW/2;
+  ssn->budgeted = 0;
+  ssn->over_budget = 0;
+  ssn->budget_room = 0;
+#ifdef PN_METRICS
+  ssn->window_stalled = 0;
+  ssn->stalled_since = 0;
+#endif
   ssn->context = 0;
 
   return ssn;
@@ -775,16 +1609,28 @@ void pn_transport_init(pn_transport_t *transport)
   transport->remote_offered_capabilities = pn_data(16);
   transport->remote_desired_capabilities = pn_data(16);
   transport->error = pn_error();
-  pn_condition_init(&transport->remote_condition);
+  transport->remote_condition = NULL;
 
   transport->sessions = NULL;
   transport->session_capacity = 0;
 
-  transport->channels = NULL;
-  transport->channel_capacity = 0;
+  pn_idmap_init(&transport->channels);
+  transport->output_room = SIZE_MAX;
+  transport->output_given = 0;
+  transport->output_quantum = 0;
+  transport->output_round = 1;
+  transport->trace_dumped = false;
+  // recording is best effort, it is left off if the records cannot be
+  // allocated
+  if (pn_recorder_resize(&transport->disp->recorder, PN_TRACE_RECORDS)) {
+    pn_recorder_tini(&transport->disp->recorder);
+  }
 
   transport->bytes_input = 0;
   transport->bytes_output = 0;
+#ifdef PN_METRICS
+  transport->clock = 0;
+#endif
 }
 
 pn_session_state_t *pn_session_get_state(pn_transport_t *transport, pn_session_t *ssn)
@@ -799,22 +1645,49 @@ pn_session_state_t *pn_session_get_state(pn_transport_t *transport, pn_session_t
     pn_delivery_buffer_init(&transport->sessions[i].incoming, 0, PN_SESSION_WINDOW);
     pn_delivery_buffer_init(&transport->sessions[i].outgoing, 0, PN_SESSION_WINDOW);
   }
+  // growing may have moved the states the channel map points to
+  if (transport->session_capacity != old_capacity) {
+    for (int i = 0; i < old_capacity; i++) {
+      pn_session_state_t *moved = &transport->sessions[i];
+      if (moved->remote_channel != (uint16_t) -1 && moved->remote_channel != (uint16_t) -2) {
+        pn_idmap_put(&transport->channels, moved->remote_channel, moved);
+      }
+    }
+  }
   pn_session_state_t *state = &transport->sessions[ssn->id];
   state->session = ssn;
+  state->incoming.limit = ssn->incoming_capacity;
+  state->outgoing.limit = ssn->outgoing_capacity;
   return state;
 }
 
 pn_session_state_t *pn_channel_state(pn_transport_t *transport, uint16_t channel)
 {
-  PN_ENSUREZ(transport->channels, transport->channel_capacity, channel + 1);
-  return transport->channels[channel];
+  return (pn_session_state_t *) pn_idmap_get(&transport->channels, channel);
 }
 
-void pn_map_channel(pn_transport_t *transport, uint16_t channel, pn_session_state_t *state)
+int pn_map_channel(pn_transport_t *transport, uint16_t channel, pn_session_state_t *state)
 {
-  PN_ENSUREZ(transport->channels, transport->channel_capacity, channel + 1);
   state->remote_channel = channel;
-  transport->channels[channel] = state;
+  return pn_idmap_put(&transport->channels, channel, state);
+}
+
+// the peer has ended the session, so its channel and the handles of
+// its links may be reused
+static void pn_unmap_channel(pn_transport_t *transport, pn_session_state_t *state)
+{
+  if (state->remote_channel != (uint16_t) -1 && state->remote_channel != (uint16_t) -2) {
+    pn_idmap_put(&transport->channels, state->remote_channel, NULL);
+  }
+  state->remote_channel = -2;
+
+  for (size_t i = 0; i < state->link_capacity; i++) {
+    pn_link_state_t *link_state = &state->links[i];
+    if (link_state->remote_handle != (uint32_t) -1) {
+      link_state->remote_handle = -2;
+    }
+  }
+  pn_idmap_tini(&state->handles);
 }
 
 pn_transport_t *pn_transport()
@@ -866,18 +1739,12 @@ int pn_transport_unbind(pn_transport_t *transport)
       dlv = dlv->unsettled_next;
     }
 
-    dlv = link->settled_head;
-    while (dlv) {
-      dlv->transport_context = NULL;
-      dlv = dlv->settled_next;
-    }
-
     link = pn_link_next(link, 0);
   }
 
   pn_endpoint_t *endpoint = conn->endpoint_head;
   while (endpoint) {
-    pn_condition_clear(&endpoint->remote_condition);
+    if (endpoint->remote_condition) pn_condition_clear(endpoint->remote_condition);
     pn_modified(conn, endpoint);
     endpoint = endpoint->endpoint_next;
   }
@@ -913,14 +1780,36 @@ void pn_link_init(pn_link_t *link, int type, pn_session_t *session, const char *
   pn_terminus_init(&link->target, PN_TARGET);
   pn_terminus_init(&link->remote_source, PN_UNSPECIFIED);
   pn_terminus_init(&link->remote_target, PN_UNSPECIFIED);
-  link->settled_head = link->settled_tail = NULL;
   link->unsettled_head = link->unsettled_tail = link->current = NULL;
   link->unsettled_count = 0;
   link->available = 0;
   link->credit = 0;
   link->queued = 0;
+  link->unresolved = 0;
+  link->credit_low_water = -1;
+  link->credit_window = 0;
+  link->credit_window_low = 0;
+  link->buffered = 0;
+  link->max_buffered = 0;
+  link->snd_settle_mode = PN_SND_MIXED;
+  link->remote_snd_settle_mode = PN_SND_MIXED;
+  link->priority = 0;
+  link->weight = 1;
+  link->output_round = 0;
+  link->output_used = 0;
+  link->sched_vtime = 0;
+  link->sched_head = NULL;
+  link->sched_tail = NULL;
+  link->sched_index = PN_SCHED_NONE;
+  link->sched_parked_next = NULL;
+  link->sched_priority = 0;
+  link->sched_rank_head = NULL;
   link->drain = false;
   link->drained = false;
+#ifdef PN_METRICS
+  memset(&link->metrics, 0, sizeof(link->metrics));
+  link->starved_since = 0;
+#endif
   link->context = 0;
 }
 
@@ -1083,22 +1972,37 @@ pn_link_state_t *pn_link_get_state(pn_session_state_t *ssn_state, pn_link_t *lin
     ssn_state->links[i] = (pn_link_state_t) {.link=NULL, .local_handle = -1,
                                              .remote_handle=-1};
   }
+  // growing may have moved the states the handle map points to
+  if (ssn_state->link_capacity != old_capacity) {
+    for (int i = 0; i < old_capacity; i++) {
+      pn_link_state_t *moved = &ssn_state->links[i];
+      if (moved->remote_handle != (uint32_t) -1 && moved->remote_handle != (uint32_t) -2) {
+        pn_idmap_put(&ssn_state->handles, moved->remote_handle, moved);
+      }
+    }
+  }
   pn_link_state_t *state = &ssn_state->links[link->id];
   state->link = link;
   return state;
 }
 
-void pn_map_handle(pn_session_state_t *ssn_state, uint32_t handle, pn_link_state_t *state)
+int pn_map_handle(pn_session_state_t *ssn_state, uint32_t handle, pn_link_state_t *state)
 {
-  PN_ENSUREZ(ssn_state->handles, ssn_state->handle_capacity, handle + 1);
   state->remote_handle = handle;
-  ssn_state->handles[handle] = state;
+  return pn_idmap_put(&ssn_state->handles, handle, state);
+}
+
+static void pn_unmap_handle(pn_session_state_t *ssn_state, pn_link_state_t *state)
+{
+  if (state->remote_handle != (uint32_t) -1 && state->remote_handle != (uint32_t) -2) {
+    pn_idmap_put(&ssn_state->handles, state->remote_handle, NULL);
+  }
+  state->remote_handle = -2;
 }
 
 pn_link_state_t *pn_handle_state(pn_session_state_t *ssn_state, uint32_t handle)
 {
-  PN_ENSUREZ(ssn_state->handles, ssn_state->handle_capacity, handle + 1);
-  return ssn_state->handles[handle];
+  return (pn_link_state_t *) pn_idmap_get(&ssn_state->handles, handle);
 }
 
 pn_link_t *pn_sender(pn_session_t *session, const char *name)
@@ -1152,23 +2056,22 @@ pn_session_t *pn_link_session(pn_link_t *link)
 pn_delivery_t *pn_delivery(pn_link_t *link, pn_delivery_tag_t tag)
 {
   if (!link) return NULL;
-  pn_delivery_t *delivery = link->settled_head;
-  LL_POP(link, settled);
-  if (!delivery) {
-    delivery = (pn_delivery_t *) malloc(sizeof(pn_delivery_t));
-    if (!delivery) return NULL;
-    delivery->tag = pn_buffer(16);
-    delivery->bytes = pn_buffer(64);
-  }
+  pn_delivery_t *delivery = pn_delivery_alloc(link->session->connection);
+  if (!delivery) return NULL;
   delivery->link = link;
-  pn_buffer_clear(delivery->tag);
-  pn_buffer_append(delivery->tag, tag.bytes, tag.size);
+  pn_delivery_tag_set(delivery, tag);
   delivery->local_state = 0;
   delivery->remote_state = 0;
   delivery->local_settled = false;
   delivery->remote_settled = false;
+  delivery->priority = PN_DEFAULT_PRIORITY;
   delivery->updated = false;
   delivery->settled = false;
+  delivery->unresolved = link->endpoint.type == SENDER;
+  if (delivery->unresolved) {
+    link->unresolved++;
+    if (pn_link_counted(link)) link->session->connection->unresolved++;
+  }
   LL_ADD(link, unsettled, delivery);
   delivery->work_next = NULL;
   delivery->work_prev = NULL;
@@ -1176,8 +2079,24 @@ pn_delivery_t *pn_delivery(pn_link_t *link, pn_delivery_tag_t tag)
   delivery->tpwork_next = NULL;
   delivery->tpwork_prev = NULL;
   delivery->tpwork = false;
-  pn_buffer_clear(delivery->bytes);
+  delivery->arrived_next = NULL;
+  delivery->arrived_prev = NULL;
+  delivery->arrived = false;
+  delivery->sched_next = NULL;
+  delivery->sched_prev = NULL;
+  delivery->sched_seq = 0;
+  delivery->sched_rank_next = NULL;
+  delivery->sched_rank_prev = NULL;
+  delivery->sched_peer_next = NULL;
+  delivery->sched_peer_prev = NULL;
+  delivery->sched_ranked = false;
+  delivery->sched = false;
   delivery->done = false;
+#ifdef PN_METRICS
+  // only the latency of outgoing deliveries is measured
+  delivery->created = pn_link_is_sender(link) ? pn_i_clock() : 0;
+  delivery->first_sent = 0;
+#endif
   delivery->transport_context = NULL;
   delivery->context = NULL;
 
@@ -1214,109 +2133,263 @@ pn_delivery_t *pn_unsettled_next(pn_delivery_t *delivery)
   return d;
 }
 
-bool pn_is_current(pn_delivery_t *delivery)
+bool pn_is_current(pn_delivery_t *delivery)
+{
+  pn_link_t *link = delivery->link;
+  return pn_link_current(link) == delivery;
+}
+
+void pn_delivery_dump(pn_delivery_t *d)
+{
+  char tag[1024];
+  pn_quote_data(tag, 1024, d->tag, d->tag_size);
+  printf("{tag=%s, local_state=%u, remote_state=%u, local_settled=%u, "
+         "remote_settled=%u, updated=%u, current=%u, writable=%u, readable=%u, "
+         "work=%u}",
+         tag, d->local_state, d->remote_state, d->local_settled,
+         d->remote_settled, d->updated, pn_is_current(d),
+         pn_delivery_writable(d), pn_delivery_readable(d), d->work);
+}
+
+void *pn_delivery_get_context(pn_delivery_t *delivery)
+{
+    return delivery ? delivery->context : NULL;
+}
+
+void pn_delivery_set_context(pn_delivery_t *delivery, void *context)
+{
+    if (delivery)
+        delivery->context = context;
+}
+
+uint8_t pn_delivery_get_priority(pn_delivery_t *delivery)
+{
+  return delivery ? delivery->priority : PN_DEFAULT_PRIORITY;
+}
+
+void pn_sched_set_priority(pn_delivery_t *delivery, uint8_t priority);
+
+void pn_delivery_set_priority(pn_delivery_t *delivery, uint8_t priority)
+{
+  if (delivery) {
+    pn_sched_set_priority(delivery, priority);
+  }
+}
+
+pn_delivery_tag_t pn_delivery_tag(pn_delivery_t *delivery)
+{
+  if (delivery) {
+    return pn_dtag(delivery->tag, delivery->tag_size);
+  } else {
+    return (pn_delivery_tag_t) {0};
+  }
+}
+
+pn_delivery_t *pn_link_current(pn_link_t *link)
+{
+  if (!link) return NULL;
+  return link->current;
+}
+
+void pn_advance_sender(pn_link_t *link)
+{
+  link->current->done = true;
+  pn_link_queue(link, 1);
+  link->credit--;
+  pn_metrics_starved(NULL, link);
+  pn_add_tpwork(link->current);
+  link->current = link->current->unsettled_next;
+}
+
+static void pn_link_replenish(pn_link_t *link)
+{
+  if (link->credit_window > 0 && (int) link->credit <= link->credit_window_low) {
+    pn_link_flow(link, link->credit_window - link->credit);
+  }
+}
+
+void pn_advance_receiver(pn_link_t *link)
+{
+  link->credit--;
+  pn_link_queue(link, -1);
+  link->current = link->current->unsettled_next;
+  pn_link_replenish(link);
+}
+
+bool pn_link_advance(pn_link_t *link)
+{
+  if (link && link->current) {
+    pn_delivery_t *prev = link->current;
+    if (link->endpoint.type == SENDER) {
+      pn_advance_sender(link);
+    } else {
+      pn_advance_receiver(link);
+    }
+    pn_delivery_t *next = link->current;
+    pn_work_update(link->session->connection, prev);
+    if (next) pn_work_update(link->session->connection, next);
+    return prev != next;
+  } else {
+    return false;
+  }
+}
+
+int pn_link_credit(pn_link_t *link)
+{
+  return link ? link->credit : 0;
+}
+
+int pn_link_get_credit_low_water(pn_link_t *link)
+{
+  return link ? link->credit_low_water : -1;
+}
+
+void pn_link_set_credit_low_water(pn_link_t *link, int low_water)
+{
+  if (link && pn_link_is_receiver(link)) {
+    link->credit_low_water = low_water;
+    pn_modified(link->session->connection, &link->endpoint);
+  }
+}
+
+int pn_link_get_credit_window(pn_link_t *link)
+{
+  return link ? link->credit_window : 0;
+}
+
+void pn_link_set_credit_window(pn_link_t *link, int window, int low_water)
+{
+  if (link && pn_link_is_receiver(link)) {
+    link->credit_window = window > 0 ? window : 0;
+    link->credit_window_low = low_water < window ? low_water : window - 1;
+    pn_link_replenish(link);
+  }
+}
+
+// the session keeps totals over its budgeted receivers so the window
+// it grants is found without visiting each link, a receiver's share is
+// taken out before its buffered bytes or budget change and put back after
+static void pn_link_budget(pn_link_t *link, int sign)
+{
+  if (!link->max_buffered) return;
+  pn_session_t *ssn = link->session;
+  ssn->budgeted += sign;
+  if (link->buffered >= link->max_buffered) {
+    ssn->over_budget += sign;
+  } else {
+    ssn->budget_room += sign*(link->max_buffered - link->buffered);
+  }
+}
+
+// accounts for unread bytes leaving a receiver, the window its
+// session can grant may have grown if the receiver has a budget
+static void pn_link_consumed(pn_link_t *link, size_t size)
+{
+  if (!size) return;
+  pn_link_budget(link, -1);
+  link->buffered -= size;
+  pn_link_budget(link, 1);
+  if (link->max_buffered) {
+    pn_modified(link->session->connection, &link->session->endpoint);
+  }
+}
+
+size_t pn_link_buffered(pn_link_t *link)
+{
+  return link ? link->buffered : 0;
+}
+
+size_t pn_link_get_max_buffered(pn_link_t *link)
+{
+  return link ? link->max_buffered : 0;
+}
+
+void pn_link_set_max_buffered(pn_link_t *link, size_t max_buffered)
+{
+  if (link && pn_link_is_receiver(link)) {
+    pn_link_budget(link, -1);
+    link->max_buffered = max_buffered;
+    pn_link_budget(link, 1);
+    pn_modified(link->session->connection, &link->session->endpoint);
+  }
+}
+
+pn_snd_settle_mode_t pn_link_get_snd_settle_mode(pn_link_t *link)
 {
-  pn_link_t *link = delivery->link;
-  return pn_link_current(link) == delivery;
+  return link ? link->snd_settle_mode : PN_SND_MIXED;
 }
 
-void pn_delivery_dump(pn_delivery_t *d)
+void pn_link_set_snd_settle_mode(pn_link_t *link, pn_snd_settle_mode_t mode)
 {
-  char tag[1024];
-  pn_bytes_t bytes = pn_buffer_bytes(d->tag);
-  pn_quote_data(tag, 1024, bytes.start, bytes.size);
-  printf("{tag=%s, local_state=%u, remote_state=%u, local_settled=%u, "
-         "remote_settled=%u, updated=%u, current=%u, writable=%u, readable=%u, "
-         "work=%u}",
-         tag, d->local_state, d->remote_state, d->local_settled,
-         d->remote_settled, d->updated, pn_is_current(d),
-         pn_delivery_writable(d), pn_delivery_readable(d), d->work);
+  if (link) link->snd_settle_mode = mode;
 }
 
-void *pn_delivery_get_context(pn_delivery_t *delivery)
+pn_snd_settle_mode_t pn_link_remote_snd_settle_mode(pn_link_t *link)
 {
-    return delivery ? delivery->context : NULL;
+  return link ? link->remote_snd_settle_mode : PN_SND_MIXED;
 }
 
-void pn_delivery_set_context(pn_delivery_t *delivery, void *context)
+uint8_t pn_link_get_priority(pn_link_t *link)
 {
-    if (delivery)
-        delivery->context = context;
+  return link ? link->priority : 0;
 }
 
-pn_delivery_tag_t pn_delivery_tag(pn_delivery_t *delivery)
+void pn_sched_update(pn_connection_t *conn, pn_link_t *link);
+
+void pn_link_set_priority(pn_link_t *link, uint8_t priority)
 {
-  if (delivery) {
-    pn_bytes_t tag = pn_buffer_bytes(delivery->tag);
-    return pn_dtag(tag.start, tag.size);
-  } else {
-    return (pn_delivery_tag_t) {0};
+  if (link) {
+    link->priority = priority;
+    pn_sched_update(link->session->connection, link);
   }
 }
 
-pn_delivery_t *pn_link_current(pn_link_t *link)
+uint32_t pn_link_get_weight(pn_link_t *link)
 {
-  if (!link) return NULL;
-  return link->current;
+  return link ? link->weight : 0;
 }
 
-void pn_advance_sender(pn_link_t *link)
+void pn_link_set_weight(pn_link_t *link, uint32_t weight)
 {
-  link->current->done = true;
-  link->queued++;
-  link->credit--;
-  pn_add_tpwork(link->current);
-  link->current = link->current->unsettled_next;
+  if (link && weight) {
+    link->weight = weight;
+  }
 }
 
-void pn_advance_receiver(pn_link_t *link)
+int pn_link_available(pn_link_t *link)
 {
-  link->credit--;
-  link->queued--;
-  link->current = link->current->unsettled_next;
+  return link ? link->available : 0;
 }
 
-bool pn_link_advance(pn_link_t *link)
+int pn_link_queued(pn_link_t *link)
 {
-  if (link && link->current) {
-    pn_delivery_t *prev = link->current;
-    if (link->endpoint.type == SENDER) {
-      pn_advance_sender(link);
-    } else {
-      pn_advance_receiver(link);
-    }
-    pn_delivery_t *next = link->current;
-    pn_work_update(link->session->connection, prev);
-    if (next) pn_work_update(link->session->connection, next);
-    return prev != next;
-  } else {
-    return false;
-  }
+  return link ? link->queued : 0;
 }
 
-int pn_link_credit(pn_link_t *link)
+int pn_connection_outgoing(pn_connection_t *connection)
 {
-  return link ? link->credit : 0;
+  return connection ? connection->outgoing : 0;
 }
 
-int pn_link_available(pn_link_t *link)
+int pn_connection_incoming(pn_connection_t *connection)
 {
-  return link ? link->available : 0;
+  return connection ? connection->incoming : 0;
 }
 
-int pn_link_queued(pn_link_t *link)
+int pn_connection_unresolved(pn_connection_t *connection)
 {
-  return link ? link->queued : 0;
+  return connection ? connection->unresolved : 0;
 }
 
 void pn_real_settle(pn_delivery_t *delivery)
 {
   pn_link_t *link = delivery->link;
+  if (pn_link_is_receiver(link)) {
+    pn_link_consumed(link, pn_delivery_pending(delivery));
+  }
   LL_REMOVE(link, unsettled, delivery);
   // TODO: what if we settle the current delivery?
-  LL_ADD(link, settled, delivery);
-  pn_buffer_clear(delivery->tag);
-  pn_buffer_clear(delivery->bytes);
+  pn_delivery_release(link->session->connection, delivery);
   delivery->settled = true;
 }
 
@@ -1341,6 +2414,17 @@ void pn_delivery_settle(pn_delivery_t *delivery)
 
   link->unsettled_count--;
   delivery->local_settled = true;
+  pn_delivery_resolve(delivery);
+
+  // a pre-settled delivery that has already been written or read has
+  // no transport state and nothing left to tell the peer
+  if (!delivery->transport_context && delivery->remote_settled) {
+    pn_clear_work(link->session->connection, delivery);
+    pn_clear_tpwork(delivery);
+    pn_real_settle(delivery);
+    return;
+  }
+
   pn_add_tpwork(delivery);
   pn_work_update(delivery->link->session->connection, delivery);
 }
@@ -1349,14 +2433,14 @@ int pn_post_close(pn_transport_t *transport, const char *condition)
 {
   pn_condition_t *cond = NULL;
   if (transport->connection) {
-    cond = pn_connection_condition(transport->connection);
+    cond = transport->connection->endpoint.condition;
   }
   const char *description = NULL;
   pn_data_t *info = NULL;
   if (!condition && pn_condition_is_set(cond)) {
     condition = pn_condition_get_name(cond);
     description = pn_condition_get_description(cond);
-    info = pn_condition_info(cond);
+    info = cond->info;
   }
 
   return pn_post_frame(transport->disp, 0, "DL[?DL[sSC]]", CLOSE,
@@ -1438,14 +2522,18 @@ int pn_do_begin(pn_dispatcher_t *disp)
 
   pn_session_state_t *state;
   if (reply) {
-    // XXX: what if session is NULL?
+    if (remote_channel >= transport->session_capacity ||
+        !transport->sessions[remote_channel].session) {
+      return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", remote_channel);
+    }
     state = &transport->sessions[remote_channel];
   } else {
     pn_session_t *ssn = pn_session(transport->connection);
     state = pn_session_get_state(transport, ssn);
   }
   state->incoming_transfer_count = next;
-  pn_map_channel(transport, disp->channel, state);
+  err = pn_map_channel(transport, disp->channel, state);
+  if (err) return err;
   PN_SET_REMOTE(state->session->endpoint.state, PN_REMOTE_ACTIVE);
 
   return 0;
@@ -1495,9 +2583,11 @@ int pn_do_attach(pn_dispatcher_t *disp)
   pn_bytes_t src_exp, tgt_exp;
   pn_seconds_t src_timeout, tgt_timeout;
   bool src_dynamic, tgt_dynamic;
+  bool snd_settle_mode_set;
+  uint8_t snd_settle_mode;
   pn_sequence_t idc;
-  int err = pn_scan_args(disp, "D.[SIo..D.[SIsIo]D.[SIsIo]..I]", &name, &handle,
-                         &is_sender,
+  int err = pn_scan_args(disp, "D.[SIo?B.D.[SIsIo]D.[SIsIo]..I]", &name, &handle,
+                         &is_sender, &snd_settle_mode_set, &snd_settle_mode,
                          &source, &src_dr, &src_exp, &src_timeout, &src_dynamic,
                          &target, &tgt_dr, &tgt_exp, &tgt_timeout, &tgt_dynamic,
                          &idc);
@@ -1507,6 +2597,9 @@ int pn_do_attach(pn_dispatcher_t *disp)
   strname[name.size] = '\0';
 
   pn_session_state_t *ssn_state = pn_channel_state(transport, disp->channel);
+  if (!ssn_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", disp->channel);
+  }
   pn_link_state_t *link_state = pn_find_link(ssn_state, name, is_sender);
   pn_link_t *link;
   if (!link_state) {
@@ -1520,7 +2613,8 @@ int pn_do_attach(pn_dispatcher_t *disp)
     link = link_state->link;
   }
 
-  pn_map_handle(ssn_state, handle, link_state);
+  err = pn_map_handle(ssn_state, handle, link_state);
+  if (err) return err;
   PN_SET_REMOTE(link->endpoint.state, PN_REMOTE_ACTIVE);
   pn_terminus_t *rsrc = &link_state->link->remote_source;
   if (source.start) {
@@ -1568,6 +2662,9 @@ int pn_do_attach(pn_dispatcher_t *disp)
   pn_data_rewind(link->remote_target.properties);
   pn_data_rewind(link->remote_target.capabilities);
 
+  link->remote_snd_settle_mode = snd_settle_mode_set ?
+    (pn_snd_settle_mode_t) snd_settle_mode : PN_SND_MIXED;
+
   if (!is_sender) {
     link_state->delivery_count = idc;
   }
@@ -1590,7 +2687,13 @@ int pn_do_transfer(pn_dispatcher_t *disp)
                          &more);
   if (err) return err;
   pn_session_state_t *ssn_state = pn_channel_state(transport, disp->channel);
+  if (!ssn_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", disp->channel);
+  }
   pn_link_state_t *link_state = pn_handle_state(ssn_state, handle);
+  if (!link_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such handle: %u", handle);
+  }
   pn_link_t *link = link_state->link;
   pn_delivery_t *delivery;
   if (link->unsettled_tail && !link->unsettled_tail->done) {
@@ -1608,12 +2711,19 @@ int pn_do_transfer(pn_dispatcher_t *disp)
     }
 
     delivery = pn_delivery(link, pn_dtag(tag.start, tag.size));
-    pn_delivery_state_t *state = pn_delivery_buffer_push(incoming, delivery);
-    delivery->transport_context = state;
-    if (id_present && id != state->id) {
+    pn_sequence_t expected = incoming->next;
+    if (link->remote_snd_settle_mode == PN_SND_SETTLED) {
+      // pre-settled deliveries consume an id but are never tracked
+      incoming->next++;
+      delivery->remote_settled = true;
+    } else {
+      pn_delivery_state_t *state = pn_delivery_buffer_push(incoming, delivery);
+      delivery->transport_context = state;
+    }
+    if (id_present && id != expected) {
       int err = pn_do_error(transport, "amqp:session:invalid-field",
                             "sequencing error, expected delivery-id %u, got %u",
-                            state->id, id);
+                            expected, id);
       // XXX: this will probably leave delivery buffer state messed up
       pn_full_settle(incoming, delivery);
       return err;
@@ -1621,17 +2731,34 @@ int pn_do_transfer(pn_dispatcher_t *disp)
 
     link_state->delivery_count++;
     link_state->link_credit--;
-    link->queued++;
+    pn_link_queue(link, 1);
   }
 
-  pn_buffer_append(delivery->bytes, disp->payload, disp->size);
+  if (disp->size) {
+    if (!delivery->bytes) delivery->bytes = pn_buffer(disp->size);
+    pn_buffer_append(delivery->bytes, disp->payload, disp->size);
+    pn_link_budget(link, -1);
+    link->buffered += disp->size;
+    pn_link_budget(link, 1);
+  }
   delivery->done = !more;
+  pn_metrics_received(link, disp->size, !more);
+  if (!more && !delivery->arrived) {
+    pn_connection_t *conn = transport->connection;
+    LL_ADD(conn, arrived, delivery);
+    delivery->arrived = true;
+  }
 
   ssn_state->incoming_transfer_count++;
   ssn_state->incoming_window--;
 
-  if (!ssn_state->incoming_window && (int32_t) link_state->local_handle >= 0) {
-    pn_post_flow(transport, ssn_state, link_state);
+  // flow updates are left to pn_process so that they coalesce
+  if (ssn_state->incoming_window <= link->session->incoming_low_water) {
+    pn_modified(transport->connection, &link->session->endpoint);
+  }
+  if (link->credit_low_water >= 0 &&
+      link_state->link_credit <= (pn_sequence_t) link->credit_low_water) {
+    pn_modified(transport->connection, &link->endpoint);
   }
 
   return 0;
@@ -1650,15 +2777,24 @@ int pn_do_flow(pn_dispatcher_t *disp)
   if (err) return err;
 
   pn_session_state_t *ssn_state = pn_channel_state(transport, disp->channel);
+  if (!ssn_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", disp->channel);
+  }
 
   if (inext_init) {
     ssn_state->outgoing_window = inext + iwin - ssn_state->outgoing_transfer_count;
   } else {
     ssn_state->outgoing_window = iwin;
   }
+  if (ssn_state->outgoing_window > 0) {
+    pn_metrics_stalled(transport, ssn_state->session, false);
+  }
 
   if (handle_init) {
     pn_link_state_t *link_state = pn_handle_state(ssn_state, handle);
+    if (!link_state) {
+      return pn_do_error(transport, "amqp:invalid-field", "no such handle: %u", handle);
+    }
     pn_link_t *link = link_state->link;
     if (link->endpoint.type == SENDER) {
       pn_sequence_t receiver_count;
@@ -1672,6 +2808,7 @@ int pn_do_flow(pn_dispatcher_t *disp)
       link_state->link_credit = receiver_count + link_credit - link_state->delivery_count;
       link->credit += link_state->link_credit - old;
       link->drain = drain;
+      pn_metrics_starved(transport, link);
       pn_delivery_t *delivery = pn_link_current(link);
       if (delivery) pn_work_update(transport->connection, delivery);
     } else {
@@ -1700,6 +2837,9 @@ int pn_do_disposition(pn_dispatcher_t *disp)
   if (!last_init) last = first;
 
   pn_session_state_t *ssn_state = pn_channel_state(transport, disp->channel);
+  if (!ssn_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", disp->channel);
+  }
   pn_disposition_t dispo = 0;
   if (code_init) {
     switch (code)
@@ -1724,15 +2864,18 @@ int pn_do_disposition(pn_dispatcher_t *disp)
     deliveries = &ssn_state->incoming;
   }
 
-  pn_sequence_t lwm = pn_delivery_buffer_lwm(deliveries);
-
-  for (pn_sequence_t id = first; id <= last; id++) {
-    if (id < lwm) continue;
-    pn_delivery_state_t *state = pn_delivery_buffer_get(deliveries, id - lwm);
+  // only the entries of the ring that fall within the range can refer
+  // to deliveries that still exist
+  size_t size = pn_delivery_buffer_size(deliveries);
+  for (size_t index = pn_delivery_buffer_find(deliveries, first); index < size; index++) {
+    pn_delivery_state_t *state = pn_delivery_buffer_get(deliveries, index);
+    if (state->id > last) break;
     pn_delivery_t *delivery = state->delivery;
     if (delivery) {
+      if (settled && !delivery->remote_settled) pn_metrics_settled(transport, delivery);
       delivery->remote_state = dispo;
       delivery->remote_settled = settled;
+      if (dispo || settled) pn_delivery_resolve(delivery);
       delivery->updated = true;
       pn_work_update(transport->connection, delivery);
     }
@@ -1741,17 +2884,26 @@ int pn_do_disposition(pn_dispatcher_t *disp)
   return 0;
 }
 
-static int pn_scan_error(pn_dispatcher_t *disp, pn_condition_t *condition, bool detach)
+static int pn_scan_error(pn_dispatcher_t *disp, pn_condition_t **condition, bool detach)
 {
+  bool set;
   pn_bytes_t cond;
   pn_bytes_t desc;
-  pn_condition_clear(condition);
-  int err = pn_scan_args(disp, detach ? "D.[..D.[sSC]" : "D.[D.[sSC]",
-                         &cond, &desc, condition->info);
+  if (*condition) pn_condition_clear(*condition);
+  int err = pn_scan_args(disp, detach ? "D.[..?D.[sS]" : "D.[?D.[sS]",
+                         &set, &cond, &desc);
   if (err) return err;
-  strncat(condition->name, cond.start, cond.size);
-  strncat(condition->description, desc.start, desc.size);
-  pn_data_rewind(condition->info);
+  // most frames carry no error, so only then is the condition needed
+  if (!set || !cond.size) return 0;
+
+  pn_condition_t *c = pn_condition_ensure(condition);
+  if (!c) return PN_ERR;
+  c->name = pn_strndup(cond.start, cond.size);
+  c->description = desc.size ? pn_strndup(desc.start, desc.size) : NULL;
+  pn_data_t *info = pn_condition_info(c);
+  err = pn_scan_args(disp, detach ? "D.[..D.[..C]" : "D.[D.[..C]", info);
+  if (err) return err;
+  pn_data_rewind(info);
   return 0;
 }
 
@@ -1768,12 +2920,15 @@ int pn_do_detach(pn_dispatcher_t *disp)
     return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", disp->channel);
   }
   pn_link_state_t *link_state = pn_handle_state(ssn_state, handle);
+  if (!link_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such handle: %u", handle);
+  }
   pn_link_t *link = link_state->link;
 
   err = pn_scan_error(disp, &link->endpoint.remote_condition, true);
   if (err) return err;
 
-  link_state->remote_handle = -2;
+  pn_unmap_handle(ssn_state, link_state);
 
   if (closed)
   {
@@ -1789,10 +2944,13 @@ int pn_do_end(pn_dispatcher_t *disp)
 {
   pn_transport_t *transport = (pn_transport_t *) disp->context;
   pn_session_state_t *ssn_state = pn_channel_state(transport, disp->channel);
+  if (!ssn_state) {
+    return pn_do_error(transport, "amqp:invalid-field", "no such channel: %u", disp->channel);
+  }
   pn_session_t *session = ssn_state->session;
   int err = pn_scan_error(disp, &session->endpoint.remote_condition, false);
   if (err) return err;
-  ssn_state->remote_channel = -2;
+  pn_unmap_channel(transport, ssn_state);
   PN_SET_REMOTE(session->endpoint.state, PN_REMOTE_CLOSED);
   return 0;
 }
@@ -1808,11 +2966,36 @@ int pn_do_close(pn_dispatcher_t *disp)
   return 0;
 }
 
+// appends the records to the file named by PN_TRACE_DUMP, once, so the
+// frames leading up to a failure are kept
+static void pn_transport_trace_failure(pn_transport_t *transport)
+{
+  if (transport->trace_dumped) return;
+  transport->trace_dumped = true;
+  const char *path = getenv("PN_TRACE_DUMP");
+  if (!path || !*path) return;
+
+  pn_recorder_t *recorder = &transport->disp->recorder;
+  size_t size = pn_recorder_size(recorder);
+  char *bytes = (char *) malloc(size);
+  if (!bytes) return;
+  ssize_t n = pn_recorder_dump(recorder, bytes, size);
+  FILE *out = fopen(path, "ab");
+  if (out) {
+    if (n > 0) fwrite(bytes, 1, n, out);
+    fclose(out);
+  }
+  free(bytes);
+}
+
 ssize_t pn_transport_input(pn_transport_t *transport, const char *bytes, size_t available)
 {
   if (!transport) return PN_ARG_ERR;
 
   size_t consumed = 0;
+#ifdef PN_METRICS
+  transport->clock = pn_i_clock();
+#endif
 
   const bool use_ssl = transport->ssl != NULL;
   while (true) {
@@ -1833,6 +3016,7 @@ ssize_t pn_transport_input(pn_transport_t *transport, const char *bytes, size_t
         pn_dispatcher_trace(transport->disp, 0, "ERROR[%i] %s\n",
                             pn_error_code(transport->error),
                             pn_error_text(transport->error));
+        pn_transport_trace_failure(transport);
       }
       if (transport->disp->trace & (PN_TRACE_RAW | PN_TRACE_FRM))
         pn_dispatcher_trace(transport->disp, 0, "<- EOS\n");
@@ -1966,9 +3150,10 @@ bool pn_delivery_buffered(pn_delivery_t *delivery)
   if (pn_link_is_sender(delivery->link)) {
     pn_delivery_state_t *state = (pn_delivery_state_t *) delivery->transport_context;
     if (state) {
-      return (delivery->done && !state->sent) || pn_buffer_size(delivery->bytes) > 0;
+      return (delivery->done && !state->sent) || pn_delivery_pending(delivery) > 0;
     } else {
-      return delivery->done;
+      // pre-settled deliveries are remotely settled once written
+      return delivery->done && !delivery->remote_settled;
     }
   } else {
     return false;
@@ -1998,6 +3183,26 @@ int pn_process_conn_setup(pn_transport_t *transport, pn_endpoint_t *endpoint)
   return 0;
 }
 
+// the window the session can grant, limited by the ring and by the
+// byte budget of any of its receivers
+static pn_sequence_t pn_session_incoming_window(pn_transport_t *transport, pn_session_state_t *ssn_state)
+{
+  size_t window = pn_delivery_buffer_available(&ssn_state->incoming);
+  pn_session_t *ssn = ssn_state->session;
+  if (!ssn->budgeted) return window;
+  uint32_t max_frame = transport->local_max_frame;
+  size_t frames;
+  if (ssn->over_budget) {
+    frames = 0;
+  } else if (max_frame) {
+    frames = (ssn->budget_room + max_frame - 1) / max_frame;
+  } else {
+    // a frame of any size may arrive, so take them one at a time
+    frames = 1;
+  }
+  return frames < window ? frames : window;
+}
+
 int pn_process_ssn_setup(pn_transport_t *transport, pn_endpoint_t *endpoint)
 {
   if (endpoint->type == SESSION && transport->open_sent)
@@ -2009,10 +3214,11 @@ int pn_process_ssn_setup(pn_transport_t *transport, pn_endpoint_t *endpoint)
       // XXX: we use the session id as the outgoing channel, we depend
       // on this for looking up via remote channel
       uint16_t channel = ssn->id;
+      state->incoming_window = pn_session_incoming_window(transport, state);
       pn_post_frame(transport->disp, channel, "DL[?HIII]", BEGIN,
                     ((int16_t) state->remote_channel >= 0), state->remote_channel,
                     state->outgoing_transfer_count,
-                    pn_delivery_buffer_available(&state->incoming),
+                    state->incoming_window,
                     pn_delivery_buffer_available(&state->outgoing));
       state->local_channel = channel;
     }
@@ -2051,10 +3257,11 @@ int pn_process_link_setup(pn_transport_t *transport, pn_endpoint_t *endpoint)
       // XXX
       state->local_handle = link->id;
       int err = pn_post_frame(transport->disp, ssn_state->local_channel,
-                              "DL[SIonn?DL[SIsIoCnCnCC]?DL[SIsIoCC]nnI]", ATTACH,
+                              "DL[SIo?Bn?DL[SIsIoCnCnCC]?DL[SIsIoCC]nnI]", ATTACH,
                               link->name,
                               state->local_handle,
                               endpoint->type == RECEIVER,
+                              link->snd_settle_mode != PN_SND_MIXED, link->snd_settle_mode,
                               (bool) link->source.type, SOURCE,
                               link->source.address,
                               link->source.durability,
@@ -2083,7 +3290,7 @@ int pn_process_link_setup(pn_transport_t *transport, pn_endpoint_t *endpoint)
 
 int pn_post_flow(pn_transport_t *transport, pn_session_state_t *ssn_state, pn_link_state_t *state)
 {
-  ssn_state->incoming_window = pn_delivery_buffer_available(&ssn_state->incoming);
+  ssn_state->incoming_window = pn_session_incoming_window(transport, ssn_state);
   bool link = (bool) state;
   return pn_post_frame(transport->disp, ssn_state->local_channel, "DL[?IIII?I?I?In?o]", FLOW,
                        (int16_t) ssn_state->remote_channel >= 0, ssn_state->incoming_transfer_count,
@@ -2103,10 +3310,15 @@ int pn_process_flow_receiver(pn_transport_t *transport, pn_endpoint_t *endpoint)
     pn_link_t *rcv = (pn_link_t *) endpoint;
     pn_session_state_t *ssn_state = pn_session_get_state(transport, rcv->session);
     pn_link_state_t *state = pn_link_get_state(ssn_state, rcv);
+    pn_sequence_t credit = rcv->credit - rcv->queued;
+    // with a low water mark, new credit is held back until the
+    // credit the sender holds falls to that mark
+    bool held = rcv->credit_low_water >= 0 && credit > state->link_credit &&
+      state->link_credit > (pn_sequence_t) rcv->credit_low_water;
     if ((int16_t) ssn_state->local_channel >= 0 &&
         (int32_t) state->local_handle >= 0 &&
-        ((rcv->drain || state->link_credit != rcv->credit - rcv->queued) || !ssn_state->incoming_window)) {
-      state->link_credit = rcv->credit - rcv->queued;
+        ((rcv->drain || (state->link_credit != credit && !held)) || !ssn_state->incoming_window)) {
+      state->link_credit = credit;
       return pn_post_flow(transport, ssn_state, state);
     }
   }
@@ -2116,19 +3328,16 @@ int pn_process_flow_receiver(pn_transport_t *transport, pn_endpoint_t *endpoint)
 
 int pn_flush_disp(pn_transport_t *transport, pn_session_state_t *ssn_state)
 {
-  uint64_t code = ssn_state->disp_code;
-  bool settled = ssn_state->disp_settled;
-  if (ssn_state->disp) {
-    int err = pn_post_frame(transport->disp, ssn_state->local_channel, "DL[oIIo?DL[]]", DISPOSITION,
-                            ssn_state->disp_type, ssn_state->disp_first, ssn_state->disp_last,
-                            settled, (bool)code, code);
-    if (err) return err;
-    ssn_state->disp_type = 0;
-    ssn_state->disp_code = 0;
-    ssn_state->disp_settled = 0;
-    ssn_state->disp_first = 0;
-    ssn_state->disp_last = 0;
-    ssn_state->disp = false;
+  for (int role = 0; role < 2; role++) {
+    pn_disp_set_t *set = &ssn_state->disp[role];
+    for (size_t i = 0; i < set->size; i++) {
+      pn_disp_range_t *range = &set->ranges[i];
+      int err = pn_post_frame(transport->disp, ssn_state->local_channel, "DL[oIIo?DL[]]", DISPOSITION,
+                              (bool) role, range->first, range->last,
+                              range->settled, (bool)range->code, range->code);
+      if (err) return err;
+    }
+    set->size = 0;
   }
   return 0;
 }
@@ -2160,68 +3369,167 @@ int pn_post_disp(pn_transport_t *transport, pn_delivery_t *delivery)
     return 0;
   }
 
-  if (ssn_state->disp && code == ssn_state->disp_code &&
-      delivery->local_settled == ssn_state->disp_settled &&
-      ssn_state->disp_type == (link->endpoint.type == RECEIVER)) {
-    if (state->id == ssn_state->disp_first - 1) {
-      ssn_state->disp_first = state->id;
-      return 0;
-    } else if (state->id == ssn_state->disp_last + 1) {
-      ssn_state->disp_last = state->id;
-      return 0;
+  pn_disp_set_t *set = &ssn_state->disp[link->endpoint.type == RECEIVER];
+  return pn_disp_set_add(set, state->id, code, delivery->local_settled);
+}
+
+// frame header and transfer performative around each slice of
+// payload, not counting the tag
+#define PN_TRANSFER_OVERHEAD (48)
+
+// writes as many frames of a delivery's pending bytes as the session
+// window allows, leaving the rest buffered for a later pass. Copied
+// bytes go first, then each ref is framed straight from the caller's
+// memory and released once nothing of it is left to write.
+static int pn_post_transfer(pn_transport_t *transport, pn_session_state_t *ssn_state,
+                            pn_link_state_t *link_state, pn_delivery_t *delivery,
+                            pn_sequence_t id, bool settled, size_t *budget, bool *complete)
+{
+  pn_bytes_t tag = pn_bytes(delivery->tag_size, delivery->tag);
+  size_t overhead = PN_TRANSFER_OVERHEAD + tag.size;
+  while (true) {
+    pn_delivery_ref_t *ref = NULL;
+    pn_bytes_t bytes = pn_bytes(0, NULL);
+    bool more;
+    if (delivery->bytes && pn_buffer_size(delivery->bytes)) {
+      // framed in place, what wraps around goes in the next slice
+      bytes = pn_buffer_head_bytes(delivery->bytes);
+      more = bytes.size < pn_buffer_size(delivery->bytes) || !delivery->done || delivery->ref_head;
+    } else if (delivery->ref_head) {
+      ref = delivery->ref_head;
+      bytes = pn_bytes(ref->size, (char *) ref->bytes);
+      more = !delivery->done || ref->ref_next;
+    } else {
+      more = !delivery->done;
+    }
+    if (bytes.size > *budget) {
+      bytes.size = *budget;
+      more = true;
     }
-  }
 
-  if (ssn_state->disp) {
-    int err = pn_flush_disp(transport, ssn_state);
+    pn_set_payload(transport->disp, bytes.start, bytes.size);
+    pn_sequence_t frames;
+    int err = pn_post_transfer_frame(transport->disp,
+                                     ssn_state->local_channel,
+                                     link_state->local_handle,
+                                     id, &tag,
+                                     0, // message-format
+                                     settled, more,
+                                     ssn_state->outgoing_window,
+                                     &frames);
+    size_t unsent = transport->disp->output_size;
+    pn_set_payload(transport->disp, NULL, 0);
     if (err) return err;
+    ssn_state->outgoing_transfer_count += frames;
+    ssn_state->outgoing_window -= frames;
+
+    size_t written = bytes.size - unsent;
+    *budget -= written;
+    pn_metrics_written(transport, delivery, written);
+    if (ref) {
+      ref->bytes += written;
+      ref->size -= written;
+      delivery->ref_size -= written;
+      if (!ref->size) pn_delivery_ref_pop(delivery);
+    } else if (delivery->bytes) {
+      pn_buffer_trim(delivery->bytes, written, 0);
+    }
+    if (unsent || !pn_delivery_pending(delivery) || !ssn_state->outgoing_window) break;
+    // the next slice goes in a frame of its own
+    if (*budget <= overhead) break;
+    *budget -= overhead;
+  }
+
+  *complete = delivery->done && !pn_delivery_pending(delivery);
+  return 0;
+}
+
+// writes a complete delivery on a pre-settled link, taking the next
+// delivery id without a slot in the outgoing ring unless the session
+// window cuts it short, in which case it falls back to a slot so the
+// remaining frames carry the same id
+static int pn_process_tpwork_presettled(pn_transport_t *transport, pn_session_state_t *ssn_state,
+                                        pn_link_state_t *link_state, pn_delivery_t *delivery,
+                                        size_t *budget)
+{
+  pn_link_t *link = delivery->link;
+  if (ssn_state->outgoing_window == 0 && link_state->link_credit > 0) {
+    pn_metrics_stalled(transport, link->session, true);
+  }
+  if (ssn_state->outgoing_window == 0 || link_state->link_credit == 0 || !*budget ||
+      !pn_delivery_buffer_available(&ssn_state->outgoing)) return 0;
+
+  bool complete;
+  int err = pn_post_transfer(transport, ssn_state, link_state, delivery,
+                             ssn_state->outgoing.next, true, budget, &complete);
+  if (err) return err;
+  if (!complete) {
+    delivery->transport_context = pn_delivery_buffer_push(&ssn_state->outgoing, delivery);
+    return 0;
   }
 
-  ssn_state->disp_type = (link->endpoint.type == RECEIVER);
-  ssn_state->disp_code = code;
-  ssn_state->disp_settled = delivery->local_settled;
-  ssn_state->disp_first = state->id;
-  ssn_state->disp_last = state->id;
-  ssn_state->disp = true;
+  ssn_state->outgoing.next++;
+  link_state->delivery_count++;
+  link_state->link_credit--;
+  pn_link_queue(link, -1);
+  pn_metrics_sent(transport, delivery);
+
+  // the peer will never settle it, so it is done with as soon as the
+  // application has settled it too
+  delivery->remote_settled = true;
+  pn_delivery_resolve(delivery);
+  if (delivery->local_settled) {
+    pn_full_settle(&ssn_state->outgoing, delivery);
+  } else {
+    pn_clear_tpwork(delivery);
+  }
 
   return 0;
 }
 
-int pn_process_tpwork_sender(pn_transport_t *transport, pn_delivery_t *delivery, bool* allocation_blocked)
+int pn_process_tpwork_sender(pn_transport_t *transport, pn_delivery_t *delivery, bool* allocation_blocked,
+                             size_t *budget)
 {
   pn_link_t *link = delivery->link;
   pn_session_state_t *ssn_state = pn_session_get_state(transport, link->session);
   pn_link_state_t *link_state = pn_link_get_state(ssn_state, link);
+  bool presettled = link->snd_settle_mode == PN_SND_SETTLED;
   if ((int16_t) ssn_state->local_channel >= 0 && (int32_t) link_state->local_handle >= 0) {
     pn_delivery_state_t *state = (pn_delivery_state_t *) delivery->transport_context;
+    if (!state && presettled) {
+      // deliveries still being written take a slot in the ring so that
+      // their remaining frames carry the same id
+      if (delivery->remote_settled) return 0;
+      if (delivery->done) {
+        return pn_process_tpwork_presettled(transport, ssn_state, link_state, delivery, budget);
+      }
+    }
     if (!(*allocation_blocked) && !state && pn_delivery_buffer_available(&ssn_state->outgoing)) {
       state = pn_delivery_buffer_push(&ssn_state->outgoing, delivery);
       delivery->transport_context = state;
-    } else {
+    } else if (!state) {
       *allocation_blocked = true;
     }
 
-    if (state && !state->sent && (delivery->done || pn_buffer_size(delivery->bytes) > 0) &&
-        ssn_state->outgoing_window > 0 && link_state->link_credit > 0) {
-      pn_bytes_t bytes = pn_buffer_bytes(delivery->bytes);
-      pn_set_payload(transport->disp, bytes.start, bytes.size);
-      pn_buffer_clear(delivery->bytes);
-      pn_bytes_t tag = pn_buffer_bytes(delivery->tag);
-      int err = pn_post_transfer_frame(transport->disp,
-                                       ssn_state->local_channel,
-                                       link_state->local_handle,
-                                       state->id, &tag,
-                                       0, // message-format
-                                       delivery->local_settled,
-                                       !delivery->done);
+    bool ready = state && !state->sent && (delivery->done || pn_delivery_pending(delivery) > 0);
+    if (ready && ssn_state->outgoing_window == 0 && link_state->link_credit > 0) {
+      pn_metrics_stalled(transport, link->session, true);
+    }
+    if (ready && ssn_state->outgoing_window > 0 && link_state->link_credit > 0 && *budget > 0) {
+      bool complete;
+      int err = pn_post_transfer(transport, ssn_state, link_state, delivery, state->id,
+                                 delivery->local_settled || presettled, budget, &complete);
       if (err) return err;
-      ssn_state->outgoing_transfer_count++;
-      ssn_state->outgoing_window--;
-      if (delivery->done) {
+      if (complete) {
         state->sent = true;
         link_state->delivery_count++;
         link_state->link_credit--;
-        link->queued--;
+        pn_link_queue(link, -1);
+        pn_metrics_sent(transport, delivery);
+        if (presettled) {
+          delivery->remote_settled = true;
+          pn_delivery_resolve(delivery);
+        }
       }
     }
   }
@@ -2252,13 +3560,169 @@ int pn_process_tpwork_receiver(pn_transport_t *transport, pn_delivery_t *deliver
   }
 
   if (delivery->local_settled) {
-    size_t available = pn_delivery_buffer_available(&ssn_state->incoming);
     pn_full_settle(&ssn_state->incoming, delivery);
-    if (!ssn_state->incoming_window &&
-        pn_delivery_buffer_available(&ssn_state->incoming) > available) {
-      int err = pn_post_flow(transport, ssn_state, NULL);
+    if (ssn_state->incoming_window <= link->session->incoming_low_water) {
+      pn_modified(transport->connection, &link->session->endpoint);
+    }
+  }
+
+  return 0;
+}
+
+// less room than this is left for the caller to drain first rather
+// than filled with a tiny frame
+#define PN_OUTPUT_MIN (512)
+
+static bool pn_output_full(pn_transport_t *transport)
+{
+  size_t pending = transport->disp->available;
+  if (pending >= transport->output_room) return true;
+  return (pending || transport->output_given) &&
+    transport->output_room - pending < PN_OUTPUT_MIN;
+}
+
+// the transfer payload a delivery may write now: what is left of its
+// link's turn in the current round, if there are turns, capped by the
+// room left in the buffer the caller is draining output into once the
+// frames it is cut into are paid for
+static size_t pn_output_allowance(pn_transport_t *transport, pn_delivery_t *delivery)
+{
+  if (pn_output_full(transport)) return 0;
+  size_t room = transport->output_room - transport->disp->available;
+  size_t overhead = PN_TRANSFER_OVERHEAD + delivery->tag_size;
+  size_t frame = transport->remote_max_frame ? transport->remote_max_frame : room;
+  size_t frames = room / frame + (room % frame ? 1 : 0);
+  size_t allowance = room > frames * overhead ? room - frames * overhead : 0;
+
+  if (transport->output_quantum) {
+    pn_link_t *link = delivery->link;
+    if (link->output_round != transport->output_round) {
+      link->output_round = transport->output_round;
+      link->output_used = 0;
+    }
+    if (link->output_used >= transport->output_quantum) return 0;
+    size_t turn = transport->output_quantum - link->output_used;
+    if (turn < allowance) allowance = turn;
+  }
+
+  return allowance < PN_OUTPUT_MIN ? PN_OUTPUT_MIN : allowance;
+}
+
+static int pn_process_tpwork_delivery(pn_transport_t *transport, pn_delivery_t *delivery,
+                                      bool *allocation_blocked, size_t allowance)
+{
+  pn_link_t *link = delivery->link;
+  if (pn_link_is_sender(link)) {
+    size_t budget = allowance;
+    int err = pn_process_tpwork_sender(transport, delivery, allocation_blocked, &budget);
+    if (err) return err;
+    link->output_used += allowance - budget;
+  } else {
+    int err = pn_process_tpwork_receiver(transport, delivery);
+    if (err) return err;
+  }
+
+  if (!pn_delivery_buffered(delivery)) {
+    pn_clear_tpwork(delivery);
+  }
+
+  return 0;
+}
+
+// works out whether and how much a delivery may write, a delivery that
+// has not started yet is skipped while its link has no turn left, and
+// nothing new is started once the output room is used up
+static bool pn_tpwork_admit(pn_transport_t *transport, pn_delivery_t *delivery,
+                            size_t *allowance, bool *waiting, bool *full)
+{
+  bool fresh = !delivery->transport_context;
+  *allowance = 0;
+  if (pn_output_full(transport)) {
+    *full = fresh;
+    return !fresh;
+  }
+
+  if (pn_link_is_sender(delivery->link)) {
+    *allowance = pn_output_allowance(transport, delivery);
+    if (!*allowance) {
+      *waiting = true;
+      return !fresh;
+    }
+  }
+
+  return true;
+}
+
+// writes the transfers of the links in the heap in scheduler order,
+// after any other transport work, a link whose next delivery cannot
+// go any further is parked until the end of the pass
+static int pn_process_sched(pn_transport_t *transport, pn_connection_t *conn,
+                            bool *allocation_blocked, bool *waiting, bool *full)
+{
+  pn_delivery_t *delivery = conn->tpwork_head;
+  while (delivery) {
+    pn_delivery_t *next = delivery->tpwork_next;
+    int err = pn_process_tpwork_delivery(transport, delivery, allocation_blocked, 0);
+    if (err) return err;
+    delivery = next;
+  }
+
+  int err = 0;
+  while (conn->sched_size && !*full) {
+    pn_link_t *link = conn->sched_heap[0];
+    delivery = link->sched_head;
+    bool fresh = !delivery->transport_context;
+    size_t allowance;
+    if (pn_tpwork_admit(transport, delivery, &allowance, waiting, full)) {
+      err = pn_process_tpwork_delivery(transport, delivery, allocation_blocked, allowance);
+      if (err) break;
+    }
+
+    // weighted fair queueing: each delivery a link starts pushes its
+    // next one 1/weight turns further into virtual time
+    if (conn->scheduler == PN_SCHED_WEIGHTED && fresh &&
+        (delivery->transport_context || !delivery->tpwork)) {
+      if ((int64_t) (link->sched_vtime - conn->sched_vtime) > 0) {
+        conn->sched_vtime = link->sched_vtime;
+      }
+      link->sched_vtime = conn->sched_vtime + PN_SCHED_TURN / link->weight;
+      pn_sched_update(conn, link);
+    }
+
+    if (delivery->tpwork) {
+      pn_sched_remove(conn, link);
+      link->sched_index = PN_SCHED_PARKED;
+      link->sched_parked_next = conn->sched_parked;
+      conn->sched_parked = link;
+    }
+  }
+
+  while (conn->sched_parked) {
+    pn_link_t *link = conn->sched_parked;
+    conn->sched_parked = link->sched_parked_next;
+    link->sched_parked_next = NULL;
+    link->sched_index = PN_SCHED_NONE;
+    pn_sched_update(conn, link);
+  }
+
+  return err;
+}
+
+static int pn_process_fifo(pn_transport_t *transport, pn_connection_t *conn,
+                           bool *allocation_blocked, bool *waiting, bool *full)
+{
+  pn_delivery_t *delivery = conn->tpwork_head;
+  while (delivery)
+  {
+    size_t allowance;
+    if (pn_tpwork_admit(transport, delivery, &allowance, waiting, full)) {
+      int err = pn_process_tpwork_delivery(transport, delivery, allocation_blocked, allowance);
       if (err) return err;
+    } else if (*full) {
+      break;
     }
+
+    delivery = delivery->tpwork_next;
   }
 
   return 0;
@@ -2269,29 +3733,21 @@ int pn_process_tpwork(pn_transport_t *transport, pn_endpoint_t *endpoint)
   if (endpoint->type == CONNECTION && !transport->close_sent)
   {
     pn_connection_t *conn = (pn_connection_t *) endpoint;
-    pn_delivery_t *delivery = conn->tpwork_head;
     bool allocation_blocked = false;
-    while (delivery)
-    {
-      if (!delivery->transport_context && transport->disp->available > 0) {
-        break;
-      }
-
-      pn_link_t *link = delivery->link;
-      if (pn_link_is_sender(link)) {
-        int err = pn_process_tpwork_sender(transport, delivery, &allocation_blocked);
-        if (err) return err;
-      } else {
-        int err = pn_process_tpwork_receiver(transport, delivery);
-        if (err) return err;
-      }
-
-      if (!pn_delivery_buffered(delivery)) {
-        pn_clear_tpwork(delivery);
-      }
 
-      delivery = delivery->tpwork_next;
-    }
+    bool waiting, full;
+    // rounds follow each other until the room is used up or no link
+    // has anything left to write, every round lets at least one link
+    // use up its turn, so this ends
+    do {
+      waiting = full = false;
+      int err = conn->scheduler == PN_SCHED_FIFO
+        ? pn_process_fifo(transport, conn, &allocation_blocked, &waiting, &full)
+        : pn_process_sched(transport, conn, &allocation_blocked, &waiting, &full);
+      if (err) return err;
+      // every link with work has had its turn
+      if (waiting && !full) transport->output_round++;
+    } while (waiting && !full);
   }
 
   return 0;
@@ -2312,6 +3768,28 @@ int pn_process_flush_disp(pn_transport_t *transport, pn_endpoint_t *endpoint)
   return 0;
 }
 
+// reopens the incoming window once it has fallen to the low water
+// mark, at most once per session per pass
+int pn_process_flow_session(pn_transport_t *transport, pn_endpoint_t *endpoint)
+{
+  if (endpoint->type == SESSION && !transport->close_sent)
+  {
+    pn_session_t *ssn = (pn_session_t *) endpoint;
+    pn_session_state_t *state = pn_session_get_state(transport, ssn);
+    if ((int16_t) state->local_channel >= 0) {
+      // a window already granted is withdrawn at once when a receiver
+      // has gone over its budget
+      pn_sequence_t window = pn_session_incoming_window(transport, state);
+      if ((state->incoming_window <= ssn->incoming_low_water && window > state->incoming_window) ||
+          window < state->incoming_window) {
+        return pn_post_flow(transport, state, NULL);
+      }
+    }
+  }
+
+  return 0;
+}
+
 int pn_process_flow_sender(pn_transport_t *transport, pn_endpoint_t *endpoint)
 {
   if (endpoint->type == SENDER && endpoint->state & PN_LOCAL_ACTIVE)
@@ -2354,10 +3832,10 @@ int pn_process_link_teardown(pn_transport_t *transport, pn_endpoint_t *endpoint)
       const char *description = NULL;
       pn_data_t *info = NULL;
 
-      if (pn_condition_is_set(&endpoint->condition)) {
-        name = pn_condition_get_name(&endpoint->condition);
-        description = pn_condition_get_description(&endpoint->condition);
-        info = pn_condition_info(&endpoint->condition);
+      if (pn_condition_is_set(endpoint->condition)) {
+        name = pn_condition_get_name(endpoint->condition);
+        description = pn_condition_get_description(endpoint->condition);
+        info = endpoint->condition->info;
       }
 
       int err = pn_post_frame(transport->disp, ssn_state->local_channel, "DL[Io?DL[sSC]]", DETACH,
@@ -2413,10 +3891,10 @@ int pn_process_ssn_teardown(pn_transport_t *transport, pn_endpoint_t *endpoint)
       const char *description = NULL;
       pn_data_t *info = NULL;
 
-      if (pn_condition_is_set(&endpoint->condition)) {
-        name = pn_condition_get_name(&endpoint->condition);
-        description = pn_condition_get_description(&endpoint->condition);
-        info = pn_condition_info(&endpoint->condition);
+      if (pn_condition_is_set(endpoint->condition)) {
+        name = pn_condition_get_name(endpoint->condition);
+        description = pn_condition_get_description(endpoint->condition);
+        info = endpoint->condition->info;
       }
 
       int err = pn_post_frame(transport->disp, state->local_channel, "DL[?DL[sSC]]", END,
@@ -2475,16 +3953,19 @@ int pn_process(pn_transport_t *transport)
   if ((err = pn_phase(transport, pn_process_tpwork))) return err;
 
   if ((err = pn_phase(transport, pn_process_flush_disp))) return err;
+  if ((err = pn_phase(transport, pn_process_flow_session))) return err;
 
   if ((err = pn_phase(transport, pn_process_flow_sender))) return err;
   if ((err = pn_phase(transport, pn_process_link_teardown))) return err;
   if ((err = pn_phase(transport, pn_process_ssn_teardown))) return err;
   if ((err = pn_phase(transport, pn_process_conn_teardown))) return err;
 
-  if (transport->connection->tpwork_head) {
+  if (transport->connection->tpwork_head || transport->connection->sched_size) {
     pn_modified(transport->connection, &transport->connection->endpoint);
   }
 
+  pn_delivery_pool_trim(transport->connection);
+
   return 0;
 }
 
@@ -2535,6 +4016,8 @@ static ssize_t pn_output_write_amqp(pn_transport_t *transport, char *bytes, size
     return 0;
   }
 
+  // transfers are only generated to fill what the caller can take now
+  transport->output_room = size;
   if (!pn_error_code(transport->error)) {
     pn_error_set(transport->error, pn_process(transport), "process error");
   }
@@ -2554,9 +4037,13 @@ ssize_t pn_transport_output(pn_transport_t *transport, char *bytes, size_t size)
   if (!transport) return PN_ARG_ERR;
 
   size_t total = 0;
+#ifdef PN_METRICS
+  transport->clock = pn_i_clock();
+#endif
 
   const bool use_ssl = transport->ssl != NULL;
 
+  transport->output_given = 0;
   while (size - total > 0) {
     ssize_t n;
     if (use_ssl)
@@ -2565,6 +4052,7 @@ ssize_t pn_transport_output(pn_transport_t *transport, char *bytes, size_t size)
       n = transport->process_output(transport, bytes + total, size - total);
     if (n > 0) {
       total += n;
+      transport->output_given = total;
     } else if (n == 0) {
       break;
     } else if (n == PN_EOS) {
@@ -2579,6 +4067,7 @@ ssize_t pn_transport_output(pn_transport_t *transport, char *bytes, size_t size)
       if (transport->disp->trace & (PN_TRACE_RAW | PN_TRACE_FRM))
         pn_dispatcher_trace(transport->disp, 0, "-> EOS (%zi) %s\n", n,
                             pn_error_text(transport->error));
+      pn_transport_trace_failure(transport);
       return n;
     }
   }
@@ -2611,6 +4100,16 @@ uint32_t pn_transport_get_remote_max_frame(pn_transport_t *transport)
   return transport->remote_max_frame;
 }
 
+size_t pn_transport_get_output_quantum(pn_transport_t *transport)
+{
+  return transport->output_quantum;
+}
+
+void pn_transport_set_output_quantum(pn_transport_t *transport, size_t quantum)
+{
+  transport->output_quantum = quantum;
+}
+
 pn_millis_t pn_transport_get_idle_timeout(pn_transport_t *transport)
 {
   return transport->local_idle_timeout;
@@ -2636,7 +4135,34 @@ ssize_t pn_link_send(pn_link_t *sender, const char *bytes, size_t n)
 {
   pn_delivery_t *current = pn_link_current(sender);
   if (!current) return PN_EOS;
-  pn_buffer_append(current->bytes, bytes, n);
+  if (current->ref_head) {
+    // queued behind referenced bytes, so it needs a copy of its own
+    char *copy = (char *) malloc(n);
+    if (!copy) return PN_ERR;
+    memcpy(copy, bytes, n);
+    if (pn_delivery_ref_push(current, copy, n, free, copy)) {
+      free(copy);
+      return PN_ERR;
+    }
+  } else {
+    if (!current->bytes) current->bytes = pn_buffer(n);
+    pn_buffer_append(current->bytes, bytes, n);
+  }
+  pn_add_tpwork(current);
+  return n;
+}
+
+ssize_t pn_link_send_ref(pn_link_t *sender, const char *bytes, size_t n,
+                         void (*release)(void *context), void *context)
+{
+  pn_delivery_t *current = pn_link_current(sender);
+  if (!current) return PN_EOS;
+  if (!n) {
+    if (release) release(context);
+    return 0;
+  }
+  int err = pn_delivery_ref_push(current, bytes, n, release, context);
+  if (err) return err;
   pn_add_tpwork(current);
   return n;
 }
@@ -2656,8 +4182,12 @@ ssize_t pn_link_recv(pn_link_t *receiver, char *bytes, size_t n)
 
   pn_delivery_t *delivery = receiver->current;
   if (delivery) {
-    size_t size = pn_buffer_get(delivery->bytes, 0, n, bytes);
-    pn_buffer_trim(delivery->bytes, size, 0);
+    size_t size = 0;
+    if (delivery->bytes) {
+      size = pn_buffer_get(delivery->bytes, 0, n, bytes);
+      pn_buffer_trim(delivery->bytes, size, 0);
+      pn_link_consumed(receiver, size);
+    }
     if (size) {
       return size;
     } else {
@@ -2706,6 +4236,24 @@ uint64_t pn_transport_get_frames_input(const pn_transport_t *transport)
   return 0;
 }
 
+size_t pn_transport_get_trace_records(pn_transport_t *transport)
+{
+  if (!transport) return 0;
+  return transport->disp->recorder.capacity;
+}
+
+int pn_transport_set_trace_records(pn_transport_t *transport, size_t records)
+{
+  if (!transport) return PN_ARG_ERR;
+  return pn_recorder_resize(&transport->disp->recorder, records);
+}
+
+ssize_t pn_transport_trace_dump(pn_transport_t *transport, char *bytes, size_t size)
+{
+  if (!transport) return PN_ARG_ERR;
+  return pn_recorder_dump(&transport->disp->recorder, bytes, size);
+}
+
 pn_link_t *pn_delivery_link(pn_delivery_t *delivery)
 {
   if (!delivery) return NULL;
@@ -2765,7 +4313,7 @@ bool pn_delivery_readable(pn_delivery_t *delivery)
 
 size_t pn_delivery_pending(pn_delivery_t *delivery)
 {
-  return pn_buffer_size(delivery->bytes);
+  return (delivery->bytes ? pn_buffer_size(delivery->bytes) : 0) + delivery->ref_size;
 }
 
 bool pn_delivery_partial(pn_delivery_t *delivery)
@@ -2776,96 +4324,95 @@ bool pn_delivery_partial(pn_delivery_t *delivery)
 pn_condition_t *pn_connection_condition(pn_connection_t *connection)
 {
   assert(connection);
-  return &connection->endpoint.condition;
+  return pn_condition_ensure(&connection->endpoint.condition);
 }
 
 pn_condition_t *pn_connection_remote_condition(pn_connection_t *connection)
 {
   assert(connection);
   pn_transport_t *transport = connection->transport;
-  return transport ? &transport->remote_condition : NULL;
+  return transport ? pn_condition_ensure(&transport->remote_condition) : NULL;
 }
 
 pn_condition_t *pn_session_condition(pn_session_t *session)
 {
   assert(session);
-  return &session->endpoint.condition;
+  return pn_condition_ensure(&session->endpoint.condition);
 }
 
 pn_condition_t *pn_session_remote_condition(pn_session_t *session)
 {
   assert(session);
-  return &session->endpoint.remote_condition;
+  return pn_condition_ensure(&session->endpoint.remote_condition);
 }
 
 pn_condition_t *pn_link_condition(pn_link_t *link)
 {
   assert(link);
-  return &link->endpoint.condition;
+  return pn_condition_ensure(&link->endpoint.condition);
 }
 
 pn_condition_t *pn_link_remote_condition(pn_link_t *link)
 {
   assert(link);
-  return &link->endpoint.remote_condition;
+  return pn_condition_ensure(&link->endpoint.remote_condition);
 }
 
 bool pn_condition_is_set(pn_condition_t *condition)
 {
-  return condition && condition->name[0];
+  return condition && condition->name;
 }
 
 void pn_condition_clear(pn_condition_t *condition)
 {
   assert(condition);
-  condition->name[0] = '\0';
-  condition->description[0] = '\0';
-  pn_data_clear(condition->info);
+  free(condition->name);
+  condition->name = NULL;
+  free(condition->description);
+  condition->description = NULL;
+  if (condition->info) pn_data_clear(condition->info);
 }
 
 const char *pn_condition_get_name(pn_condition_t *condition)
 {
   assert(condition);
-  return condition->name[0] ? condition->name : NULL;
+  return condition->name;
 }
 
-static inline int pn_set_buf(char *dst, const char *src, size_t capacity)
+static inline int pn_set_str(char **dst, const char *src)
 {
-  if (!src) {
-    dst[0] = '\0';
-    return 0;
-  } else {
-    int n = strlen(src) + 1;
-    if (n > capacity) {
-      return PN_ARG_ERR;
-    } else {
-      strncpy(dst, src, n);
-      return 0;
-    }
+  char *copy = NULL;
+  if (src && src[0]) {
+    copy = pn_strdup(src);
+    if (!copy) return PN_ERR;
   }
+  free(*dst);
+  *dst = copy;
+  return 0;
 }
 
 int pn_condition_set_name(pn_condition_t *condition, const char *name)
 {
   assert(condition);
-  return pn_set_buf(condition->name, name, COND_NAME_MAX);
+  return pn_set_str(&condition->name, name);
 }
 
 const char *pn_condition_get_description(pn_condition_t *condition)
 {
   assert(condition);
-  return condition->description[0] ? condition->description : NULL;
+  return condition->description;
 }
 
 int pn_condition_set_description(pn_condition_t *condition, const char *description)
 {
   assert(condition);
-  return pn_set_buf(condition->description, description, COND_DESC_MAX);
+  return pn_set_str(&condition->description, description);
 }
 
 pn_data_t *pn_condition_info(pn_condition_t *condition)
 {
   assert(condition);
+  if (!condition->info) condition->info = pn_data(16);
   return condition->info;
 }
 
@@ -0,0 +1,160 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <proton/error.h>
+#include <stdlib.h>
+#include <string.h>
+#include "idmap.h"
+#include "util.h"
+
+void pn_idmap_init(pn_idmap_t *map)
+{
+  map->dense = NULL;
+  map->dense_capacity = 0;
+  map->entries = NULL;
+  map->capacity = 0;
+  map->size = 0;
+}
+
+void pn_idmap_tini(pn_idmap_t *map)
+{
+  free(map->dense);
+  free(map->entries);
+  pn_idmap_init(map);
+}
+
+// ids are chosen by the peer, so scramble them before masking
+static size_t pn_idmap_slot(pn_idmap_t *map, uint32_t id)
+{
+  id ^= id >> 16;
+  id *= 0x85ebca6b;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35;
+  id ^= id >> 16;
+  return id & (map->capacity - 1);
+}
+
+static pn_idmap_entry_t *pn_idmap_find(pn_idmap_t *map, uint32_t id)
+{
+  if (!map->capacity) return NULL;
+
+  size_t i = pn_idmap_slot(map, id);
+  while (map->entries[i].value) {
+    if (map->entries[i].id == id) return &map->entries[i];
+    i = (i + 1) & (map->capacity - 1);
+  }
+
+  return NULL;
+}
+
+static void pn_idmap_insert(pn_idmap_t *map, uint32_t id, void *value)
+{
+  size_t i = pn_idmap_slot(map, id);
+  while (map->entries[i].value) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  map->entries[i].id = id;
+  map->entries[i].value = value;
+  map->size++;
+}
+
+static int pn_idmap_grow(pn_idmap_t *map)
+{
+  pn_idmap_entry_t *old = map->entries;
+  size_t old_capacity = map->capacity;
+  size_t capacity = old_capacity ? 2*old_capacity : 16;
+
+  pn_idmap_entry_t *entries = calloc(capacity, sizeof(pn_idmap_entry_t));
+  if (!entries) return PN_ERR;
+
+  map->entries = entries;
+  map->capacity = capacity;
+  map->size = 0;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].value) pn_idmap_insert(map, old[i].id, old[i].value);
+  }
+
+  free(old);
+  return 0;
+}
+
+// backward shift deletion keeps every probe chain unbroken without
+// leaving tombstones behind
+static void pn_idmap_erase(pn_idmap_t *map, pn_idmap_entry_t *entry)
+{
+  size_t mask = map->capacity - 1;
+  size_t hole = entry - map->entries;
+  size_t i = hole;
+
+  while (true) {
+    i = (i + 1) & mask;
+    if (!map->entries[i].value) break;
+    size_t home = pn_idmap_slot(map, map->entries[i].id);
+    // move the entry back unless its home lies cyclically in (hole, i]
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      map->entries[hole] = map->entries[i];
+      hole = i;
+    }
+  }
+
+  map->entries[hole].value = NULL;
+  map->size--;
+}
+
+void *pn_idmap_get(pn_idmap_t *map, uint32_t id)
+{
+  if (id < PN_IDMAP_DENSE) {
+    return id < map->dense_capacity ? map->dense[id] : NULL;
+  }
+
+  pn_idmap_entry_t *entry = pn_idmap_find(map, id);
+  return entry ? entry->value : NULL;
+}
+
+int pn_idmap_put(pn_idmap_t *map, uint32_t id, void *value)
+{
+  if (id < PN_IDMAP_DENSE) {
+    if (id >= map->dense_capacity) {
+      if (!value) return 0;
+      PN_ENSUREZ(map->dense, map->dense_capacity, id + 1);
+      if (!map->dense) return PN_ERR;
+    }
+    map->dense[id] = value;
+    return 0;
+  }
+
+  pn_idmap_entry_t *entry = pn_idmap_find(map, id);
+  if (entry) {
+    if (value) entry->value = value;
+    else pn_idmap_erase(map, entry);
+    return 0;
+  }
+
+  if (!value) return 0;
+
+  if (2*(map->size + 1) > map->capacity) {
+    int err = pn_idmap_grow(map);
+    if (err) return err;
+  }
+
+  pn_idmap_insert(map, id, value);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _PROTON_SRC_IDMAP_H
+#define _PROTON_SRC_IDMAP_H 1
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// maps the ids a peer picks, such as channels and handles, to state;
+// ids below PN_IDMAP_DENSE index an array directly, and the rest live
+// in an open addressing hash, so memory follows the number of ids in
+// use rather than the largest of them
+#define PN_IDMAP_DENSE (256)
+
+typedef struct {
+  uint32_t id;
+  void *value; // NULL when the slot is free
+} pn_idmap_entry_t;
+
+typedef struct {
+  void **dense;
+  size_t dense_capacity;
+  pn_idmap_entry_t *entries;
+  size_t capacity; // zero or a power of two
+  size_t size;
+} pn_idmap_t;
+
+// a zeroed map is an empty map
+void pn_idmap_init(pn_idmap_t *map);
+void pn_idmap_tini(pn_idmap_t *map);
+void *pn_idmap_get(pn_idmap_t *map, uint32_t id);
+// a NULL value removes the id
+int pn_idmap_put(pn_idmap_t *map, uint32_t id, void *value);
+
+#endif /* idmap.h */
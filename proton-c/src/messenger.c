@@ -31,25 +31,43 @@
 #include <sys/time.h>
 #include "util.h"
 #include "platform.h"
+#include "strmap.h"
+#include "mpsc.h"
 
+// tracked deliveries live in a ring indexed by sequence, so adding,
+// finding and retiring one does not move the others; slots retired
+// below hwm are NULL until lwm passes them
 typedef struct {
-  size_t capacity;
+  size_t capacity; // a power of two, never less than hwm - lwm
   int window;
   pn_sequence_t lwm;
   pn_sequence_t hwm;
   pn_delivery_t **deliveries;
 } pn_queue_t;
 
+typedef struct pn_link_ctx_t pn_link_ctx_t;
+
 struct pn_messenger_t {
   char *name;
   char *certificate;
   char *private_key;
   char *password;
   char *trusted_certificates;
+  // ssl domains are built on first use and shared by every connection
+  // until the credentials change; each connection holds a reference
+  pn_ssl_domain_t *client_domain;
+  pn_ssl_domain_t *server_domain;  // for amqps subscriptions
+  pn_ssl_domain_t *mixed_domain;   // for amqp ones, also accepts clients without ssl
+  bool ssl_resume;
   int timeout;
+  bool blocking;
   pn_driver_t *driver;
   int credit;
   int distributed;
+  uint32_t flow_seed;      // picks where the rounding of an allocation falls
+  pn_link_ctx_t *returning_head; // receivers asked to drain, until the sender holds none
+  pn_link_ctx_t *returning_tail;
+  bool starved;            // a receiver ran out of credit since the last drain or allocation
   uint64_t next_tag;
   pn_queue_t outgoing;
   pn_queue_t incoming;
@@ -59,7 +77,17 @@ struct pn_messenger_t {
   size_t sub_count;
   pn_subscription_t *incoming_subscription;
   pn_buffer_t *buffer;
+  size_t batch_size;       // what put_batch last encoded, a guess at the next message
   pn_error_t *error;
+  pn_strmap_t senders;     // address -> sender link
+  pn_strmap_t connections; // domain -> connection
+  pn_delivery_t **ready;   // complete incoming deliveries, oldest first
+  size_t ready_capacity;   // zero or a power of two
+  size_t ready_head;
+  size_t ready_count;
+  int complete;            // deliveries arrived in full and not yet read
+  pn_mpsc_t handoff;       // messages put by other threads
+  int handoff_pending;     // set by the first handoff since the last adoption
 };
 
 struct pn_subscription_t {
@@ -67,6 +95,34 @@ struct pn_subscription_t {
   void *context;
 };
 
+// the credit a receiver holds and how quickly it is being used; the
+// rate is smoothed over allocations and kept in sixteenths of a read
+struct pn_link_ctx_t {
+  pn_link_t *link;
+  pn_subscription_t *subscription;
+  int held;  // the credit granted, less what has been read since
+  int reads; // deliveries read since the last allocation
+  int complete; // deliveries arrived in full and not yet read
+  int rate;
+  bool draining;
+  bool returning; // credit it was asked to drain may still come back
+  pn_link_ctx_t *returning_next;
+  pn_link_ctx_t *returning_prev;
+  int parked; // allocations a drained receiver sits out
+};
+
+#define PN_PARKED_ALLOCATIONS (8)
+
+// a message encoded by pn_messenger_put_async, in one allocation with
+// its address and encoded bytes, that the delivery takes over
+typedef struct {
+  pn_mpsc_node_t node;
+  uint8_t priority;
+  char *address;
+  char *bytes;
+  size_t size;
+} pn_handoff_t;
+
 typedef struct {
   int refcount;
   char *address;
@@ -96,28 +152,41 @@ bool pn_queue_contains(pn_queue_t *queue, pn_sequence_t id)
   return (id - queue->lwm >= 0) && (queue->hwm - id > 0);
 }
 
+static inline size_t pn_queue_slot(pn_queue_t *queue, pn_sequence_t id)
+{
+  return (uint32_t) id & (queue->capacity - 1);
+}
+
 pn_delivery_t *pn_queue_get(pn_queue_t *queue, pn_sequence_t id)
 {
   if (pn_queue_contains(queue, id)) {
-    size_t offset = id - queue->lwm;
-    assert(offset >= 0 && offset < queue->capacity);
-    return queue->deliveries[offset];
+    return queue->deliveries[pn_queue_slot(queue, id)];
   } else {
     return NULL;
   }
 }
 
+// each sequence is passed over once, so this is O(1) amortized
 void pn_queue_gc(pn_queue_t *queue)
 {
-  size_t count = queue->hwm - queue->lwm;
-  size_t delta = 0;
-
-  while (delta < count && !queue->deliveries[delta]) {
-    delta++;
+  while (queue->lwm != queue->hwm && !queue->deliveries[pn_queue_slot(queue, queue->lwm)]) {
+    queue->lwm++;
   }
+}
 
-  memmove(queue->deliveries, queue->deliveries + delta, (count - delta)*sizeof(pn_delivery_t *));
-  queue->lwm += delta;
+static void pn_queue_grow(pn_queue_t *queue)
+{
+  size_t old_capacity = queue->capacity;
+  PN_ENSUREZ(queue->deliveries, queue->capacity, old_capacity + 1);
+  // a sequence keeps its slot modulo the old capacity, so each entry
+  // either stays put or moves into the half just added
+  for (pn_sequence_t id = queue->lwm; id != queue->hwm; id++) {
+    if ((uint32_t) id & old_capacity) {
+      size_t slot = (uint32_t) id & (old_capacity - 1);
+      queue->deliveries[slot + old_capacity] = queue->deliveries[slot];
+      queue->deliveries[slot] = NULL;
+    }
+  }
 }
 
 static void pn_incref(pn_connection_t *conn)
@@ -131,6 +200,11 @@ static void pn_decref(pn_connection_t *conn)
   pn_connection_ctx_t *ctx = pn_connection_get_context(conn);
   ctx->refcount--;
   if (ctx->refcount == 0) {
+    pn_link_t *link = pn_link_head(conn, 0);
+    while (link) {
+      if (pn_link_is_receiver(link)) free(pn_link_get_context(link));
+      link = pn_link_next(link, 0);
+    }
     pn_connection_free(conn);
     free(ctx->scheme);
     free(ctx->user);
@@ -145,9 +219,7 @@ void pn_queue_del(pn_queue_t *queue, pn_delivery_t *delivery)
 {
   pn_sequence_t id = (pn_sequence_t) (intptr_t) pn_delivery_get_context(delivery);
   if (pn_queue_contains(queue, id)) {
-    size_t offset = id - queue->lwm;
-    assert(offset >= 0 && offset < queue->capacity);
-    queue->deliveries[offset] = NULL;
+    queue->deliveries[pn_queue_slot(queue, id)] = NULL;
     pn_delivery_set_context(delivery, NULL);
     pn_connection_t *conn =
       pn_session_connection(pn_link_session(pn_delivery_link(delivery)));
@@ -176,11 +248,11 @@ void pn_queue_slide(pn_queue_t *queue)
 
 pn_sequence_t pn_queue_add(pn_queue_t *queue, pn_delivery_t *delivery)
 {
+  if ((size_t) (queue->hwm - queue->lwm) == queue->capacity) {
+    pn_queue_grow(queue);
+  }
   pn_sequence_t id = queue->hwm++;
-  size_t offset = id - queue->lwm;
-  PN_ENSUREZ(queue->deliveries, queue->capacity, offset + 1);
-  assert(offset >= 0 && offset < queue->capacity);
-  queue->deliveries[offset] = delivery;
+  queue->deliveries[pn_queue_slot(queue, id)] = delivery;
   pn_delivery_set_context(delivery, (void *) (intptr_t) id);
   pn_connection_t *conn =
     pn_session_connection(pn_link_session(pn_delivery_link(delivery)));
@@ -196,37 +268,36 @@ int pn_queue_update(pn_queue_t *queue, pn_sequence_t id, pn_status_t status,
     return 0;
   }
 
-  size_t start;
-  if (PN_CUMULATIVE & flags) {
-    start = queue->lwm;
-  } else {
-    start = id;
-  }
-
-  for (pn_sequence_t i = start; i <= id; i++) {
-    pn_delivery_t *d = pn_queue_get(queue, i);
-    if (d) {
-      if (!pn_delivery_local_state(d)) {
-        if (match) {
-          pn_delivery_update(d, pn_delivery_remote_state(d));
-        } else {
-          switch (status) {
-          case PN_STATUS_ACCEPTED:
-            pn_delivery_update(d, PN_ACCEPTED);
-            break;
-          case PN_STATUS_REJECTED:
-            pn_delivery_update(d, PN_REJECTED);
-            break;
-          default:
-            break;
-          }
-        }
-      }
-      if (settle) {
-        pn_delivery_settle(d);
-        pn_queue_del(queue, d);
+  pn_disposition_t disposition = 0;
+  switch (status) {
+  case PN_STATUS_ACCEPTED:
+    disposition = PN_ACCEPTED;
+    break;
+  case PN_STATUS_REJECTED:
+    disposition = PN_REJECTED;
+    break;
+  default:
+    break;
+  }
+
+  // a cumulative update walks the ring slots of the whole range
+  // directly, and whatever it settles is collected once at the end
+  pn_sequence_t start = (PN_CUMULATIVE & flags) ? queue->lwm : id;
+  size_t mask = queue->capacity - 1;
+  for (pn_sequence_t i = start; i != id + 1; i++) {
+    pn_delivery_t *d = queue->deliveries[(uint32_t) i & mask];
+    if (!d) continue;
+    if (!pn_delivery_local_state(d)) {
+      if (match) {
+        pn_delivery_update(d, pn_delivery_remote_state(d));
+      } else if (disposition) {
+        pn_delivery_update(d, disposition);
       }
     }
+    if (settle) {
+      pn_delivery_settle(d);
+      pn_queue_del(queue, d);
+    }
   }
 
   pn_queue_gc(queue);
@@ -234,6 +305,98 @@ int pn_queue_update(pn_queue_t *queue, pn_sequence_t id, pn_status_t status,
   return 0;
 }
 
+// incoming deliveries that are complete and current on their link wait
+// in the ready queue, so finding the next message to read does not
+// mean searching every connection; a queued delivery is marked through
+// its context until it is read
+static char pn_ready_mark;
+
+static void pn_ready_push(pn_messenger_t *messenger, pn_delivery_t *delivery)
+{
+  if (pn_delivery_get_context(delivery) == &pn_ready_mark) return;
+
+  if (messenger->ready_count == messenger->ready_capacity) {
+    size_t old_capacity = messenger->ready_capacity;
+    PN_ENSURE(messenger->ready, messenger->ready_capacity, old_capacity + 1);
+    // unwrap the entries that wrapped around the old end
+    size_t wrapped = messenger->ready_head + messenger->ready_count;
+    for (size_t i = 0; wrapped > old_capacity && i < wrapped - old_capacity; i++) {
+      messenger->ready[old_capacity + i] = messenger->ready[i];
+    }
+  }
+
+  size_t tail = (messenger->ready_head + messenger->ready_count) & (messenger->ready_capacity - 1);
+  messenger->ready[tail] = delivery;
+  messenger->ready_count++;
+  pn_delivery_set_context(delivery, &pn_ready_mark);
+}
+
+static void pn_ready_shift(pn_messenger_t *messenger)
+{
+  pn_delivery_t *delivery = messenger->ready[messenger->ready_head];
+  pn_delivery_set_context(delivery, NULL);
+  messenger->ready_head = (messenger->ready_head + 1) & (messenger->ready_capacity - 1);
+  messenger->ready_count--;
+}
+
+static pn_delivery_t *pn_ready_head(pn_messenger_t *messenger)
+{
+  while (messenger->ready_count) {
+    pn_delivery_t *delivery = messenger->ready[messenger->ready_head];
+    if (pn_delivery_readable(delivery) && !pn_delivery_partial(delivery)) {
+      return delivery;
+    }
+    pn_ready_shift(messenger);
+  }
+  return NULL;
+}
+
+static pn_delivery_t *pn_ready_pop(pn_messenger_t *messenger)
+{
+  pn_delivery_t *delivery = pn_ready_head(messenger);
+  if (delivery) pn_ready_shift(messenger);
+  return delivery;
+}
+
+// drops the deliveries of a connection that is going away
+static void pn_ready_purge(pn_messenger_t *messenger, pn_connection_t *conn)
+{
+  size_t mask = messenger->ready_capacity - 1;
+  size_t kept = 0;
+  for (size_t i = 0; i < messenger->ready_count; i++) {
+    pn_delivery_t *delivery = messenger->ready[(messenger->ready_head + i) & mask];
+    if (pn_session_connection(pn_link_session(pn_delivery_link(delivery))) == conn) {
+      pn_delivery_set_context(delivery, NULL);
+    } else {
+      messenger->ready[(messenger->ready_head + kept++) & mask] = delivery;
+    }
+  }
+  messenger->ready_count = kept;
+}
+
+// queues the deliveries that arrived in full while conn was processed,
+// one that is not yet current on its link is queued by pn_messenger_read
+// once the delivery ahead of it has been read
+static void pn_messenger_collect(pn_messenger_t *messenger, pn_connection_t *conn)
+{
+  if (!conn) return;
+  pn_delivery_t *d;
+  while ((d = pn_connection_arrived(conn))) {
+    if (pn_delivery_readable(d) && !pn_delivery_partial(d)) {
+      pn_ready_push(messenger, d);
+    }
+    pn_link_t *link = pn_delivery_link(d);
+    pn_link_ctx_t *ctx = pn_link_get_context(link);
+    if (!ctx) continue;
+    ctx->complete++;
+    messenger->complete++;
+    // the arrival may have used up the last of its receiver's credit
+    if (!ctx->parked && pn_link_credit(link) == pn_link_queued(link)) {
+      messenger->starved = true;
+    }
+  }
+}
+
 #define OUTGOING (0x0000000000000000)
 #define INCOMING (0x1000000000000000)
 
@@ -260,10 +423,19 @@ pn_messenger_t *pn_messenger(const char *name)
     m->private_key = NULL;
     m->password = NULL;
     m->trusted_certificates = NULL;
+    m->client_domain = NULL;
+    m->server_domain = NULL;
+    m->mixed_domain = NULL;
+    m->ssl_resume = false;
     m->timeout = -1;
+    m->blocking = true;
     m->driver = pn_driver();
     m->credit = 0;
     m->distributed = 0;
+    m->flow_seed = 1;
+    m->returning_head = NULL;
+    m->returning_tail = NULL;
+    m->starved = false;
     m->next_tag = 0;
     pn_queue_init(&m->outgoing);
     pn_queue_init(&m->incoming);
@@ -273,7 +445,17 @@ pn_messenger_t *pn_messenger(const char *name)
     m->sub_count = 0;
     m->incoming_subscription = NULL;
     m->buffer = pn_buffer(1024);
+    m->batch_size = 0;
     m->error = pn_error();
+    pn_strmap_init(&m->senders);
+    pn_strmap_init(&m->connections);
+    m->ready = NULL;
+    m->ready_capacity = 0;
+    m->ready_head = 0;
+    m->ready_count = 0;
+    m->complete = 0;
+    pn_mpsc_init(&m->handoff);
+    m->handoff_pending = 0;
   }
 
   return m;
@@ -284,8 +466,19 @@ const char *pn_messenger_name(pn_messenger_t *messenger)
   return messenger->name;
 }
 
+static void pn_messenger_reset_domains(pn_messenger_t *messenger)
+{
+  if (messenger->client_domain) pn_ssl_domain_free(messenger->client_domain);
+  if (messenger->server_domain) pn_ssl_domain_free(messenger->server_domain);
+  if (messenger->mixed_domain) pn_ssl_domain_free(messenger->mixed_domain);
+  messenger->client_domain = NULL;
+  messenger->server_domain = NULL;
+  messenger->mixed_domain = NULL;
+}
+
 int pn_messenger_set_certificate(pn_messenger_t *messenger, const char *certificate)
 {
+  pn_messenger_reset_domains(messenger);
   if (messenger->certificate) free(messenger->certificate);
   messenger->certificate = pn_strdup(certificate);
   return 0;
@@ -298,6 +491,7 @@ const char *pn_messenger_get_certificate(pn_messenger_t *messenger)
 
 int pn_messenger_set_private_key(pn_messenger_t *messenger, const char *private_key)
 {
+  pn_messenger_reset_domains(messenger);
   if (messenger->private_key) free(messenger->private_key);
   messenger->private_key = pn_strdup(private_key);
   return 0;
@@ -310,6 +504,7 @@ const char *pn_messenger_get_private_key(pn_messenger_t *messenger)
 
 int pn_messenger_set_password(pn_messenger_t *messenger, const char *password)
 {
+  pn_messenger_reset_domains(messenger);
   if (messenger->password) free(messenger->password);
   messenger->password = pn_strdup(password);
   return 0;
@@ -322,6 +517,7 @@ const char *pn_messenger_get_password(pn_messenger_t *messenger)
 
 int pn_messenger_set_trusted_certificates(pn_messenger_t *messenger, const char *trusted_certificates)
 {
+  pn_messenger_reset_domains(messenger);
   if (messenger->trusted_certificates) free(messenger->trusted_certificates);
   messenger->trusted_certificates = pn_strdup(trusted_certificates);
   return 0;
@@ -344,6 +540,30 @@ int pn_messenger_get_timeout(pn_messenger_t *messenger)
   return messenger ? messenger->timeout : 0;
 }
 
+int pn_messenger_set_blocking(pn_messenger_t *messenger, bool blocking)
+{
+  if (!messenger) return PN_ARG_ERR;
+  messenger->blocking = blocking;
+  return 0;
+}
+
+bool pn_messenger_is_blocking(pn_messenger_t *messenger)
+{
+  return messenger ? messenger->blocking : true;
+}
+
+int pn_messenger_set_ssl_resume(pn_messenger_t *messenger, bool resume)
+{
+  if (!messenger) return PN_ARG_ERR;
+  messenger->ssl_resume = resume;
+  return 0;
+}
+
+bool pn_messenger_get_ssl_resume(pn_messenger_t *messenger)
+{
+  return messenger ? messenger->ssl_resume : false;
+}
+
 void pn_messenger_free(pn_messenger_t *messenger)
 {
   if (messenger) {
@@ -352,11 +572,19 @@ void pn_messenger_free(pn_messenger_t *messenger)
     free(messenger->private_key);
     free(messenger->password);
     free(messenger->trusted_certificates);
+    pn_messenger_reset_domains(messenger);
     pn_driver_free(messenger->driver);
     pn_buffer_free(messenger->buffer);
     pn_error_free(messenger->error);
     pn_queue_tini(&messenger->incoming);
     pn_queue_tini(&messenger->outgoing);
+    pn_strmap_tini(&messenger->senders);
+    pn_strmap_tini(&messenger->connections);
+    free(messenger->ready);
+    pn_mpsc_node_t *node;
+    while ((node = pn_mpsc_pop(&messenger->handoff))) {
+      free(node);
+    }
     for (int i = 0; i < messenger->sub_count; i++) {
       free(messenger->subscriptions[i].scheme);
     }
@@ -383,38 +611,168 @@ const char *pn_messenger_error(pn_messenger_t *messenger)
   }
 }
 
-void pn_messenger_flow(pn_messenger_t *messenger)
+// a new receiver holds no credit, so it counts as starved
+static pn_link_ctx_t *pn_link_ctx(pn_messenger_t *messenger, pn_link_t *link,
+                                  pn_subscription_t *subscription)
+{
+  pn_link_ctx_t *ctx = (pn_link_ctx_t *) malloc(sizeof(pn_link_ctx_t));
+  if (!ctx) return NULL;
+  ctx->link = link;
+  ctx->subscription = subscription;
+  ctx->held = pn_link_credit(link);
+  ctx->reads = 0;
+  ctx->complete = 0;
+  ctx->rate = 0;
+  ctx->draining = false;
+  ctx->returning = false;
+  ctx->returning_next = NULL;
+  ctx->returning_prev = NULL;
+  ctx->parked = 0;
+  pn_link_set_context(link, ctx);
+  messenger->starved = true;
+  return ctx;
+}
+
+static void pn_link_ctx_returned(pn_messenger_t *messenger, pn_link_ctx_t *ctx)
+{
+  if (ctx->returning) {
+    LL_REMOVE(messenger, returning, ctx);
+    ctx->returning = false;
+  }
+}
+
+// the rate an allocation would leave a receiver with, plus one so that
+// idle receivers still get a little unless they were just drained
+static uint64_t pn_link_ctx_weight(pn_link_ctx_t *ctx)
 {
-  while (messenger->credit > 0) {
-    int prev = messenger->credit;
-    pn_connector_t *ctor = pn_connector_head(messenger->driver);
-    while (ctor) {
-      pn_connection_t *conn = pn_connector_connection(ctor);
-
-      pn_link_t *link = pn_link_head(conn, PN_LOCAL_ACTIVE);
-      while (link && messenger->credit > 0) {
-        if (pn_link_is_receiver(link)) {
-          pn_link_flow(link, 1);
-          messenger->credit--;
-          messenger->distributed++;
+  if (ctx->parked) return 0;
+  return 1 + (ctx->rate + 16*ctx->reads) / 2;
+}
+
+// asks the receivers that have not been read from since the last
+// allocation to give back what credit the sender still holds
+static void pn_messenger_drain(pn_messenger_t *messenger)
+{
+  pn_connector_t *ctor = pn_connector_head(messenger->driver);
+  while (ctor) {
+    pn_link_t *link = pn_link_head(pn_connector_connection(ctor), PN_LOCAL_ACTIVE);
+    while (link) {
+      pn_link_ctx_t *ctx = pn_link_get_context(link);
+      if (pn_link_is_receiver(link) && ctx && !ctx->draining && !ctx->reads &&
+          pn_link_credit(link) > pn_link_queued(link)) {
+        pn_link_drain(link, 0);
+        ctx->draining = true;
+        if (!ctx->returning) {
+          LL_ADD(messenger, returning, ctx);
+          ctx->returning = true;
         }
-        link = pn_link_next(link, PN_LOCAL_ACTIVE);
       }
+      link = pn_link_next(link, PN_LOCAL_ACTIVE);
+    }
+    ctor = pn_connector_next(ctor);
+  }
+}
+
+// hands out the undistributed credit in one chunk per receiver, in
+// proportion to how quickly each has been reading, and asks idle
+// receivers to give theirs back when another has none left; a receiver
+// that was drained does not count as waiting for credit, so credit only
+// moves while some receiver is actually using it up
+//
+// only receivers that were asked to drain can give credit back and
+// pn_messenger_collect notes those that run out, so with no credit to
+// hand out this costs nothing unless a drain is outstanding
+void pn_messenger_flow(pn_messenger_t *messenger)
+{
+  pn_link_ctx_t *ctx = messenger->returning_head;
+  while (ctx) {
+    pn_link_ctx_t *next = ctx->returning_next;
+    // credit that went without being read was drained by the sender
+    int credit = pn_link_credit(ctx->link);
+    if (ctx->held > credit) {
+      messenger->credit += ctx->held - credit;
+      messenger->distributed -= ctx->held - credit;
+      ctx->held = credit;
+      ctx->rate = 0;
+      ctx->draining = false;
+      ctx->parked = PN_PARKED_ALLOCATIONS;
+      pn_link_ctx_returned(messenger, ctx);
+    } else if (credit == pn_link_queued(ctx->link)) {
+      // everything it was given has arrived, so there is nothing to drain
+      pn_link_ctx_returned(messenger, ctx);
+    }
+    ctx = next;
+  }
+
+  if (messenger->credit <= 0) {
+    if (messenger->starved) {
+      messenger->starved = false;
+      pn_messenger_drain(messenger);
+    }
+    return;
+  }
+
+  uint64_t total = 0;
+  pn_connector_t *ctor = pn_connector_head(messenger->driver);
+  while (ctor) {
+    pn_link_t *link = pn_link_head(pn_connector_connection(ctor), PN_LOCAL_ACTIVE);
+    while (link) {
+      ctx = pn_link_get_context(link);
+      if (pn_link_is_receiver(link) && ctx) {
+        total += pn_link_ctx_weight(ctx);
+      }
+      link = pn_link_next(link, PN_LOCAL_ACTIVE);
+    }
+    ctor = pn_connector_next(ctor);
+  }
+
+  // each receiver gets the credit that falls between its bounds on the
+  // running total of weights, so the shares always add up to the
+  // credit; the random phase spreads whatever is left over by rounding
+  uint64_t credit = messenger->credit;
+  messenger->flow_seed = messenger->flow_seed * 1103515245 + 12345;
+  uint64_t phase = total ? messenger->flow_seed % total : 0;
+  uint64_t cumulative = 0;
+  messenger->starved = false;
 
-      ctor = pn_connector_next(ctor);
+  ctor = pn_connector_head(messenger->driver);
+  while (ctor) {
+    pn_link_t *link = pn_link_head(pn_connector_connection(ctor), PN_LOCAL_ACTIVE);
+    while (link) {
+      ctx = pn_link_get_context(link);
+      if (pn_link_is_receiver(link) && ctx) {
+        uint64_t weight = pn_link_ctx_weight(ctx);
+        ctx->rate = (ctx->rate + 16*ctx->reads) / 2;
+        ctx->reads = 0;
+        if (ctx->parked) ctx->parked--;
+        int share = 0;
+        if (weight) {
+          uint64_t before = (credit*cumulative + phase) / total;
+          cumulative += weight;
+          share = (credit*cumulative + phase) / total - before;
+        }
+        if (share) {
+          pn_link_flow(link, share);
+          ctx->held += share;
+          ctx->draining = false;
+          messenger->credit -= share;
+          messenger->distributed += share;
+        }
+        if (!ctx->parked && pn_link_credit(link) == pn_link_queued(link)) {
+          messenger->starved = true;
+        }
+      }
+      link = pn_link_next(link, PN_LOCAL_ACTIVE);
     }
-    if (messenger->credit == prev) break;
+    ctor = pn_connector_next(ctor);
   }
 }
 
-static void pn_transport_config(pn_messenger_t *messenger,
-                                pn_connector_t *connector,
-                                pn_connection_t *connection)
+static pn_ssl_domain_t *pn_messenger_client_domain(pn_messenger_t *messenger)
 {
-  pn_connection_ctx_t *ctx = pn_connection_get_context(connection);
-  pn_transport_t *transport = pn_connector_transport(connector);
-  if (ctx->scheme && !strcmp(ctx->scheme, "amqps")) {
+  if (!messenger->client_domain) {
     pn_ssl_domain_t *d = pn_ssl_domain( PN_SSL_MODE_CLIENT );
+    if (!d) return NULL;
     if (messenger->certificate && messenger->private_key) {
       pn_ssl_domain_set_credentials( d, messenger->certificate,
                                      messenger->private_key,
@@ -426,9 +784,50 @@ static void pn_transport_config(pn_messenger_t *messenger,
     } else {
       pn_ssl_domain_set_peer_authentication(d, PN_SSL_ANONYMOUS_PEER, NULL);
     }
+    messenger->client_domain = d;
+  }
+  return messenger->client_domain;
+}
+
+static pn_ssl_domain_t *pn_messenger_server_domain(pn_messenger_t *messenger, bool secure)
+{
+  pn_ssl_domain_t **domain = secure ? &messenger->server_domain : &messenger->mixed_domain;
+  if (!*domain) {
+    pn_ssl_domain_t *d = pn_ssl_domain( PN_SSL_MODE_SERVER );
+    if (!d) return NULL;
+    if (messenger->certificate) {
+      pn_ssl_domain_set_credentials(d, messenger->certificate,
+                                    messenger->private_key,
+                                    messenger->password);
+    }
+    if (!secure) {
+      pn_ssl_domain_allow_unsecured_client(d);
+    }
+    *domain = d;
+  }
+  return *domain;
+}
+
+static void pn_transport_config(pn_messenger_t *messenger,
+                                pn_connector_t *connector,
+                                pn_connection_t *connection)
+{
+  pn_connection_ctx_t *ctx = pn_connection_get_context(connection);
+  pn_transport_t *transport = pn_connector_transport(connector);
+  if (ctx->scheme && !strcmp(ctx->scheme, "amqps")) {
     pn_ssl_t *ssl = pn_ssl(transport);
-    pn_ssl_init(ssl, d, NULL);
-    pn_ssl_domain_free( d );
+    if (messenger->ssl_resume) {
+      // the client domain caches sessions by peer and user, and is
+      // rebuilt when the certificates change
+      const char *user = ctx->user ? ctx->user : "";
+      const char *host = ctx->host ? ctx->host : "";
+      const char *port = ctx->port ? ctx->port : "";
+      char session_id[strlen(user) + strlen(host) + strlen(port) + 3];
+      sprintf(session_id, "%s@%s:%s", user, host, port);
+      pn_ssl_init(ssl, pn_messenger_client_domain(messenger), session_id);
+    } else {
+      pn_ssl_init(ssl, pn_messenger_client_domain(messenger), NULL);
+    }
   }
 
   pn_sasl_t *sasl = pn_sasl(transport);
@@ -462,6 +861,38 @@ static void pn_condition_report(const char *pfx, pn_condition_t *condition)
   }
 }
 
+static bool pn_is(void *value, void *arg)
+{
+  return value == arg;
+}
+
+static bool pn_link_of(void *value, void *arg)
+{
+  return pn_session_connection(pn_link_session((pn_link_t *) value)) == arg;
+}
+
+// drops the cached lookups that lead to a link or connection once it
+// is closed, anything else is left cached
+static void pn_messenger_forget_link(pn_messenger_t *messenger, pn_link_t *link)
+{
+  pn_strmap_purge(&messenger->senders, pn_is, link);
+}
+
+static void pn_messenger_forget(pn_messenger_t *messenger, pn_connection_t *conn)
+{
+  pn_strmap_purge(&messenger->senders, pn_link_of, conn);
+  pn_strmap_purge(&messenger->connections, pn_is, conn);
+}
+
+// sessions must be able to track a full window of unsettled deliveries
+static void pn_messenger_size_session(pn_messenger_t *messenger, pn_session_t *ssn)
+{
+  if (messenger->incoming.window > PN_SESSION_WINDOW)
+    pn_session_set_incoming_capacity(ssn, messenger->incoming.window);
+  if (messenger->outgoing.window > PN_SESSION_WINDOW)
+    pn_session_set_outgoing_capacity(ssn, messenger->outgoing.window);
+}
+
 void pn_messenger_endpoints(pn_messenger_t *messenger, pn_connection_t *conn, pn_connector_t *ctor)
 {
   if (pn_connection_state(conn) & PN_LOCAL_UNINIT) {
@@ -478,12 +909,15 @@ void pn_messenger_endpoints(pn_messenger_t *messenger, pn_connection_t *conn, pn
     d = pn_work_next(d);
   }
 
-  if (pn_work_head(conn)) {
+  // unread deliveries hold off the rest, unless the peer has closed, which
+  // must still be answered so the connector can close
+  if (pn_work_head(conn) && !(pn_connection_state(conn) & PN_REMOTE_CLOSED)) {
     return;
   }
 
   pn_session_t *ssn = pn_session_head(conn, PN_LOCAL_UNINIT);
   while (ssn) {
+    pn_messenger_size_session(messenger, ssn);
     pn_session_open(ssn);
     ssn = pn_session_next(ssn, PN_LOCAL_UNINIT);
   }
@@ -493,15 +927,26 @@ void pn_messenger_endpoints(pn_messenger_t *messenger, pn_connection_t *conn, pn
     pn_terminus_copy(pn_link_source(link), pn_link_remote_source(link));
     pn_terminus_copy(pn_link_target(link), pn_link_remote_target(link));
     pn_link_open(link);
-    if (pn_link_is_receiver(link)) {
-      pn_listener_t *listener = pn_connector_listener(ctor);
-      pn_link_set_context(link, pn_listener_context(listener));
+    // the listener may already be gone if the messenger is stopping, a
+    // receiver that cannot be tracked is closed rather than left unfed
+    if (pn_link_is_receiver(link) &&
+        !pn_link_ctx(messenger, link, (pn_subscription_t *) pn_connector_context(ctor))) {
+      pn_link_close(link);
     }
     link = pn_link_next(link, PN_LOCAL_UNINIT);
   }
 
   pn_messenger_flow(messenger);
 
+  // give back credit a receiver asks to drain once nothing is left to send
+  link = pn_link_head(conn, PN_LOCAL_ACTIVE);
+  while (link) {
+    if (pn_link_is_sender(link) && !pn_link_queued(link)) {
+      pn_link_drained(link);
+    }
+    link = pn_link_next(link, PN_LOCAL_ACTIVE);
+  }
+
   ssn = pn_session_head(conn, PN_LOCAL_ACTIVE | PN_REMOTE_CLOSED);
   while (ssn) {
     pn_condition_report("SESSION", pn_session_remote_condition(ssn));
@@ -513,6 +958,7 @@ void pn_messenger_endpoints(pn_messenger_t *messenger, pn_connection_t *conn, pn
   while (link) {
     pn_condition_report("LINK", pn_link_remote_condition(link));
     pn_link_close(link);
+    pn_messenger_forget_link(messenger, link);
     link = pn_link_next(link, PN_LOCAL_ACTIVE | PN_REMOTE_CLOSED);
   }
 
@@ -520,6 +966,7 @@ void pn_messenger_endpoints(pn_messenger_t *messenger, pn_connection_t *conn, pn
     pn_condition_t *condition = pn_connection_remote_condition(conn);
     pn_condition_report("CONNECTION", condition);
     pn_connection_close(conn);
+    pn_messenger_forget(messenger, conn);
     if (pn_condition_is_redirect(condition)) {
       const char *host = pn_condition_redirect_host(condition);
       char buf[1024];
@@ -543,6 +990,13 @@ void pn_messenger_reclaim(pn_messenger_t *messenger, pn_connection_t *conn)
 {
   pn_link_t *link = pn_link_head(conn, 0);
   while (link) {
+    pn_link_ctx_t *ctx = pn_link_get_context(link);
+    if (pn_link_is_receiver(link) && ctx) {
+      pn_link_ctx_returned(messenger, ctx);
+      // what arrived but was never read goes with the connection
+      messenger->complete -= ctx->complete;
+      ctx->complete = 0;
+    }
     if (pn_link_is_receiver(link) && pn_link_credit(link) > 0) {
       int credit = pn_link_credit(link);
       messenger->credit += credit;
@@ -577,14 +1031,96 @@ pn_connection_t *pn_messenger_connection(pn_messenger_t *messenger,
   return connection;
 }
 
-int pn_messenger_tsync(pn_messenger_t *messenger, bool (*predicate)(pn_messenger_t *), int timeout)
+static int pn_messenger_adopt(pn_messenger_t *messenger);
+
+// pushes local changes, including messages handed off by other
+// threads, through to the transports
+static int pn_messenger_prime(pn_messenger_t *messenger)
 {
+  int error = pn_messenger_adopt(messenger);
+
   pn_connector_t *ctor = pn_connector_head(messenger->driver);
   while (ctor) {
     pn_connector_process(ctor);
+    pn_messenger_collect(messenger, pn_connector_connection(ctor));
     ctor = pn_connector_next(ctor);
   }
 
+  return error;
+}
+
+// waits once on the driver and handles whatever turned up
+static int pn_messenger_wait(pn_messenger_t *messenger, int timeout)
+{
+  int error = pn_driver_wait(messenger->driver, timeout);
+  if (error)
+    return error;
+
+  // a producer that hands off a message wakes the driver
+  if (__atomic_load_n(&messenger->handoff_pending, __ATOMIC_ACQUIRE)) {
+    error = pn_messenger_prime(messenger);
+  }
+
+  pn_listener_t *l;
+  while ((l = pn_driver_listener(messenger->driver))) {
+    pn_subscription_t *sub = (pn_subscription_t *) pn_listener_context(l);
+    char *scheme = sub->scheme;
+    pn_connector_t *c = pn_listener_accept(l);
+    pn_connector_set_context(c, sub);
+    pn_transport_t *t = pn_connector_transport(c);
+
+    pn_ssl_t *ssl = pn_ssl(t);
+    bool secure = scheme && !strcmp(scheme, "amqps");
+    pn_ssl_init(ssl, pn_messenger_server_domain(messenger, secure), NULL);
+
+    pn_sasl_t *sasl = pn_sasl(t);
+    pn_sasl_mechanisms(sasl, "ANONYMOUS");
+    pn_sasl_server(sasl);
+    pn_sasl_done(sasl, PN_SASL_OK);
+    pn_connection_t *conn =
+      pn_messenger_connection(messenger, scheme, NULL, NULL, NULL, NULL);
+    pn_connector_set_connection(c, conn);
+  }
+
+  pn_connector_t *c;
+  while ((c = pn_driver_connector(messenger->driver))) {
+    pn_connector_process(c);
+    pn_connection_t *conn = pn_connector_connection(c);
+    pn_messenger_endpoints(messenger, conn, c);
+    pn_messenger_collect(messenger, conn);
+    if (pn_connector_closed(c)) {
+      pn_connector_free(c);
+      if (conn) {
+        pn_ready_purge(messenger, conn);
+        pn_messenger_forget(messenger, conn);
+        pn_messenger_reclaim(messenger, conn);
+        pn_decref(conn);
+        pn_messenger_flow(messenger);
+      }
+    } else {
+      pn_connector_process(c);
+      pn_messenger_collect(messenger, conn);
+    }
+  }
+
+  return error;
+}
+
+int pn_messenger_tsync(pn_messenger_t *messenger, bool (*predicate)(pn_messenger_t *), int timeout)
+{
+  int error = pn_messenger_prime(messenger);
+  if (error)
+    return error;
+
+  if (!messenger->blocking) {
+    if (!predicate(messenger)) {
+      error = pn_messenger_wait(messenger, 0);
+      if (error)
+        return error;
+    }
+    return predicate(messenger) ? 0 : PN_INPROGRESS;
+  }
+
   pn_timestamp_t now = pn_i_now();
   long int deadline = now + timeout;
   bool pred;
@@ -594,56 +1130,10 @@ int pn_messenger_tsync(pn_messenger_t *messenger, bool (*predicate)(pn_messenger
     int remaining = deadline - now;
     if (pred || (timeout >= 0 && remaining < 0)) break;
 
-    int error = pn_driver_wait(messenger->driver, remaining);
+    error = pn_messenger_wait(messenger, remaining);
     if (error)
         return error;
 
-    pn_listener_t *l;
-    while ((l = pn_driver_listener(messenger->driver))) {
-      pn_subscription_t *sub = (pn_subscription_t *) pn_listener_context(l);
-      char *scheme = sub->scheme;
-      pn_connector_t *c = pn_listener_accept(l);
-      pn_transport_t *t = pn_connector_transport(c);
-
-      pn_ssl_domain_t *d = pn_ssl_domain( PN_SSL_MODE_SERVER );
-      if (messenger->certificate) {
-        pn_ssl_domain_set_credentials(d, messenger->certificate,
-                                      messenger->private_key,
-                                      messenger->password);
-      }
-      if (!(scheme && !strcmp(scheme, "amqps"))) {
-        pn_ssl_domain_allow_unsecured_client(d);
-      }
-      pn_ssl_t *ssl = pn_ssl(t);
-      pn_ssl_init(ssl, d, NULL);
-      pn_ssl_domain_free( d );
-
-      pn_sasl_t *sasl = pn_sasl(t);
-      pn_sasl_mechanisms(sasl, "ANONYMOUS");
-      pn_sasl_server(sasl);
-      pn_sasl_done(sasl, PN_SASL_OK);
-      pn_connection_t *conn =
-        pn_messenger_connection(messenger, scheme, NULL, NULL, NULL, NULL);
-      pn_connector_set_connection(c, conn);
-    }
-
-    pn_connector_t *c;
-    while ((c = pn_driver_connector(messenger->driver))) {
-      pn_connector_process(c);
-      pn_connection_t *conn = pn_connector_connection(c);
-      pn_messenger_endpoints(messenger, conn, c);
-      if (pn_connector_closed(c)) {
-        pn_connector_free(c);
-        if (conn) {
-          pn_messenger_reclaim(messenger, conn);
-          pn_decref(conn);
-          pn_messenger_flow(messenger);
-        }
-      } else {
-        pn_connector_process(c);
-      }
-    }
-
     if (timeout >= 0) {
       now = pn_i_now();
     }
@@ -657,6 +1147,26 @@ int pn_messenger_sync(pn_messenger_t *messenger, bool (*predicate)(pn_messenger_
   return pn_messenger_tsync(messenger, predicate, messenger->timeout);
 }
 
+int pn_messenger_work(pn_messenger_t *messenger, int timeout)
+{
+  if (!messenger) return PN_ARG_ERR;
+  int error = pn_messenger_prime(messenger);
+  if (error) return error;
+  return pn_messenger_wait(messenger, timeout);
+}
+
+size_t pn_messenger_fds(pn_messenger_t *messenger, pn_fd_t *fds, size_t capacity)
+{
+  if (!messenger) return 0;
+  pn_messenger_prime(messenger);
+  return pn_driver_fds(messenger->driver, fds, capacity);
+}
+
+pn_timestamp_t pn_messenger_deadline(pn_messenger_t *messenger)
+{
+  return messenger ? pn_driver_deadline(messenger->driver) : 0;
+}
+
 int pn_messenger_start(pn_messenger_t *messenger)
 {
   if (!messenger) return PN_ARG_ERR;
@@ -673,6 +1183,9 @@ int pn_messenger_stop(pn_messenger_t *messenger)
 {
   if (!messenger) return PN_ARG_ERR;
 
+  pn_strmap_clear(&messenger->senders);
+  pn_strmap_clear(&messenger->connections);
+
   pn_connector_t *ctor = pn_connector_head(messenger->driver);
   while (ctor) {
     pn_connection_t *conn = pn_connector_connection(ctor);
@@ -718,6 +1231,17 @@ pn_connection_t *pn_messenger_resolve(pn_messenger_t *messenger, char *address,
   char *port = NULL;
   parse_url(address, &scheme, &user, &pass, &host, &port, name);
 
+  // every part is marked present or absent, since NULL and "" differ
+  char key[strlen(address) + 32];
+  sprintf(key, "%c%s\n%c%s\n%c%s\n%c%s\n%c%s",
+          scheme ? '+' : '-', scheme ? scheme : "",
+          user ? '+' : '-', user ? user : "",
+          pass ? '+' : '-', pass ? pass : "",
+          host ? '+' : '-', host ? host : "",
+          port ? '+' : '-', port ? port : "");
+  pn_connection_t *cached = pn_strmap_get(&messenger->connections, key);
+  if (cached) return cached;
+
   domain[0] = '\0';
 
   if (user) {
@@ -737,10 +1261,12 @@ pn_connection_t *pn_messenger_resolve(pn_messenger_t *messenger, char *address,
     if (pn_streq(scheme, ctx->scheme) && pn_streq(user, ctx->user) &&
         pn_streq(pass, ctx->pass) && pn_streq(host, ctx->host) &&
         pn_streq(port, ctx->port)) {
+      pn_strmap_put(&messenger->connections, key, connection);
       return connection;
     }
     const char *container = pn_connection_remote_container(connection);
     if (pn_streq(container, domain)) {
+      pn_strmap_put(&messenger->connections, key, connection);
       return connection;
     }
     ctor = pn_connector_next(ctor);
@@ -755,6 +1281,7 @@ pn_connection_t *pn_messenger_resolve(pn_messenger_t *messenger, char *address,
   pn_transport_config(messenger, connector, connection);
   pn_connection_open(connection);
   pn_connector_set_connection(connector, connection);
+  pn_strmap_put(&messenger->connections, key, connection);
 
   return connection;
 }
@@ -780,8 +1307,44 @@ void pn_subscription_set_context(pn_subscription_t *sub, void *context)
   sub->context = context;
 }
 
+pn_ssl_resume_status_t pn_messenger_ssl_resume_status(pn_messenger_t *messenger,
+                                                      const char *address)
+{
+  if (!messenger || !address) return PN_SSL_RESUME_UNKNOWN;
+
+  char copy[strlen(address) + 1];
+  strcpy(copy, address);
+  char *scheme = NULL;
+  char *user = NULL;
+  char *pass = NULL;
+  char *host = "0.0.0.0";
+  char *port = NULL;
+  char *path = NULL;
+  parse_url(copy, &scheme, &user, &pass, &host, &port, &path);
+  if (!scheme || strcmp(scheme, "amqps")) return PN_SSL_RESUME_UNKNOWN;
+
+  pn_connector_t *ctor = pn_connector_head(messenger->driver);
+  while (ctor) {
+    pn_connection_t *connection = pn_connector_connection(ctor);
+    pn_connection_ctx_t *ctx = connection ? pn_connection_get_context(connection) : NULL;
+    if (ctx && pn_streq(scheme, ctx->scheme) && pn_streq(user, ctx->user) &&
+        pn_streq(pass, ctx->pass) && pn_streq(host, ctx->host) &&
+        pn_streq(port, ctx->port)) {
+      return pn_ssl_resume_status(pn_ssl(pn_connector_transport(ctor)));
+    }
+    ctor = pn_connector_next(ctor);
+  }
+
+  return PN_SSL_RESUME_UNKNOWN;
+}
+
 pn_link_t *pn_messenger_link(pn_messenger_t *messenger, const char *address, bool sender)
 {
+  if (sender) {
+    pn_link_t *link = pn_strmap_get(&messenger->senders, address ? address : "");
+    if (link && (pn_link_state(link) & PN_LOCAL_ACTIVE)) return link;
+  }
+
   char copy[(address ? strlen(address) : 0) + 1];
   if (address) {
     strcpy(copy, address);
@@ -798,21 +1361,28 @@ pn_link_t *pn_messenger_link(pn_messenger_t *messenger, const char *address, boo
       const char *terminus = pn_link_is_sender(link) ?
         pn_terminus_get_address(pn_link_target(link)) :
         pn_terminus_get_address(pn_link_source(link));
-      if (pn_streq(name, terminus))
+      if (pn_streq(name, terminus)) {
+        if (sender) pn_strmap_put(&messenger->senders, address ? address : "", link);
         return link;
+      }
     }
     link = pn_link_next(link, PN_LOCAL_ACTIVE);
   }
 
   pn_session_t *ssn = pn_session(connection);
+  pn_messenger_size_session(messenger, ssn);
   pn_session_open(ssn);
   link = sender ? pn_sender(ssn, "sender-xxx") : pn_receiver(ssn, "receiver-xxx");
   // XXX
   pn_terminus_set_address(pn_link_target(link), name);
   pn_terminus_set_address(pn_link_source(link), name);
   if (!sender) {
-    pn_subscription_t *sub = pn_subscription(messenger, NULL);
-    pn_link_set_context(link, sub);
+    if (!pn_link_ctx(messenger, link, pn_subscription(messenger, NULL))) {
+      pn_link_free(link);
+      return NULL;
+    }
+  } else {
+    pn_strmap_put(&messenger->senders, address ? address : "", link);
   }
   pn_link_open(link);
   return link;
@@ -858,8 +1428,8 @@ pn_subscription_t *pn_messenger_subscribe(pn_messenger_t *messenger, const char
   } else {
     pn_link_t *src = pn_messenger_source(messenger, source);
     if (src) {
-      pn_subscription_t *sub = pn_link_get_context(src);
-      return sub;
+      pn_link_ctx_t *ctx = pn_link_get_context(src);
+      return ctx->subscription;
     } else {
       pn_error_format(messenger->error, PN_ERR,
                       "unable to subscribe to source: %s (%s)", source,
@@ -887,12 +1457,6 @@ int pn_messenger_get_outgoing_window(pn_messenger_t *messenger)
 
 int pn_messenger_set_outgoing_window(pn_messenger_t *messenger, int window)
 {
-  if (window >= PN_SESSION_WINDOW) {
-    return pn_error_format(messenger->error, PN_ARG_ERR,
-                           "specified window (%i) exceeds max (%i)",
-                           window, PN_SESSION_WINDOW);
-  }
-
   messenger->outgoing.window = window;
   return 0;
 }
@@ -904,12 +1468,6 @@ int pn_messenger_get_incoming_window(pn_messenger_t *messenger)
 
 int pn_messenger_set_incoming_window(pn_messenger_t *messenger, int window)
 {
-  if (window >= PN_SESSION_WINDOW) {
-    return pn_error_format(messenger->error, PN_ARG_ERR,
-                           "specified window (%i) exceeds max (%i)",
-                           window, PN_SESSION_WINDOW);
-  }
-
   messenger->incoming.window = window;
   return 0;
 }
@@ -931,6 +1489,19 @@ static void outward_munge(pn_messenger_t *mng, pn_message_t *msg)
 
 // static bool false_pred(pn_messenger_t *messenger) { return false; }
 
+static pn_delivery_t *pn_messenger_delivery(pn_messenger_t *messenger, pn_link_t *sender,
+                                            uint8_t priority)
+{
+  // XXX: proper tag
+  char tag[8];
+  void *ptr = &tag;
+  uint64_t next = messenger->next_tag++;
+  *((uint64_t *) ptr) = next;
+  pn_delivery_t *d = pn_delivery(sender, pn_dtag(tag, 8));
+  pn_delivery_set_priority(d, priority);
+  return d;
+}
+
 int pn_messenger_put(pn_messenger_t *messenger, pn_message_t *msg)
 {
   if (!messenger) return PN_ARG_ERR;
@@ -956,12 +1527,7 @@ int pn_messenger_put(pn_messenger_t *messenger, pn_message_t *msg)
       return pn_error_format(messenger->error, err, "encode error: %s",
                              pn_message_error(msg));
     } else {
-      // XXX: proper tag
-      char tag[8];
-      void *ptr = &tag;
-      uint64_t next = messenger->next_tag++;
-      *((uint64_t *) ptr) = next;
-      pn_delivery_t *d = pn_delivery(sender, pn_dtag(tag, 8));
+      pn_delivery_t *d = pn_messenger_delivery(messenger, sender, pn_message_get_priority(msg));
       ssize_t n = pn_link_send(sender, encoded, size);
       if (n < 0) {
         return pn_error_format(messenger->error, n, "send error: %s",
@@ -979,6 +1545,165 @@ int pn_messenger_put(pn_messenger_t *messenger, pn_message_t *msg)
   return PN_ERR;
 }
 
+// the smallest allocation put_batch encodes a message into
+#define PN_BATCH_MIN (256)
+
+int pn_messenger_put_batch(pn_messenger_t *messenger, pn_message_t **messages, size_t count)
+{
+  if (!messenger) return PN_ARG_ERR;
+  if (count && !messages) return pn_error_set(messenger->error, PN_ARG_ERR, "null messages");
+
+  pn_link_t *sender = NULL;
+  const char *resolved = NULL;
+  for (size_t i = 0; i < count; i++) {
+    pn_message_t *msg = messages[i];
+    if (!msg) return pn_error_set(messenger->error, PN_ARG_ERR, "null message");
+    outward_munge(messenger, msg);
+
+    // runs of messages to the same address share one lookup
+    const char *address = pn_message_get_address(msg);
+    if (!sender || !pn_streq(address, resolved)) {
+      sender = pn_messenger_target(messenger, address);
+      if (!sender)
+        return pn_error_format(messenger->error, PN_ERR,
+                               "unable to send to address: %s (%s)", address,
+                               pn_driver_error(messenger->driver));
+      resolved = address;
+    }
+
+    // encode into memory that the delivery then takes over, sized by
+    // the previous message with some slack and doubled on overflow
+    size_t capacity = messenger->batch_size + messenger->batch_size/4;
+    if (capacity < PN_BATCH_MIN) capacity = PN_BATCH_MIN;
+    char *encoded = (char *) malloc(capacity);
+    size_t size;
+    while (true) {
+      if (!encoded) return pn_error_format(messenger->error, PN_ERR, "put: error allocating buffer");
+      size = capacity;
+      int err = pn_message_encode(msg, encoded, &size);
+      if (!err) break;
+      if (err != PN_OVERFLOW) {
+        free(encoded);
+        return pn_error_format(messenger->error, err, "encode error: %s",
+                               pn_message_error(msg));
+      }
+      capacity *= 2;
+      char *grown = (char *) realloc(encoded, capacity);
+      if (!grown) free(encoded);
+      encoded = grown;
+    }
+    messenger->batch_size = size;
+    if (size < capacity/2) {
+      char *shrunk = (char *) realloc(encoded, size);
+      if (shrunk) encoded = shrunk;
+    }
+
+    pn_delivery_t *d = pn_messenger_delivery(messenger, sender, pn_message_get_priority(msg));
+    ssize_t n = pn_link_send_ref(sender, encoded, size, free, encoded);
+    if (n < 0) {
+      free(encoded);
+      return pn_error_format(messenger->error, n, "send error: %s",
+                             pn_error_text(pn_link_error(sender)));
+    }
+    pn_link_advance(sender);
+    pn_queue_add(&messenger->outgoing, d);
+  }
+
+  // a single pass pushes the transfers of the whole batch
+  pn_connector_t *ctor = pn_connector_head(messenger->driver);
+  while (ctor) {
+    pn_connector_process(ctor);
+    pn_messenger_collect(messenger, pn_connector_connection(ctor));
+    ctor = pn_connector_next(ctor);
+  }
+
+  return 0;
+}
+
+int pn_messenger_put_async(pn_messenger_t *messenger, pn_message_t *msg)
+{
+  if (!messenger || !msg) return PN_ARG_ERR;
+  outward_munge(messenger, msg);
+
+  // the messenger's buffer and error belong to the loop thread, so
+  // this encodes into memory of its own and reports by code alone
+  const char *address = pn_message_get_address(msg);
+  size_t head = sizeof(pn_handoff_t) + (address ? strlen(address) + 1 : 0);
+  size_t capacity = 1024;
+  size_t size;
+  char *block = NULL;
+  while (true) {
+    char *grown = (char *) realloc(block, head + capacity);
+    if (!grown) {
+      free(block);
+      return PN_ERR;
+    }
+    block = grown;
+    size = capacity;
+    int err = pn_message_encode(msg, block + head, &size);
+    if (!err) break;
+    if (err != PN_OVERFLOW) {
+      free(block);
+      return err;
+    }
+    capacity *= 2;
+  }
+  if (size < capacity/2) {
+    char *shrunk = (char *) realloc(block, head + size);
+    if (shrunk) block = shrunk;
+  }
+
+  pn_handoff_t *handoff = (pn_handoff_t *) block;
+  handoff->priority = pn_message_get_priority(msg);
+  handoff->address = address ? strcpy(block + sizeof(pn_handoff_t), address) : NULL;
+  handoff->bytes = block + head;
+  handoff->size = size;
+  pn_mpsc_push(&messenger->handoff, &handoff->node);
+
+  // only the first handoff since the loop last looked needs to wake it
+  if (!__atomic_exchange_n(&messenger->handoff_pending, 1, __ATOMIC_ACQ_REL)) {
+    return pn_driver_wakeup(messenger->driver);
+  }
+  return 0;
+}
+
+// gives deliveries to the messages handed off by pn_messenger_put_async
+static int pn_messenger_adopt(pn_messenger_t *messenger)
+{
+  if (!__atomic_load_n(&messenger->handoff_pending, __ATOMIC_ACQUIRE)) return 0;
+  // cleared before popping, so a handoff this misses wakes the loop again
+  __atomic_exchange_n(&messenger->handoff_pending, 0, __ATOMIC_ACQ_REL);
+
+  int error = 0;
+  pn_mpsc_node_t *node;
+  while ((node = pn_mpsc_pop(&messenger->handoff))) {
+    pn_handoff_t *handoff = (pn_handoff_t *) node;
+    pn_link_t *sender = pn_messenger_target(messenger, handoff->address);
+    if (!sender) {
+      if (!error)
+        error = pn_error_format(messenger->error, PN_ERR,
+                                "unable to send to address: %s (%s)", handoff->address,
+                                pn_driver_error(messenger->driver));
+      free(handoff);
+      continue;
+    }
+
+    pn_delivery_t *d = pn_messenger_delivery(messenger, sender, handoff->priority);
+    ssize_t n = pn_link_send_ref(sender, handoff->bytes, handoff->size, free, handoff);
+    if (n < 0) {
+      free(handoff);
+      if (!error)
+        error = pn_error_format(messenger->error, n, "send error: %s",
+                                pn_error_text(pn_link_error(sender)));
+      continue;
+    }
+    pn_link_advance(sender);
+    pn_queue_add(&messenger->outgoing, d);
+  }
+
+  return error;
+}
+
 pn_tracker_t pn_messenger_outgoing_tracker(pn_messenger_t *messenger)
 {
   return pn_tracker(OUTGOING, messenger->outgoing.hwm - 1);
@@ -1036,25 +1761,9 @@ bool pn_messenger_sent(pn_messenger_t *messenger)
   pn_connector_t *ctor = pn_connector_head(messenger->driver);
   while (ctor) {
     pn_connection_t *conn = pn_connector_connection(ctor);
-
-    pn_link_t *link = pn_link_head(conn, PN_LOCAL_ACTIVE);
-    while (link) {
-      if (pn_link_is_sender(link)) {
-        if (pn_link_queued(link)) {
-          return false;
-        }
-
-        pn_delivery_t *d = pn_unsettled_head(link);
-        while (d) {
-          if (!pn_delivery_remote_state(d) && !pn_delivery_settled(d)) {
-            return false;
-          }
-          d = pn_unsettled_next(d);
-        }
-      }
-      link = pn_link_next(link, PN_LOCAL_ACTIVE);
+    if (pn_connection_outgoing(conn) || pn_connection_unresolved(conn)) {
+      return false;
     }
-
     ctor = pn_connector_next(ctor);
   }
 
@@ -1063,21 +1772,7 @@ bool pn_messenger_sent(pn_messenger_t *messenger)
 
 bool pn_messenger_rcvd(pn_messenger_t *messenger)
 {
-  pn_connector_t *ctor = pn_connector_head(messenger->driver);
-  while (ctor) {
-    pn_connection_t *conn = pn_connector_connection(ctor);
-
-    pn_delivery_t *d = pn_work_head(conn);
-    while (d) {
-      if (pn_delivery_readable(d) && !pn_delivery_partial(d)) {
-        return true;
-      }
-      d = pn_work_next(d);
-    }
-    ctor = pn_connector_next(ctor);
-  }
-
-  return false;
+  return pn_ready_head(messenger) != NULL;
 }
 
 int pn_messenger_send(pn_messenger_t *messenger)
@@ -1097,52 +1792,54 @@ int pn_messenger_recv(pn_messenger_t *messenger, int n)
   return pn_messenger_sync(messenger, pn_messenger_rcvd);
 }
 
+// reads a complete delivery off its link and into msg, if any
+static int pn_messenger_read(pn_messenger_t *messenger, pn_delivery_t *d, pn_message_t *msg)
+{
+  pn_link_t *l = pn_delivery_link(d);
+  pn_link_ctx_t *ctx = pn_link_get_context(l);
+  pn_subscription_t *sub = ctx->subscription;
+  size_t pending = pn_delivery_pending(d);
+  pn_buffer_t *buf = messenger->buffer;
+  int err = pn_buffer_ensure(buf, pending + 1);
+  if (err) return pn_error_format(messenger->error, err, "get: error growing buffer");
+  char *encoded = pn_buffer_bytes(buf).start;
+  ssize_t n = pn_link_recv(l, encoded, pending);
+  if (n != pending) {
+    return pn_error_format(messenger->error, n, "didn't receive pending bytes: %zi", n);
+  }
+  n = pn_link_recv(l, encoded + pending, 1);
+  pn_link_advance(l);
+  messenger->distributed--;
+  ctx->held--;
+  ctx->reads++;
+  ctx->complete--;
+  messenger->complete--;
+  pn_delivery_t *next = pn_link_current(l);
+  if (next && pn_delivery_readable(next) && !pn_delivery_partial(next)) {
+    pn_ready_push(messenger, next);
+  }
+  if (n != PN_EOS) {
+    return pn_error_format(messenger->error, n, "PN_EOS expected");
+  }
+  pn_queue_add(&messenger->incoming, d);
+  messenger->incoming_subscription = sub;
+  if (msg) {
+    int err = pn_message_decode(msg, encoded, pending);
+    if (err) {
+      return pn_error_format(messenger->error, err, "error decoding message: %s",
+                             pn_message_error(msg));
+    }
+  }
+  return 0;
+}
+
 int pn_messenger_get(pn_messenger_t *messenger, pn_message_t *msg)
 {
   if (!messenger) return PN_ARG_ERR;
 
-  pn_connector_t *ctor = pn_connector_head(messenger->driver);
-  while (ctor) {
-    pn_connection_t *conn = pn_connector_connection(ctor);
-
-    pn_delivery_t *d = pn_work_head(conn);
-    while (d) {
-      if (pn_delivery_readable(d) && !pn_delivery_partial(d)) {
-        pn_link_t *l = pn_delivery_link(d);
-        pn_subscription_t *sub = pn_link_get_context(l);
-        size_t pending = pn_delivery_pending(d);
-        pn_buffer_t *buf = messenger->buffer;
-        int err = pn_buffer_ensure(buf, pending + 1);
-        if (err) return pn_error_format(messenger->error, err, "get: error growing buffer");
-        char *encoded = pn_buffer_bytes(buf).start;
-        ssize_t n = pn_link_recv(l, encoded, pending);
-        if (n != pending) {
-          return pn_error_format(messenger->error, n, "didn't receive pending bytes: %zi", n);
-        }
-        n = pn_link_recv(l, encoded + pending, 1);
-        pn_link_advance(l);
-        messenger->distributed--;
-        if (n != PN_EOS) {
-          return pn_error_format(messenger->error, n, "PN_EOS expected");
-        }
-        pn_queue_add(&messenger->incoming, d);
-        messenger->incoming_subscription = sub;
-        if (msg) {
-          int err = pn_message_decode(msg, encoded, pending);
-          if (err) {
-            return pn_error_format(messenger->error, err, "error decoding message: %s",
-                                   pn_message_error(msg));
-          } else {
-            return 0;
-          }
-        } else {
-          return 0;
-        }
-      }
-      d = pn_work_next(d);
-    }
-
-    ctor = pn_connector_next(ctor);
+  pn_delivery_t *d = pn_ready_pop(messenger);
+  if (d) {
+    return pn_messenger_read(messenger, d, msg);
   }
 
   // XXX: need to drain credit before returning EOS
@@ -1150,6 +1847,22 @@ int pn_messenger_get(pn_messenger_t *messenger, pn_message_t *msg)
   return PN_EOS;
 }
 
+int pn_messenger_get_batch(pn_messenger_t *messenger, pn_message_t **messages, size_t count)
+{
+  if (!messenger) return PN_ARG_ERR;
+  if (count && !messages) return pn_error_set(messenger->error, PN_ARG_ERR, "null messages");
+
+  size_t got = 0;
+  pn_delivery_t *d;
+  while (got < count && (d = pn_ready_pop(messenger))) {
+    int err = pn_messenger_read(messenger, d, messages[got]);
+    if (err) return err;
+    got++;
+  }
+
+  return got || !count ? (int) got : PN_EOS;
+}
+
 pn_tracker_t pn_messenger_incoming_tracker(pn_messenger_t *messenger)
 {
   return pn_tracker(INCOMING, messenger->incoming.hwm - 1);
@@ -1192,17 +1905,10 @@ int pn_messenger_queued(pn_messenger_t *messenger, bool sender)
   pn_connector_t *ctor = pn_connector_head(messenger->driver);
   while (ctor) {
     pn_connection_t *conn = pn_connector_connection(ctor);
-
-    pn_link_t *link = pn_link_head(conn, PN_LOCAL_ACTIVE);
-    while (link) {
-      if (pn_link_is_sender(link)) {
-        if (sender) {
-          result += pn_link_queued(link);
-        }
-      } else if (!sender) {
-        result += pn_link_queued(link);
-      }
-      link = pn_link_next(link, PN_LOCAL_ACTIVE);
+    if (sender) {
+      result += pn_connection_outgoing(conn);
+    } else {
+      result += pn_connection_incoming(conn);
     }
     ctor = pn_connector_next(ctor);
   }
@@ -1217,5 +1923,6 @@ int pn_messenger_outgoing(pn_messenger_t *messenger)
 
 int pn_messenger_incoming(pn_messenger_t *messenger)
 {
-  return pn_messenger_queued(messenger, false);
+  // a delivery still arriving cannot be read yet, so it is not counted
+  return messenger ? messenger->complete : 0;
 }
@@ -0,0 +1,71 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "mpsc.h"
+
+// a producer publishes its node with the release of the exchange, and
+// links it in with a release store that the consumer acquires, so a
+// popped node is seen with everything written to it before the push
+
+void pn_mpsc_init(pn_mpsc_t *queue)
+{
+  queue->stub.next = NULL;
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+}
+
+void pn_mpsc_push(pn_mpsc_t *queue, pn_mpsc_node_t *node)
+{
+  node->next = NULL;
+  pn_mpsc_node_t *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+pn_mpsc_node_t *pn_mpsc_pop(pn_mpsc_t *queue)
+{
+  pn_mpsc_node_t *tail = queue->tail;
+  pn_mpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &queue->stub) {
+    if (!next) return NULL;
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+
+  // tail is the last node linked in, it can only be handed out once
+  // something follows it, so put the stub back behind it
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) return NULL;
+  pn_mpsc_push(queue, &queue->stub);
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
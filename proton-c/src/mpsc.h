@@ -0,0 +1,49 @@
+#ifndef _PROTON_SRC_MPSC_H
+#define _PROTON_SRC_MPSC_H 1
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * under the License.
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// an intrusive queue that any number of threads may push onto without
+// locking while a single thread pops; a push is an atomic exchange and
+// a store, a pop touches no shared state unless the queue is nearly
+// empty
+typedef struct pn_mpsc_node_t {
+  struct pn_mpsc_node_t *next;
+} pn_mpsc_node_t;
+
+typedef struct {
+  pn_mpsc_node_t *head; // the newest node, swung by producers
+  pn_mpsc_node_t *tail; // the oldest node, owned by the consumer
+  pn_mpsc_node_t stub;
+} pn_mpsc_t;
+
+void pn_mpsc_init(pn_mpsc_t *queue);
+// any thread
+void pn_mpsc_push(pn_mpsc_t *queue, pn_mpsc_node_t *node);
+// the consumer only; NULL when the queue is empty, or when the next
+// node is still being pushed, in which case its producer has yet to
+// return
+pn_mpsc_node_t *pn_mpsc_pop(pn_mpsc_t *queue);
+
+#endif /* mpsc.h */
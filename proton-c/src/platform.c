@@ -32,6 +32,13 @@ pn_timestamp_t pn_i_now(void)
   if (clock_gettime(CLOCK_REALTIME, &now)) pn_fatal("clock_gettime() failed\n");
   return ((pn_timestamp_t)now.tv_sec) * 1000 + (now.tv_nsec / 1000000);
 }
+
+uint64_t pn_i_clock(void)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now)) pn_fatal("clock_gettime() failed\n");
+  return ((uint64_t)now.tv_sec) * 1000000 + (now.tv_nsec / 1000);
+}
 #else
 #include <sys/time.h>
 pn_timestamp_t pn_i_now(void)
@@ -40,6 +47,13 @@ pn_timestamp_t pn_i_now(void)
   if (gettimeofday(&now, NULL)) pn_fatal("gettimeofday failed\n");
   return ((pn_timestamp_t)now.tv_sec) * 1000 + (now.tv_usec / 1000);
 }
+
+uint64_t pn_i_clock(void)
+{
+  struct timeval now;
+  if (gettimeofday(&now, NULL)) pn_fatal("gettimeofday failed\n");
+  return ((uint64_t)now.tv_sec) * 1000000 + now.tv_usec;
+}
 #endif
 
 #ifdef USE_UUID_GENERATE
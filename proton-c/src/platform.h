@@ -39,6 +39,16 @@ extern "C" {
  */
 pn_timestamp_t pn_i_now(void);
 
+/** Read a monotonic clock in microseconds.
+ *
+ * Only the difference between two readings is meaningful, the clock
+ * is meant for timing intervals rather than telling the time.
+ *
+ * @return current clock reading
+ * @internal
+ */
+uint64_t pn_i_clock(void);
+
 /** Generate a UUID in string format.
  *
  * Returns a newly generated UUID in the standard 36 char format.
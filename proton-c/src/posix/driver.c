@@ -857,6 +857,49 @@ int pn_driver_wait(pn_driver_t *d, int timeout)
     return 0;
 }
 
+static size_t pn_driver_fd(pn_fd_t *fds, size_t capacity, size_t n, pn_socket_t fd, int events)
+{
+  if (n < capacity) {
+    fds[n].fd = fd;
+    fds[n].events = events;
+  }
+  return n + 1;
+}
+
+size_t pn_driver_fds(pn_driver_t *d, pn_fd_t *fds, size_t capacity)
+{
+  if (!d) return 0;
+
+  size_t n = pn_driver_fd(fds, capacity, 0, d->ctrl[0], PN_FD_READABLE);
+
+  for (pn_listener_t *l = d->listener_head; l; l = l->listener_next) {
+    n = pn_driver_fd(fds, capacity, n, l->fd, PN_FD_READABLE);
+  }
+
+  for (pn_connector_t *c = d->connector_head; c; c = c->connector_next) {
+    if (!c->closed) {
+      n = pn_driver_fd(fds, capacity, n, c->fd,
+                       (c->status & PN_SEL_RD ? PN_FD_READABLE : 0) |
+                       (c->status & PN_SEL_WR ? PN_FD_WRITABLE : 0));
+    }
+  }
+
+  return n;
+}
+
+pn_timestamp_t pn_driver_deadline(pn_driver_t *d)
+{
+  if (!d) return 0;
+  // closed connectors are handed out by the very next wait
+  if (d->closed_count) return pn_i_now();
+
+  pn_timestamp_t deadline = 0;
+  for (pn_connector_t *c = d->connector_head; c; c = c->connector_next) {
+    deadline = pn_timestamp_min(deadline, c->wakeup);
+  }
+  return deadline;
+}
+
 pn_listener_t *pn_driver_listener(pn_driver_t *d) {
   if (!d) return NULL;
 
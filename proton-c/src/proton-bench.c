@@ -0,0 +1,402 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <proton/buffer.h>
+#include <proton/engine.h>
+#include <proton/util.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#define HAVE_HEAP_USED
+#endif
+
+// bytes currently allocated on the heap
+static size_t heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+  struct mallinfo mi = mallinfo();
+  return (size_t) mi.uordblks + (size_t) mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+static void report_memory(const char *what, size_t before, size_t after, int count)
+{
+  printf("%-12s %10.1f bytes each (%d allocated)\n", what,
+         (double) (after - before) / count, count);
+}
+
+// measures the heap footprint of idle endpoints: connections, sessions
+// on a single connection, and links on a single session
+int memory(int count)
+{
+#ifndef HAVE_HEAP_USED
+  fprintf(stderr, "proton-bench: memory: heap statistics unavailable on this platform\n");
+  return 1;
+#endif
+
+  pn_connection_t **conns = (pn_connection_t **) malloc(count * sizeof(pn_connection_t *));
+  if (!conns) return 1;
+
+  size_t before = heap_used();
+  for (int i = 0; i < count; i++) {
+    conns[i] = pn_connection();
+  }
+  report_memory("connection", before, heap_used(), count);
+  for (int i = 0; i < count; i++) {
+    pn_connection_free(conns[i]);
+  }
+  free(conns);
+
+  pn_connection_t *conn = pn_connection();
+  before = heap_used();
+  for (int i = 0; i < count; i++) {
+    pn_session(conn);
+  }
+  report_memory("session", before, heap_used(), count);
+  pn_connection_free(conn);
+
+  conn = pn_connection();
+  pn_session_t *ssn = pn_session(conn);
+  char name[32];
+  before = heap_used();
+  for (int i = 0; i < count; i++) {
+    snprintf(name, 32, "link-%d", i);
+    if (i % 2) {
+      pn_receiver(ssn, name);
+    } else {
+      pn_sender(ssn, name);
+    }
+  }
+  report_memory("link", before, heap_used(), count);
+  pn_connection_free(conn);
+
+  return 0;
+}
+
+// an in-process wire that holds bytes for a fixed number of ticks
+// and carries at most bandwidth bytes per tick, standing in for a
+// delay proxy on a high latency link
+typedef struct {
+  pn_transport_t *src;
+  pn_transport_t *dst;
+  pn_buffer_t **slots;
+  pn_buffer_t *pending;
+  int delay;
+  size_t bandwidth;
+  char *bytes;
+} wire_t;
+
+static void wire_init(wire_t *wire, pn_transport_t *src, pn_transport_t *dst,
+                      int delay, size_t bandwidth)
+{
+  wire->src = src;
+  wire->dst = dst;
+  wire->delay = delay;
+  wire->bandwidth = bandwidth;
+  wire->slots = (pn_buffer_t **) malloc(delay * sizeof(pn_buffer_t *));
+  for (int i = 0; i < delay; i++) {
+    wire->slots[i] = pn_buffer(bandwidth);
+  }
+  wire->pending = pn_buffer(bandwidth);
+  wire->bytes = (char *) malloc(bandwidth);
+}
+
+static void wire_tini(wire_t *wire)
+{
+  for (int i = 0; i < wire->delay; i++) {
+    pn_buffer_free(wire->slots[i]);
+  }
+  free(wire->slots);
+  pn_buffer_free(wire->pending);
+  free(wire->bytes);
+}
+
+static void wire_tick(wire_t *wire, uint64_t tick)
+{
+  // whatever was written delay ticks ago arrives now
+  pn_buffer_t *slot = wire->slots[tick % wire->delay];
+  pn_bytes_t arrived = pn_buffer_bytes(slot);
+  pn_buffer_append(wire->pending, arrived.start, arrived.size);
+  pn_buffer_clear(slot);
+
+  pn_bytes_t input = pn_buffer_bytes(wire->pending);
+  if (input.size) {
+    ssize_t n = pn_transport_input(wire->dst, input.start, input.size);
+    if (n > 0) pn_buffer_trim(wire->pending, n, 0);
+  }
+
+  ssize_t n = pn_transport_output(wire->src, wire->bytes, wire->bandwidth);
+  if (n > 0) pn_buffer_append(slot, wire->bytes, n);
+}
+
+static void open_remote(pn_connection_t *conn, size_t capacity)
+{
+  pn_session_t *ssn = pn_session_head(conn, PN_LOCAL_UNINIT);
+  while (ssn) {
+    pn_session_set_incoming_capacity(ssn, capacity);
+    pn_session_set_outgoing_capacity(ssn, capacity);
+    pn_session_open(ssn);
+    ssn = pn_session_next(ssn, PN_LOCAL_UNINIT);
+  }
+
+  pn_link_t *link = pn_link_head(conn, PN_LOCAL_UNINIT);
+  while (link) {
+    pn_link_open(link);
+    link = pn_link_next(link, PN_LOCAL_UNINIT);
+  }
+}
+
+static void released(void *context)
+{
+  (*(int *) context)++;
+}
+
+// sends count messages of the given size over a single link and
+// returns the number of ticks until every one has been settled, or
+// for a pre-settled link, until every one has been received
+static uint64_t transfer(int count, size_t size, size_t capacity, int delay, size_t bandwidth,
+                         pn_snd_settle_mode_t mode, bool zero_copy)
+{
+  pn_connection_t *c1 = pn_connection();
+  pn_connection_t *c2 = pn_connection();
+  pn_transport_t *t1 = pn_transport();
+  pn_transport_t *t2 = pn_transport();
+  pn_transport_bind(t1, c1);
+  pn_transport_bind(t2, c2);
+  pn_connection_open(c1);
+  pn_connection_open(c2);
+
+  pn_session_t *ssn = pn_session(c1);
+  pn_session_set_incoming_capacity(ssn, capacity);
+  pn_session_set_outgoing_capacity(ssn, capacity);
+  pn_session_open(ssn);
+  pn_link_t *snd = pn_sender(ssn, "bench");
+  pn_link_set_snd_settle_mode(snd, mode);
+  pn_link_open(snd);
+
+  wire_t out, in;
+  wire_init(&out, t1, t2, delay, bandwidth);
+  wire_init(&in, t2, t1, delay, bandwidth);
+
+  char *payload = (char *) calloc(1, size);
+  char *scratch = (char *) malloc(size);
+  int sent = 0;
+  int releases = 0;
+  int received = 0;
+  int settled = 0;
+  uint64_t tick = 0;
+  while ((mode == PN_SND_SETTLED ? received : settled) < count) {
+    open_remote(c2, capacity);
+
+    pn_link_t *rcv = pn_link_head(c2, PN_LOCAL_ACTIVE);
+    if (rcv) {
+      pn_delivery_t *d;
+      while ((d = pn_link_current(rcv)) && !pn_delivery_partial(d)) {
+        while (pn_link_recv(rcv, scratch, size) > 0);
+        if (!pn_delivery_settled(d)) pn_delivery_update(d, PN_ACCEPTED);
+        pn_delivery_settle(d);
+        received++;
+      }
+      if (pn_link_credit(rcv) < (int) capacity / 2) {
+        pn_link_flow(rcv, capacity - pn_link_credit(rcv));
+      }
+    }
+
+    while (sent < count && pn_link_credit(snd) > 0) {
+      char tag[16];
+      snprintf(tag, 16, "%d", sent);
+      pn_delivery_t *d = pn_delivery(snd, pn_dtag(tag, strlen(tag)));
+      if (zero_copy) {
+        pn_link_send_ref(snd, payload, size, released, &releases);
+      } else {
+        pn_link_send(snd, payload, size);
+      }
+      pn_link_advance(snd);
+      if (mode == PN_SND_SETTLED) pn_delivery_settle(d);
+      sent++;
+    }
+
+    pn_delivery_t *d = pn_work_head(c1);
+    while (d) {
+      pn_delivery_t *next = pn_work_next(d);
+      if (pn_delivery_updated(d) && pn_delivery_settled(d)) {
+        pn_delivery_settle(d);
+        settled++;
+      }
+      d = next;
+    }
+
+    wire_tick(&out, tick);
+    wire_tick(&in, tick);
+    tick++;
+  }
+
+  wire_tini(&out);
+  wire_tini(&in);
+  pn_transport_free(t1);
+  pn_transport_free(t2);
+  pn_connection_free(c1);
+  pn_connection_free(c2);
+  if (zero_copy && releases != count) {
+    pn_fatal("proton-bench: %d of %d payloads released\n", releases, count);
+  }
+  free(payload);
+  free(scratch);
+  return tick;
+}
+
+// compares the throughput of the default session window with a larger
+// one over a wire with a round trip of 2*delay ticks
+int window(int count, size_t size, size_t capacity, int delay)
+{
+  size_t bandwidth = 1024*1024;
+  printf("%d messages of %zu bytes, %d tick delay, %zu bytes per tick\n",
+         count, size, delay, bandwidth);
+  size_t capacities[] = {PN_SESSION_WINDOW, capacity};
+  for (int i = 0; i < 2; i++) {
+    uint64_t ticks = transfer(count, size, capacities[i], delay, bandwidth, PN_SND_MIXED, false);
+    printf("window %-8zu %10" PRIu64 " ticks %10.1f messages/tick\n",
+           capacities[i], ticks, (double) count / ticks);
+  }
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// compares acknowledged deliveries with pre-settled ones over an
+// otherwise idle wire, where the cost is dominated by the engine
+int presettled(int count, size_t size, size_t capacity)
+{
+  size_t bandwidth = 1024*1024;
+  printf("%d messages of %zu bytes, window %zu\n", count, size, capacity);
+  pn_snd_settle_mode_t modes[] = {PN_SND_UNSETTLED, PN_SND_SETTLED};
+  const char *names[] = {"unsettled", "settled"};
+  for (int i = 0; i < 2; i++) {
+    double start = now();
+    uint64_t ticks = transfer(count, size, capacity, 1, bandwidth, modes[i], false);
+    double elapsed = now() - start;
+    printf("%-10s %10" PRIu64 " ticks %12.0f messages/second\n",
+           names[i], ticks, count / elapsed);
+  }
+  return 0;
+}
+
+// compares sends that copy the payload with sends that reference it
+int zero_copy(int count, size_t size, size_t capacity)
+{
+  size_t bandwidth = 1024*1024;
+  printf("%d messages of %zu bytes, window %zu\n", count, size, capacity);
+  const char *names[] = {"copied", "referenced"};
+  for (int i = 0; i < 2; i++) {
+    double start = now();
+    uint64_t ticks = transfer(count, size, capacity, 1, bandwidth, PN_SND_SETTLED, i);
+    double elapsed = now() - start;
+    printf("%-10s %10" PRIu64 " ticks %12.1f MB/second\n",
+           names[i], ticks, count * (double) size / elapsed / (1024*1024));
+  }
+  return 0;
+}
+
+static void usage(const char *program)
+{
+  printf("Usage: %s [-h] [-n <count>] [-s <size>] [-w <window>] [-d <delay>] <benchmark> ...\n", program);
+  printf("\n");
+  printf("    -n    The number of iterations.\n");
+  printf("    -s    Message size.\n");
+  printf("    -w    Session window to compare against the default.\n");
+  printf("    -d    One way delay in ticks.\n");
+  printf("    -h    Print this help.\n");
+  printf("\n");
+  printf("Benchmarks:\n");
+  printf("    memory      Heap bytes per idle connection, session and link.\n");
+  printf("    window      Throughput over a delayed wire by session window.\n");
+  printf("    presettled  Throughput of acknowledged and pre-settled deliveries.\n");
+  printf("    zerocopy    Throughput of copied and referenced payloads.\n");
+}
+
+int main(int argc, char **argv)
+{
+  int count = 100000;
+  int size = 64;
+  int capacity = 16*PN_SESSION_WINDOW;
+  int delay = 50;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:w:d:h")) != -1)
+  {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 's':
+      size = atoi(optarg);
+      break;
+    case 'w':
+      capacity = atoi(optarg);
+      break;
+    case 'd':
+      delay = atoi(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default: /* '?' */
+      pn_fatal("Usage: %s -h\n", argv[0]);
+    }
+  }
+
+  if (optind >= argc || count <= 0 || size <= 0 || capacity <= 0 || delay <= 0)
+    pn_fatal("Usage: %s -h\n", argv[0]);
+
+  for (int i = optind; i < argc; i++) {
+    int err;
+    if (!strcmp(argv[i], "memory")) {
+      err = memory(count);
+    } else if (!strcmp(argv[i], "window")) {
+      err = window(count, size, capacity, delay);
+    } else if (!strcmp(argv[i], "presettled")) {
+      err = presettled(count, size, capacity);
+    } else if (!strcmp(argv[i], "zerocopy")) {
+      err = zero_copy(count, size, capacity);
+    } else {
+      pn_fatal("proton-bench: unknown benchmark: %s\n", argv[i]);
+    }
+    if (err) return err;
+  }
+
+  return 0;
+}
@@ -20,11 +20,43 @@
  */
 
 #include <stdio.h>
-#include <proton/buffer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <proton/codec.h>
 #include <proton/error.h>
 #include <proton/framing.h>
+#include <proton/util.h>
 #include "util.h"
+#include "dispatcher/recorder.h"
+
+// native Windows has neither mmap nor pthreads, so captures are read
+// into memory there and decoded on the main thread
+#if defined(_WIN32) && ! defined(__CYGWIN__)
+#define DUMP_READ
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// frames are decoded in segments of about this many bytes, a batch of
+// segments, one per thread, is decoded before any output is written
+#define SEGMENT (8*1024*1024)
+#ifdef DUMP_READ
+#define MAX_THREADS (1)
+#else
+#define MAX_THREADS (64)
+#endif
+#define ANY (-1)
+#define PRINT_LIMIT (1024)
 
 void fatal_error(const char *msg, const char *arg, int err)
 {
@@ -35,73 +67,487 @@ void fatal_error(const char *msg, const char *arg, int err)
   exit(1);
 }
 
-int dump(const char *file)
+typedef struct {
+  int channel;
+  int code;
+  int64_t handle;
+  bool summary;
+  int threads;
+} options_t;
+
+typedef struct {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t payload;
+} counter_t;
+
+typedef struct {
+  counter_t codes[256];
+  counter_t *channels; // indexed by channel, allocated on first use
+} stats_t;
+
+typedef struct {
+  const options_t *options;
+  const char *start;
+  size_t size;
+  pn_data_t *data;
+  char *out;
+  size_t out_size;
+  size_t out_capacity;
+  stats_t stats;
+  size_t error_offset;
+  int error;
+} segment_t;
+
+static void count(stats_t *stats, uint16_t channel, uint8_t code, size_t bytes, size_t payload)
 {
-  FILE *in = fopen(file, "r");
-  if (!in) fatal_error("proton-dump: dump: opening %s", file, errno);
+  counter_t *c = &stats->codes[code];
+  c->frames++;
+  c->bytes += bytes;
+  c->payload += payload;
 
-  pn_buffer_t *buf = pn_buffer(1024);
-  pn_data_t *data = pn_data(16);
-  bool header = false;
+  if (!stats->channels) {
+    stats->channels = (counter_t *) calloc(65536, sizeof(counter_t));
+    if (!stats->channels) pn_fatal("proton-dump: out of memory\n");
+  }
+  c = &stats->channels[channel];
+  c->frames++;
+  c->bytes += bytes;
+  c->payload += payload;
+}
 
-  char bytes[1024];
-  size_t n;
-  while ((n = fread(bytes, 1, 1024, in))) {
-    int err = pn_buffer_append(buf, bytes, n);
-    if (err) return err;
+// adds other to stats and zeroes it for the next segment
+static void merge(stats_t *stats, stats_t *other)
+{
+  for (int i = 0; i < 256; i++) {
+    stats->codes[i].frames += other->codes[i].frames;
+    stats->codes[i].bytes += other->codes[i].bytes;
+    stats->codes[i].payload += other->codes[i].payload;
+  }
+  memset(other->codes, 0, sizeof(other->codes));
+  if (!other->channels) return;
+  if (!stats->channels) {
+    stats->channels = other->channels;
+    other->channels = NULL;
+    return;
+  }
+  for (int i = 0; i < 65536; i++) {
+    stats->channels[i].frames += other->channels[i].frames;
+    stats->channels[i].bytes += other->channels[i].bytes;
+    stats->channels[i].payload += other->channels[i].payload;
+  }
+  memset(other->channels, 0, 65536 * sizeof(counter_t));
+}
+
+static void summarize(const char *file, stats_t *stats)
+{
+  counter_t total = {0, 0, 0};
+  printf("%s:\n", file);
+  printf("%12s %14s %14s  %s\n", "frames", "bytes", "payload", "performative");
+  for (int i = 0; i < 256; i++) {
+    counter_t *c = &stats->codes[i];
+    if (!c->frames) continue;
+    printf("%12" PRIu64 " %14" PRIu64 " %14" PRIu64 "  %s\n", c->frames, c->bytes, c->payload,
+           pn_record_name(i));
+    total.frames += c->frames;
+    total.bytes += c->bytes;
+    total.payload += c->payload;
+  }
+  printf("%12" PRIu64 " %14" PRIu64 " %14" PRIu64 "  total\n", total.frames, total.bytes,
+         total.payload);
+
+  if (!stats->channels) return;
+  printf("%12s %14s %14s  %s\n", "frames", "bytes", "payload", "channel");
+  for (int i = 0; i < 65536; i++) {
+    counter_t *c = &stats->channels[i];
+    if (!c->frames) continue;
+    printf("%12" PRIu64 " %14" PRIu64 " %14" PRIu64 "  %i\n", c->frames, c->bytes, c->payload, i);
+  }
+}
+
+static void reserve(segment_t *seg, size_t size)
+{
+  if (seg->out_capacity - seg->out_size >= size) return;
+  size_t capacity = seg->out_capacity ? seg->out_capacity : 64*1024;
+  while (capacity - seg->out_size < size) capacity *= 2;
+  seg->out = (char *) realloc(seg->out, capacity);
+  if (!seg->out) pn_fatal("proton-dump: out of memory\n");
+  seg->out_capacity = capacity;
+}
+
+// formats straight into the output of the segment, doubling it until
+// the data fits
+static void emit(segment_t *seg, pn_data_t *data)
+{
+  reserve(seg, 1024);
+  while (true) {
+    size_t size = seg->out_capacity - seg->out_size;
+    int err = pn_data_format(data, seg->out + seg->out_size, &size);
+    if (!err) {
+      seg->out_size += size;
+      break;
+    }
+    if (err != PN_OVERFLOW) pn_fatal("proton-dump: %s\n", pn_code(err));
+    reserve(seg, 2*(seg->out_capacity - seg->out_size));
+  }
+  reserve(seg, 1);
+  seg->out[seg->out_size++] = '\n';
+}
 
-    while (true) {
-      pn_bytes_t available = pn_buffer_bytes(buf);
-      if (!available.size) break;
-
-      if (!header) {
-        if (available.size >= 8) {
-          pn_buffer_trim(buf, 8, 0);
-          available = pn_buffer_bytes(buf);
-          header = true;
-        } else {
-          break;
-        }
+// quotes bytes to stderr, cut short since pn_fprint_data quotes on
+// the stack and what follows a bad frame may be the rest of the file
+static void print_bytes(const char *bytes, size_t size)
+{
+  pn_fprint_data(stderr, bytes, size < PRINT_LIMIT ? size : PRINT_LIMIT);
+  if (size > PRINT_LIMIT) fprintf(stderr, "... (%zu bytes)", size);
+  fprintf(stderr, "\n");
+}
+
+// the handle a performative refers to, or ANY if it has none
+static int64_t frame_handle(pn_data_t *data, uint8_t code)
+{
+  uint32_t handle = 0, skip;
+  bool init = false, present = true;
+  int err;
+  switch (code) {
+  case 0x12: // attach
+    err = pn_data_scan(data, "D.[.I]", &handle);
+    break;
+  case 0x13: // flow
+    err = pn_data_scan(data, "D.[?IIII?I]", &init, &skip, &skip, &skip, &skip,
+                       &present, &handle);
+    break;
+  case 0x14: // transfer
+  case 0x16: // detach
+    err = pn_data_scan(data, "D.[I]", &handle);
+    break;
+  default:
+    return ANY;
+  }
+  return err || !present ? ANY : handle;
+}
+
+static bool match(const options_t *options, uint16_t channel, uint8_t code, int64_t handle)
+{
+  if (options->channel != ANY && channel != options->channel) return false;
+  if (options->code != ANY && code != options->code) return false;
+  if (options->handle != ANY && handle != options->handle) return false;
+  return true;
+}
+
+// decodes the frames of a segment in place, the segment always ends on
+// a frame boundary
+static void *decode(void *arg)
+{
+  segment_t *seg = (segment_t *) arg;
+  const options_t *options = seg->options;
+  size_t offset = 0;
+
+  while (offset < seg->size) {
+    pn_frame_t frame;
+    size_t n = pn_read_frame(&frame, seg->start + offset, seg->size - offset);
+    if (!n) break;
+
+    if (options->channel != ANY && frame.channel != options->channel) {
+      offset += n;
+      continue;
+    }
+
+    uint8_t code = 0;
+    size_t payload = 0;
+    pn_data_clear(seg->data);
+    if (frame.size) {
+      ssize_t dsize = pn_data_decode(seg->data, frame.payload, frame.size);
+      if (dsize < 0) {
+        seg->error = dsize;
+        seg->error_offset = offset;
+        break;
       }
+      uint64_t code64;
+      bool scanned;
+      pn_data_scan(seg->data, "D?L.", &scanned, &code64);
+      code = scanned ? code64 : 0;
+      payload = frame.size - dsize;
+    }
 
-      pn_frame_t frame;
-      size_t consumed = pn_read_frame(&frame, available.start, available.size);
-      if (consumed) {
-        pn_data_clear(data);
-        ssize_t dsize = pn_data_decode(data, frame.payload, frame.size);
-        if (dsize < 0) {
-          fprintf(stderr, "Error decoding frame: %s\n", pn_code(err));
-          pn_fprint_data(stderr, frame.payload, frame.size);
-          fprintf(stderr, "\n");
-          return err;
-        } else {
-          pn_data_print(data);
-          printf("\n");
-        }
-        pn_buffer_trim(buf, consumed, 0);
+    int64_t handle = options->handle == ANY ? ANY : frame_handle(seg->data, code);
+    if (match(options, frame.channel, code, handle)) {
+      if (options->summary) {
+        count(&seg->stats, frame.channel, code, n, payload);
       } else {
-        break;
+        emit(seg, seg->data);
+      }
+    }
+    offset += n;
+  }
+
+  return NULL;
+}
+
+// the length of the whole frames that start at offset and span about
+// limit bytes, found by hopping from one size prefix to the next
+static size_t split(const char *base, size_t offset, size_t end, size_t limit)
+{
+  size_t start = offset;
+  while (end - offset >= 8) {
+    const unsigned char *p = (const unsigned char *) base + offset;
+    size_t size = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+    if (size < 8 || size > end - offset) break;
+    offset += size;
+    if (offset - start >= limit) break;
+  }
+  return offset - start;
+}
+
+static int dump_frames(const char *file, const options_t *options, const char *base, size_t size)
+{
+  segment_t segs[MAX_THREADS];
+  stats_t stats;
+  memset(segs, 0, sizeof(segs));
+  memset(&stats, 0, sizeof(stats));
+  for (int i = 0; i < options->threads; i++) {
+    segs[i].options = options;
+    segs[i].data = pn_data(16);
+  }
+
+  // skip the protocol header
+  size_t offset = size < 8 ? size : 8;
+  int err = 0;
+  while (!err && offset < size) {
+    int n = 0;
+    while (n < options->threads && offset < size) {
+      size_t length = split(base, offset, size, SEGMENT);
+      if (!length) break;
+      segs[n].start = base + offset;
+      segs[n].size = length;
+      segs[n].out_size = 0;
+      offset += length;
+      n++;
+    }
+    if (!n) break;
+
+#ifdef DUMP_READ
+    decode(&segs[0]);
+#else
+    if (n == 1) {
+      decode(&segs[0]);
+    } else {
+      pthread_t threads[MAX_THREADS];
+      for (int i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, decode, &segs[i]))
+          pn_fatal("proton-dump: unable to start thread\n");
+      }
+      for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+#endif
+
+    for (int i = 0; i < n && !err; i++) {
+      fwrite(segs[i].out, 1, segs[i].out_size, stdout);
+      merge(&stats, &segs[i].stats);
+      if (segs[i].error) {
+        err = segs[i].error;
+        size_t at = segs[i].start - base + segs[i].error_offset;
+        pn_frame_t frame;
+        pn_read_frame(&frame, base + at, size - at);
+        fprintf(stderr, "Error decoding frame at offset %zu: %s\n", at, pn_code(err));
+        print_bytes(frame.payload, frame.size);
       }
     }
   }
 
-  if (ferror(in)) fatal_error("proton-dump: dump: reading %s", file, errno);
-  if (pn_buffer_size(buf) > 0) {
+  if (!err && offset < size) {
     fprintf(stderr, "Trailing data: ");
-    pn_bytes_t b = pn_buffer_bytes(buf);
-    pn_fprint_data(stderr, b.start, b.size);
-    fprintf(stderr, "\n");
+    print_bytes(base + offset, size - offset);
+  }
+  if (options->summary) summarize(file, &stats);
+
+  for (int i = 0; i < options->threads; i++) {
+    pn_data_free(segs[i].data);
+    free(segs[i].out);
+    free(segs[i].stats.channels);
   }
+  free(stats.channels);
+  return err;
+}
 
-  fclose(in);
+// prints flight recorder dumps, as written by pn_transport_trace_dump,
+// one frame per line with times relative to the first record
+static int dump_trace(const char *file, const options_t *options, const char *base, size_t size)
+{
+  stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  char line[1024];
+  size_t offset = 0;
+  while (offset < size) {
+    size_t records;
+    uint32_t overwritten;
+    ssize_t n = pn_recorder_read_header(base + offset, size - offset, &records, &overwritten);
+    if (n <= 0 || records > (size - offset - n) / PN_RECORD_SIZE) {
+      fprintf(stderr, "proton-dump: %s: bad trace at offset %zu\n", file, offset);
+      free(stats.channels);
+      return PN_ERR;
+    }
+    offset += n;
+    if (!options->summary) {
+      printf("# %zu frames, %u earlier frames overwritten\n", records, overwritten);
+    }
 
+    uint64_t start = 0;
+    for (size_t i = 0; i < records; i++, offset += PN_RECORD_SIZE) {
+      pn_frame_record_t record;
+      pn_record_decode(&record, base + offset);
+      if (!i) start = record.time;
+      int64_t handle = ANY;
+      if (pn_record_key_name(record.code, 0) && !strcmp(pn_record_key_name(record.code, 0), "handle") &&
+          (record.flags & PN_RECORD_KEY0)) {
+        handle = record.key[0];
+      }
+      if (!match(options, record.channel, record.code, handle)) continue;
+      if (options->summary) {
+        count(&stats, record.channel, record.code, record.size, record.payload);
+      } else {
+        pn_record_format(&record, start, line, sizeof(line));
+        printf("%s\n", line);
+      }
+    }
+  }
+
+  if (options->summary) summarize(file, &stats);
+  free(stats.channels);
   return 0;
 }
 
+#ifdef DUMP_READ
+
+static const char *load(const char *file, int fd, size_t size)
+{
+  char *base = (char *) malloc(size);
+  if (!base) pn_fatal("proton-dump: out of memory\n");
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t n = read(fd, base + offset, size - offset);
+    if (n <= 0) fatal_error("proton-dump: dump: reading %s", file, n ? errno : EIO);
+    offset += n;
+  }
+  return base;
+}
+
+static void unload(const char *base, size_t size)
+{
+  free((void *) base);
+}
+
+#else
+
+static const char *load(const char *file, int fd, size_t size)
+{
+  const char *base = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) fatal_error("proton-dump: dump: mapping %s", file, errno);
+  madvise((void *) base, size, MADV_SEQUENTIAL);
+  return base;
+}
+
+static void unload(const char *base, size_t size)
+{
+  munmap((void *) base, size);
+}
+
+#endif
+
+int dump(const char *file, const options_t *options)
+{
+  int fd = open(file, O_RDONLY | O_BINARY);
+  if (fd < 0) fatal_error("proton-dump: dump: opening %s", file, errno);
+  struct stat st;
+  if (fstat(fd, &st)) fatal_error("proton-dump: dump: reading %s", file, errno);
+
+  size_t size = st.st_size;
+  if (!size) {
+    close(fd);
+    return 0;
+  }
+  const char *base = load(file, fd, size);
+  close(fd);
+
+  int err;
+  if (size >= 4 && !memcmp(base, PN_RECORDER_MAGIC, 4)) {
+    err = dump_trace(file, options, base, size);
+  } else {
+    err = dump_frames(file, options, base, size);
+  }
+
+  unload(base, size);
+  return err;
+}
+
+static int parse_code(const char *name)
+{
+  char *end;
+  long code = strtol(name, &end, 0);
+  if (*name && !*end && code >= 0 && code < 256) return code;
+  for (int i = 0; i < 256; i++) {
+    if (!strcmp(pn_record_name(i), name)) return i;
+  }
+  pn_fatal("proton-dump: unknown performative: %s\n", name);
+  return ANY;
+}
+
+static void usage(const char *program)
+{
+  printf("Usage: %s [-h] [-s] [-c <channel>] [-p <performative>] [-l <handle>] [-j <threads>] <file> ...\n", program);
+  printf("\n");
+  printf("Prints the frames of AMQP captures and of flight recorder dumps.\n");
+  printf("\n");
+  printf("    -c    Only frames on this channel.\n");
+  printf("    -p    Only this performative, by name (transfer) or code (0x14).\n");
+  printf("    -l    Only frames for this link handle.\n");
+  printf("    -s    Print frame, byte and payload counts instead of frames.\n");
+  printf("    -j    Threads to decode captures with, defaults to the CPUs online.\n");
+  printf("    -h    Print this help.\n");
+}
+
 int main(int argc, char **argv)
 {
-  for (int i = 1; i < argc; i++) {
-    int err = dump(argv[i]);
+  options_t options = {ANY, ANY, ANY, false, 1};
+#ifndef DUMP_READ
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0) options.threads = cpus;
+#endif
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:p:l:sj:h")) != -1)
+  {
+    switch (opt) {
+    case 'c':
+      options.channel = atoi(optarg);
+      break;
+    case 'p':
+      options.code = parse_code(optarg);
+      break;
+    case 'l':
+      options.handle = atoll(optarg);
+      break;
+    case 's':
+      options.summary = true;
+      break;
+    case 'j':
+      options.threads = atoi(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default: /* '?' */
+      pn_fatal("Usage: %s -h\n", argv[0]);
+    }
+  }
+
+  if (options.threads < 1) options.threads = 1;
+  if (options.threads > MAX_THREADS) options.threads = MAX_THREADS;
+
+  for (int i = optind; i < argc; i++) {
+    int err = dump(argv[i], &options);
     if (err) return err;
   }
 
@@ -157,7 +157,7 @@ void server_callback(pn_connector_t *ctor)
     pn_terminus_copy(pn_link_target(link), pn_link_remote_target(link));
     pn_link_open(link);
     if (pn_link_is_receiver(link)) {
-      pn_link_flow(link, 100);
+      pn_link_set_credit_window(link, 100, 50);
     } else {
       pn_delivery(link, pn_dtag("blah", 4));
     }
@@ -187,7 +187,6 @@ void server_callback(pn_connector_t *ctor)
         }
       }
       if (!ctx->quiet) printf("\"\n");
-      if (pn_link_credit(link) < 50) pn_link_flow(link, 100);
     } else if (pn_delivery_writable(delivery)) {
       pn_link_send(link, data, ndata);
       if (pn_link_advance(link)) {
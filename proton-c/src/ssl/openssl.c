@@ -25,6 +25,7 @@
 #include "../engine/engine-internal.h"
 #include "../platform.h"
 #include "../util.h"
+#include "../strmap.h"
 
 #include <openssl/ssl.h>
 #include <openssl/dh.h>
@@ -63,9 +64,12 @@ struct pn_ssl_domain_t {
   pn_ssl_verify_mode_t verify_mode;
   bool allow_unsecured;
 
-  // session cache
+  // session cache: indexed by id, and listed least recently saved first
+  pn_strmap_t ssn_cache_index;
   pn_ssl_session_t *ssn_cache_head;
   pn_ssl_session_t *ssn_cache_tail;
+  size_t ssn_cache_size;
+  pn_ssl_cache_stats_t ssn_cache_stats;
 };
 
 
@@ -115,6 +119,9 @@ struct pn_ssl_session_t {
 #define CIPHERS_AUTHENTICATE    "ALL:!aNULL:!eNULL:@STRENGTH"
 #define CIPHERS_ANONYMOUS       "ALL:aNULL:!eNULL:@STRENGTH"
 
+// the default bound on the sessions a domain caches
+#define SSN_CACHE_SIZE          (1024)
+
 /* */
 static int keyfile_pw_cb(char *buf, int size, int rwflag, void *userdata);
 static ssize_t process_input_ssl( pn_transport_t *transport, const char *input_data, size_t len);
@@ -129,6 +136,8 @@ static connection_mode_t check_for_ssl_connection( const char *data, size_t len
 static int init_ssl_socket( pn_ssl_t * );
 static void release_ssl_socket( pn_ssl_t * );
 static pn_ssl_session_t *ssn_cache_find( pn_ssl_domain_t *, const char * );
+static void ssn_cache_add( pn_ssl_domain_t *, pn_ssl_session_t * );
+static void ssn_cache_remove( pn_ssl_domain_t *, pn_ssl_session_t * );
 static void ssl_session_free( pn_ssl_session_t *);
 
 
@@ -377,30 +386,80 @@ static DH *get_dh2048()
   return(dh);
 }
 
+static bool ssn_expired( pn_ssl_session_t *ssn, long now_sec )
+{
+  long expire = SSL_SESSION_get_time( ssn->session )
+    + SSL_SESSION_get_timeout( ssn->session );
+  return expire < now_sec;
+}
+
+// unlinks a session from the cache, leaving the caller to free it
+static void ssn_cache_remove( pn_ssl_domain_t *domain, pn_ssl_session_t *ssn )
+{
+  pn_strmap_put( &domain->ssn_cache_index, ssn->id, NULL );
+  LL_REMOVE( domain, ssn_cache, ssn );
+  domain->ssn_cache_stats.size--;
+}
+
+// expiry is checked on lookup rather than by a timer, so a lookup only
+// looks at the session it finds
 static pn_ssl_session_t *ssn_cache_find( pn_ssl_domain_t *domain, const char *id )
 {
-  pn_timestamp_t now_msec = pn_i_now();
-  long now_sec = (long)(now_msec / 1000);
-  pn_ssl_session_t *ssn = LL_HEAD( domain, ssn_cache );
-  while (ssn) {
-    long expire = SSL_SESSION_get_time( ssn->session )
-      + SSL_SESSION_get_timeout( ssn->session );
-    if (expire < now_sec) {
-      pn_ssl_session_t *next = ssn->ssn_cache_next;
-      LL_REMOVE( domain, ssn_cache, ssn );
-      ssl_session_free( ssn );
-      ssn = next;
-      continue;
-    }
+  pn_ssl_session_t *ssn = (pn_ssl_session_t *) pn_strmap_get( &domain->ssn_cache_index, id );
+  if (ssn && ssn_expired( ssn, (long)(pn_i_now() / 1000) )) {
+    ssn_cache_remove( domain, ssn );
+    ssl_session_free( ssn );
+    domain->ssn_cache_stats.expirations++;
+    ssn = NULL;
+  }
 
-    if (!strcmp(ssn->id, id)) {
-      break;
-    }
-    ssn = ssn->ssn_cache_next;
+  if (ssn) {
+    domain->ssn_cache_stats.hits++;
+  } else {
+    domain->ssn_cache_stats.misses++;
   }
   return ssn;
 }
 
+// saving a session replaces any under the same id, then trims the
+// cache from the least recently saved end: first whatever has expired,
+// then whatever exceeds the size
+static void ssn_cache_add( pn_ssl_domain_t *domain, pn_ssl_session_t *ssn )
+{
+  if (!domain->ssn_cache_size || !ssn->id) {
+    ssl_session_free( ssn );
+    return;
+  }
+
+  pn_ssl_session_t *old = (pn_ssl_session_t *) pn_strmap_get( &domain->ssn_cache_index, ssn->id );
+  if (old) {
+    ssn_cache_remove( domain, old );
+    ssl_session_free( old );
+  }
+
+  if (pn_strmap_put( &domain->ssn_cache_index, ssn->id, ssn )) {
+    ssl_session_free( ssn );
+    return;
+  }
+  LL_ADD( domain, ssn_cache, ssn );
+  domain->ssn_cache_stats.size++;
+
+  long now_sec = (long)(pn_i_now() / 1000);
+  pn_ssl_session_t *head;
+  while ((head = LL_HEAD( domain, ssn_cache )) && ssn_expired( head, now_sec )) {
+    ssn_cache_remove( domain, head );
+    ssl_session_free( head );
+    domain->ssn_cache_stats.expirations++;
+  }
+
+  while (domain->ssn_cache_stats.size > domain->ssn_cache_size) {
+    head = LL_HEAD( domain, ssn_cache );
+    ssn_cache_remove( domain, head );
+    ssl_session_free( head );
+    domain->ssn_cache_stats.evictions++;
+  }
+}
+
 static void ssl_session_free( pn_ssl_session_t *ssn)
 {
   if (ssn) {
@@ -429,6 +488,7 @@ pn_ssl_domain_t *pn_ssl_domain( pn_ssl_mode_t mode )
 
   domain->ref_count = 1;
   domain->mode = mode;
+  domain->ssn_cache_size = SSN_CACHE_SIZE;
   switch(mode) {
   case PN_SSL_MODE_CLIENT:
     domain->ctx = SSL_CTX_new(TLSv1_client_method());
@@ -489,6 +549,7 @@ void pn_ssl_domain_free( pn_ssl_domain_t *domain )
       ssl_session_free( ssn );
       ssn = next;
     }
+    pn_strmap_tini( &domain->ssn_cache_index );
 
     if (domain->ctx) SSL_CTX_free(domain->ctx);
     if (domain->keyfile_pw) free(domain->keyfile_pw);
@@ -668,6 +729,26 @@ int pn_ssl_domain_allow_unsecured_client(pn_ssl_domain_t *domain)
   return 0;
 }
 
+int pn_ssl_domain_set_session_cache_size(pn_ssl_domain_t *domain, size_t size)
+{
+  if (!domain) return -1;
+  domain->ssn_cache_size = size;
+  while (domain->ssn_cache_stats.size > size) {
+    pn_ssl_session_t *head = LL_HEAD( domain, ssn_cache );
+    ssn_cache_remove( domain, head );
+    ssl_session_free( head );
+    domain->ssn_cache_stats.evictions++;
+  }
+  return 0;
+}
+
+int pn_ssl_domain_get_session_cache_stats(pn_ssl_domain_t *domain, pn_ssl_cache_stats_t *stats)
+{
+  if (!domain || !stats) return -1;
+  *stats = domain->ssn_cache_stats;
+  return 0;
+}
+
 
 bool pn_ssl_get_cipher_name(pn_ssl_t *ssl, char *buffer, size_t size )
 {
@@ -763,7 +844,7 @@ static int start_ssl_shutdown( pn_ssl_t *ssl )
         ssn->session = SSL_get1_session( ssl->ssl );
         if (ssn->session) {
           _log( ssl, "Saving SSL session as %s\n", ssl->session_id );
-          LL_ADD( ssl->domain, ssn_cache, ssn );
+          ssn_cache_add( ssl->domain, ssn );
         } else {
           ssl_session_free( ssn );
         }
@@ -1053,7 +1134,7 @@ static int init_ssl_socket( pn_ssl_t *ssl )
       if (rc != 1) {
         _log( ssl, "Session restore failed, id=%s\n", ssn->id );
       }
-      LL_REMOVE( ssl->domain, ssn_cache, ssn );
+      ssn_cache_remove( ssl->domain, ssn );
       ssl_session_free( ssn );
     }
   }
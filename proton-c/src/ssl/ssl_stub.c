@@ -104,6 +104,16 @@ int pn_ssl_domain_allow_unsecured_client(pn_ssl_domain_t *domain)
   return -1;
 }
 
+int pn_ssl_domain_set_session_cache_size(pn_ssl_domain_t *domain, size_t size)
+{
+  return -1;
+}
+
+int pn_ssl_domain_get_session_cache_stats(pn_ssl_domain_t *domain, pn_ssl_cache_stats_t *stats)
+{
+  return -1;
+}
+
 pn_ssl_resume_status_t pn_ssl_resume_status( pn_ssl_t *s )
 {
   return PN_SSL_RESUME_UNKNOWN;
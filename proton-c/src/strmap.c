@@ -0,0 +1,181 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <proton/error.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "strmap.h"
+#include "util.h"
+
+void pn_strmap_init(pn_strmap_t *map)
+{
+  map->entries = NULL;
+  map->capacity = 0;
+  map->size = 0;
+}
+
+void pn_strmap_clear(pn_strmap_t *map)
+{
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (map->entries[i].value) {
+      free(map->entries[i].key);
+      map->entries[i].key = NULL;
+      map->entries[i].value = NULL;
+    }
+  }
+  map->size = 0;
+}
+
+void pn_strmap_tini(pn_strmap_t *map)
+{
+  pn_strmap_clear(map);
+  free(map->entries);
+  pn_strmap_init(map);
+}
+
+// FNV-1a
+static size_t pn_strmap_hash(const char *key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *c = (const unsigned char *) key; *c; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ (hash >> 32);
+}
+
+static pn_strmap_entry_t *pn_strmap_find(pn_strmap_t *map, const char *key, size_t hash)
+{
+  if (!map->capacity) return NULL;
+
+  size_t i = hash & (map->capacity - 1);
+  while (map->entries[i].value) {
+    if (map->entries[i].hash == hash && !strcmp(map->entries[i].key, key))
+      return &map->entries[i];
+    i = (i + 1) & (map->capacity - 1);
+  }
+
+  return NULL;
+}
+
+static void pn_strmap_insert(pn_strmap_t *map, char *key, size_t hash, void *value)
+{
+  size_t i = hash & (map->capacity - 1);
+  while (map->entries[i].value) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  map->entries[i].key = key;
+  map->entries[i].hash = hash;
+  map->entries[i].value = value;
+  map->size++;
+}
+
+static int pn_strmap_grow(pn_strmap_t *map)
+{
+  pn_strmap_entry_t *old = map->entries;
+  size_t old_capacity = map->capacity;
+  size_t capacity = old_capacity ? 2*old_capacity : 16;
+
+  pn_strmap_entry_t *entries = calloc(capacity, sizeof(pn_strmap_entry_t));
+  if (!entries) return PN_ERR;
+
+  map->entries = entries;
+  map->capacity = capacity;
+  map->size = 0;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].value) pn_strmap_insert(map, old[i].key, old[i].hash, old[i].value);
+  }
+
+  free(old);
+  return 0;
+}
+
+// backward shift deletion, as in idmap.c
+static void pn_strmap_erase(pn_strmap_t *map, pn_strmap_entry_t *entry)
+{
+  size_t mask = map->capacity - 1;
+  size_t hole = entry - map->entries;
+  size_t i = hole;
+
+  free(entry->key);
+  while (true) {
+    i = (i + 1) & mask;
+    if (!map->entries[i].value) break;
+    size_t home = map->entries[i].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      map->entries[hole] = map->entries[i];
+      hole = i;
+    }
+  }
+
+  map->entries[hole].key = NULL;
+  map->entries[hole].value = NULL;
+  map->size--;
+}
+
+void *pn_strmap_get(pn_strmap_t *map, const char *key)
+{
+  pn_strmap_entry_t *entry = pn_strmap_find(map, key, pn_strmap_hash(key));
+  return entry ? entry->value : NULL;
+}
+
+int pn_strmap_put(pn_strmap_t *map, const char *key, void *value)
+{
+  size_t hash = pn_strmap_hash(key);
+  pn_strmap_entry_t *entry = pn_strmap_find(map, key, hash);
+  if (entry) {
+    if (value) entry->value = value;
+    else pn_strmap_erase(map, entry);
+    return 0;
+  }
+
+  if (!value) return 0;
+
+  if (2*(map->size + 1) > map->capacity) {
+    int err = pn_strmap_grow(map);
+    if (err) return err;
+  }
+
+  char *copy = pn_strdup(key);
+  if (!copy) return PN_ERR;
+  pn_strmap_insert(map, copy, hash, value);
+  return 0;
+}
+
+size_t pn_strmap_purge(pn_strmap_t *map, bool (*match)(void *value, void *arg), void *arg)
+{
+  size_t removed = 0;
+  // an erase can shift an entry that wrapped around the end of the
+  // table back past the scan, so scan until nothing matches
+  bool again = true;
+  while (again) {
+    again = false;
+    for (size_t i = 0; i < map->capacity; i++) {
+      while (map->entries[i].value && match(map->entries[i].value, arg)) {
+        pn_strmap_erase(map, &map->entries[i]);
+        removed++;
+        again = true;
+      }
+    }
+  }
+  return removed;
+}
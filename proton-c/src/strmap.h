@@ -0,0 +1,52 @@
+#ifndef _PROTON_SRC_STRMAP_H
+#define _PROTON_SRC_STRMAP_H 1
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// maps strings, such as addresses, to pointers with an open addressing
+// hash; the map keeps its own copy of each key
+typedef struct {
+  char *key;
+  size_t hash;
+  void *value; // NULL when the slot is free
+} pn_strmap_entry_t;
+
+typedef struct {
+  pn_strmap_entry_t *entries;
+  size_t capacity; // zero or a power of two
+  size_t size;
+} pn_strmap_t;
+
+// a zeroed map is an empty map
+void pn_strmap_init(pn_strmap_t *map);
+void pn_strmap_tini(pn_strmap_t *map);
+void pn_strmap_clear(pn_strmap_t *map);
+void *pn_strmap_get(pn_strmap_t *map, const char *key);
+// a NULL value removes the key
+int pn_strmap_put(pn_strmap_t *map, const char *key, void *value);
+// removes every entry whose value matches, returning how many were removed
+size_t pn_strmap_purge(pn_strmap_t *map, bool (*match)(void *value, void *arg), void *arg);
+
+#endif /* strmap.h */
@@ -18,6 +18,7 @@
 #
 
 import proton_tests.codec
+import proton_tests.dump
 import proton_tests.engine
 import proton_tests.message
 import proton_tests.messenger
@@ -0,0 +1,97 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+import os, common, struct, subprocess, tempfile
+from proton import *
+from common import Skipped
+from transport import frame, FLOW
+
+TRANSFER = 0x14
+
+def transfer(channel, payload):
+  performative = frame(channel, TRANSFER, ("uint", 0), ("uint", 0), ("binary", "tag"))
+  return struct.pack("!I", len(performative) + len(payload)) + performative[4:] + payload
+
+def find_dump():
+  dirs = os.environ.get("PATH", "").split(os.pathsep)
+  if os.environ.get("CPROTON_BUILD"):
+    dirs.insert(0, os.environ["CPROTON_BUILD"])
+  if os.environ.get("PROTON_HOME"):
+    dirs.insert(0, os.path.join(os.environ["PROTON_HOME"], "proton-c", "build"))
+  for d in dirs:
+    path = os.path.join(d, "proton-dump")
+    if os.path.isfile(path) and os.access(path, os.X_OK):
+      return path
+  return None
+
+class DumpTest(common.Test):
+
+  def setup(self):
+    self.dump = find_dump()
+    if not self.dump:
+      raise Skipped("proton-dump not found")
+    fd, self.capture = tempfile.mkstemp()
+    os.close(fd)
+
+  def teardown(self):
+    os.unlink(self.capture)
+
+  def write(self, frames):
+    f = open(self.capture, "wb")
+    f.write("AMQP\x00\x01\x00\x00")
+    for fr in frames:
+      f.write(fr)
+    f.close()
+
+  def run(self, *args):
+    p = subprocess.Popen((self.dump,) + args + (self.capture,), stdout=subprocess.PIPE,
+                         stderr=subprocess.PIPE)
+    out, err = p.communicate()
+    assert p.returncode == 0, (p.returncode, err)
+    assert not err, err
+    return out
+
+  def totals(self, out):
+    for line in out.splitlines():
+      if line.endswith(" total"):
+        return tuple(int(f) for f in line.split()[:3])
+    assert False, out
+
+  def testSegments(self):
+    payload = "x"*(64*1024)
+    xfr = transfer(1, payload)
+    flow = frame(0, FLOW, ("uint", 0), ("uint", 100), ("uint", 0), ("uint", 100))
+    # three and a bit segments of 8 MB, so the segment counters get
+    # merged more than once
+    count = 3*8*16 + 10
+    self.write([xfr, flow]*count)
+
+    out = self.run("-j1")
+    assert out.count("@20 ") == count, out.count("@20 ")
+    assert out.count("@19 ") == count, out.count("@19 ")
+    assert self.run("-j4") == out
+
+    summary = self.run("-s", "-j1")
+    frames = 2*count
+    size = (len(xfr) + len(flow))*count
+    assert self.totals(summary) == (frames, size, len(payload)*count), summary
+    assert self.run("-s", "-j4") == summary
+
+    filtered = self.run("-s", "-j4", "-p", "transfer")
+    assert self.totals(filtered) == (count, len(xfr)*count, len(payload)*count), filtered
@@ -17,7 +17,7 @@
 # under the License.
 #
 
-import os, common
+import os, common, time
 from proton import *
 from threading import Thread
 
@@ -204,6 +204,200 @@ class MessengerTest(Test):
       else:
         assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
 
+  def testLargeWindow(self):
+    self.server.incoming_window = 2000
+    self.start()
+    msg = Message()
+    msg.address="amqp://0.0.0.0:12345"
+    msg.subject="Hello World!"
+
+    self.client.outgoing_window = 2000
+    trackers = []
+    for i in range(1500):
+      trackers.append(self.client.put(msg))
+
+    self.client.send()
+
+    for t in trackers:
+      assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
+
+  def testWindowWraps(self):
+    self.server.incoming_window = 3000
+    self.start()
+    msg = Message()
+    msg.address="amqp://0.0.0.0:12345"
+    msg.subject="Hello World!"
+
+    # retiring the head of the window and then outgrowing it moves
+    # trackers that have wrapped around the end of the queue
+    self.client.outgoing_window = 3000
+    trackers = []
+    for i in range(1000):
+      trackers.append(self.client.put(msg))
+    self.client.send()
+
+    for t in trackers[:900]:
+      self.client.settle(t)
+    for i in range(1000):
+      trackers.append(self.client.put(msg))
+    self.client.send()
+
+    for t in trackers[:900]:
+      assert self.client.status(t) is None, (t, self.client.status(t))
+    for t in trackers[900:]:
+      assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
+
+    self.client.settle()
+    for t in trackers:
+      assert self.client.status(t) is None, (t, self.client.status(t))
+
+  def testRestart(self):
+    self.server.incoming_window = 10
+    self.start()
+    msg = Message()
+    msg.address="amqp://0.0.0.0:12345"
+    msg.subject="Hello World!"
+
+    self.client.outgoing_window = 10
+    for i in range(2):
+      t = self.client.put(msg)
+      self.client.send()
+      assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
+      self.client.stop()
+      self.client.start()
+
+  def testBatch(self):
+    self.server.incoming_window = 10
+    self.start()
+    msgs = []
+    for i in range(10):
+      msg = Message()
+      msg.address="amqp://0.0.0.0:12345"
+      msg.subject="Hello World!"
+      msg.body = "batch-%s" % i
+      msgs.append(msg)
+
+    self.client.outgoing_window = 10
+    last = self.client.put_batch(msgs)
+    self.client.send()
+
+    for t in range(last - 9, last + 1):
+      assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
+
+    replies = [Message() for i in range(10)]
+    got = 0
+    while got < 10:
+      self.client.recv(10 - got)
+      got += self.client.get_batch(replies[got:])
+    assert self.client.get_batch(replies) == 0
+    assert sorted(r.body for r in replies) == sorted(m.body for m in msgs)
+
+  def testBatchSizes(self):
+    self.server.incoming_window = 10
+    self.start()
+    # each message is encoded into memory sized by the one before it
+    msgs = []
+    for size in (10, 100000, 10, 5000, 5000, 300000, 1):
+      msg = Message()
+      msg.address="amqp://0.0.0.0:12345"
+      msg.body = "x"*size
+      msgs.append(msg)
+
+    self.client.outgoing_window = 10
+    last = self.client.put_batch(msgs)
+    self.client.send()
+    for t in range(last - len(msgs) + 1, last + 1):
+      assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
+
+    replies = [Message() for m in msgs]
+    got = 0
+    while got < len(msgs):
+      self.client.recv(len(msgs) - got)
+      got += self.client.get_batch(replies[got:])
+    assert sorted(len(r.body) for r in replies) == sorted(len(m.body) for m in msgs)
+
+  def testManyAddresses(self):
+    self.start()
+    msg = Message()
+    for i in range(20):
+      msg.address="amqp://0.0.0.0:12345/idle-%s" % i
+      self.client.put(msg)
+    self.client.send()
+
+    msg.address="amqp://0.0.0.0:12345/busy"
+    for i in range(200):
+      self.client.put(msg)
+    self.client.send()
+    assert self.client.outgoing == 0, self.client.outgoing
+
+  def testNonBlocking(self):
+    self.start()
+    self.client.blocking = False
+    msg = Message()
+    msg.address="amqp://0.0.0.0:12345"
+    msg.subject="Hello World!"
+    self.client.put(msg)
+    self.client.send()
+    for i in range(100):
+      if not self.client.outgoing: break
+      self.client.work(100)
+      self.client.send()
+    assert self.client.outgoing == 0, self.client.outgoing
+
+    self.client.recv(1)
+    for i in range(100):
+      if self.client.incoming: break
+      self.client.work(100)
+    assert self.client.incoming == 1, self.client.incoming
+
+    reply = Message()
+    self.client.get(reply)
+    assert reply.subject == "Hello World!"
+    self.client.blocking = True
+
+  def testPutAsync(self):
+    self.start()
+    def produce(n):
+      msg = Message()
+      msg.address="amqp://0.0.0.0:12345"
+      for i in range(50):
+        msg.subject = "%s-%s" % (n, i)
+        self.client.put_async(msg)
+    producers = [Thread(target=produce, args=(n,)) for n in range(4)]
+    for p in producers:
+      p.start()
+    for p in producers:
+      p.join()
+
+    self.client.send()
+    assert self.client.outgoing == 0, self.client.outgoing
+
+    self.client.recv(200)
+    subjects = set()
+    while len(subjects) < 200:
+      while self.client.incoming:
+        reply = Message()
+        self.client.get(reply)
+        subjects.add(reply.subject)
+      if len(subjects) < 200:
+        self.client.recv(200 - len(subjects))
+    assert len(subjects) == 200, len(subjects)
+
+  def testPutAsyncWakesWork(self):
+    self.start()
+    msg = Message()
+    msg.address="amqp://0.0.0.0:12345"
+    def produce():
+      self.client.put_async(msg)
+    producer = Thread(target=produce)
+    producer.start()
+    start = time.time()
+    self.client.work(10000)
+    assert time.time() - start < 5, "work was not woken"
+    producer.join()
+    self.client.send()
+    assert self.client.outgoing == 0, self.client.outgoing
+
   def testRejectIndividual(self):
     self.testReject(self.reject_individual)
 
@@ -249,3 +443,84 @@ class MessengerTest(Test):
         remaining -= 1
     for t in trackers:
       assert self.client.status(t) is ACCEPTED, (t, self.client.status(t))
+
+class ReadyTest(common.Test):
+
+  def setup(self):
+    self.server = Messenger("server")
+    self.server.blocking = False
+    self.server.start()
+    self.server.subscribe("amqp://~0.0.0.0:12346")
+    self.client = Messenger("client")
+    self.client.blocking = False
+    self.client.start()
+
+  def teardown(self):
+    self.client.stop()
+    self.server.stop()
+    self.client = None
+    self.server = None
+
+  def pump(self, done):
+    for i in range(200):
+      if done(): break
+      self.client.work(10)
+      self.server.work(10)
+    assert done()
+
+  def put(self, *subjects):
+    msg = Message()
+    for subject in subjects:
+      msg.address = "amqp://0.0.0.0:12346/%s" % subject.split("-")[0]
+      msg.subject = subject
+      self.client.put(msg)
+
+  def testOrderAcrossLinks(self):
+    subjects = ["%s-%s" % (name, i) for i in range(3) for name in ("a", "b")]
+    self.put(*subjects)
+    self.server.recv(100)
+    self.pump(lambda: self.server.incoming == len(subjects))
+
+    msg = Message()
+    got = []
+    while self.server.incoming:
+      self.server.get(msg)
+      got.append(msg.subject)
+    assert got == subjects, got
+
+  def testPurgedOnClose(self):
+    self.put("a-0", "b-0", "a-1")
+    self.server.recv(100)
+    self.pump(lambda: self.server.incoming == 3)
+
+    # the unread deliveries go away with their connection
+    self.client.stop()
+    self.pump(lambda: self.client.stopped)
+    for i in range(10):
+      self.server.work(10)
+    try:
+      self.server.get(Message())
+      assert False, "message survived its connection"
+    except MessengerException:
+      pass
+
+  def testIdleCreditDrained(self):
+    self.put("a-0", "b-0")
+    self.server.recv(2)
+    self.pump(lambda: self.server.incoming == 2)
+    msg = Message()
+    while self.server.incoming:
+      self.server.get(msg)
+
+    # a uses up its half of the credit while b, which has nothing to
+    # send, holds the rest; asking for no more than is already out has
+    # b give its share back to a
+    self.server.recv(4)
+    self.put("a-1", "a-2", "a-3", "a-4")
+    self.pump(lambda: self.server.incoming == 2)
+    while self.server.incoming:
+      self.server.get(msg)
+    self.server.recv(2)
+    self.pump(lambda: self.server.incoming == 2)
+    self.server.get(msg)
+    assert msg.subject == "a-3", msg.subject
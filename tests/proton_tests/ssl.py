@@ -475,6 +475,9 @@ class SslTest(common.Test):
         assert server.ssl.protocol_name() is not None
         if(LANGUAGE=="C"):
             assert client.ssl.resume_status() == SSL.RESUME_NEW
+            stats = self.client_domain.session_cache_stats
+            assert stats.hits == 1, stats.hits
+            assert stats.misses == 2, stats.misses
 
         client.connection.close()
         server.connection.close()
@@ -677,3 +680,90 @@ class SslTest(common.Test):
         except TransportException:
             pass
         self.teardown()
+
+
+class MessengerSSLTest(common.Test):
+    """ Messengers build each ssl domain once and share it between their
+    connections, until the credentials change.
+    """
+
+    def setup(self):
+        try:
+            SSLDomain(SSLDomain.MODE_SERVER)
+        except SSLUnavailable, e:
+            raise Skipped(e)
+        self.server = Messenger("server")
+        self.server.blocking = False
+        self.server.certificate = self._testpath("server-certificate.pem")
+        self.server.private_key = self._testpath("server-private-key.pem")
+        self.server.password = "server-password"
+        self.server.start()
+        self.server.subscribe("amqps://~0.0.0.0:12347")
+        self.server.recv(100)
+        self.client = Messenger("client")
+        self.client.blocking = False
+
+    def teardown(self):
+        self.client.stop()
+        self.server.stop()
+        self.client = None
+        self.server = None
+
+    def _testpath(self, file):
+        return os.path.join(os.path.dirname(__file__), "ssl_db/%s" % file)
+
+    def _pump(self, done, count=200):
+        for i in range(count):
+            if done(): break
+            self.client.work(10)
+            self.server.work(10)
+        return done()
+
+    def _send(self, subject):
+        """ Sends a message over a new connection, returning whether the
+        server received it. The resume status of the connection is kept
+        in self.resumed.
+        """
+        self.client.start()
+        msg = Message()
+        msg.address = "amqps://0.0.0.0:12347"
+        msg.subject = subject
+        self.client.put(msg)
+        received = self._pump(lambda: self.server.incoming)
+        if received:
+            self.server.get(msg)
+            assert msg.subject == subject, msg.subject
+        self.resumed = self.client.ssl_resume_status(msg.address)
+        self.client.stop()
+        self._pump(lambda: self.client.stopped)
+        return received
+
+    def test_domains_shared(self):
+        self.client.trusted_certificates = self._testpath("ca-certificate.pem")
+        assert self._send("first")
+        # the second connection reuses the domains built for the first
+        assert self._send("second")
+
+    def test_domains_rebuilt(self):
+        self.client.trusted_certificates = self._testpath("ca-certificate.pem")
+        assert self._send("trusted")
+        # a client domain kept from before would still trust the server
+        self.client.trusted_certificates = self._testpath("bad-server-certificate.pem")
+        assert not self._send("untrusted")
+        self.client.trusted_certificates = self._testpath("ca-certificate.pem")
+        assert self._send("trusted again")
+
+    def test_session_not_resumed(self):
+        self.client.trusted_certificates = self._testpath("ca-certificate.pem")
+        assert not self.client.ssl_resume
+        assert self._send("first")
+        assert self._send("second")
+        assert self.resumed == SSL.RESUME_NEW, self.resumed
+
+    def test_session_resumed(self):
+        self.client.trusted_certificates = self._testpath("ca-certificate.pem")
+        self.client.ssl_resume = True
+        assert self._send("first")
+        assert self.resumed == SSL.RESUME_NEW, self.resumed
+        assert self._send("second")
+        assert self.resumed == SSL.RESUME_REUSED, self.resumed
@@ -17,7 +17,7 @@
 # under the License.
 #
 
-import os, common
+import os, common, struct
 from proton import *
 
 class Test(common.Test):
@@ -128,3 +128,147 @@ class TransportTest(Test):
       n = self.transport.input(out)
       assert n == len(out), (n, out)
     assert c.session_head(0) != None
+
+def frame(channel, code, *fields):
+  """
+  Encodes a performative, fields are (type, value) pairs such as
+  ("uint", 7), or ("null",), or functions that put the field.
+  """
+  data = Data()
+  data.put_described()
+  data.enter()
+  data.put_ulong(code)
+  data.put_list()
+  data.enter()
+  for field in fields:
+    if callable(field):
+      field(data)
+    else:
+      getattr(data, "put_%s" % field[0])(*field[1:])
+  data.exit()
+  data.exit()
+  body = data.encode()
+  return struct.pack("!IBBH", 8 + len(body), 2, 0, channel) + body
+
+OPEN, BEGIN, ATTACH, FLOW, DETACH, END = 0x10, 0x11, 0x12, 0x13, 0x16, 0x17
+SOURCE = 0x28
+
+def source(address):
+  def put(data):
+    data.put_described()
+    data.enter()
+    data.put_ulong(SOURCE)
+    data.put_list()
+    data.enter()
+    data.put_string(address)
+    data.exit()
+    data.exit()
+  return put
+
+class ChannelHandleTest(Test):
+  """
+  Channels and handles are picked by the peer, so any value must work
+  and only those in use may be named.
+  """
+
+  def setup(self):
+    self.conn = Connection()
+    self.transport = Transport()
+    self.transport.bind(self.conn)
+    self.input("AMQP\x00\x01\x00\x00" + frame(0, OPEN, ("string", "peer")))
+
+  def teardown(self):
+    self.transport = None
+    self.conn = None
+
+  def input(self, bytes):
+    n = self.transport.input(bytes)
+    assert n == len(bytes), (n, len(bytes))
+
+  def begin(self, channel):
+    self.input(frame(channel, BEGIN, ("null",), ("uint", 0), ("uint", 1024),
+                     ("uint", 1024)))
+
+  def attach(self, channel, name, handle):
+    # the peer attaches as a receiver, so the local end is a sender
+    self.input(frame(channel, ATTACH, ("string", name), ("uint", handle),
+                     ("bool", True), ("null",), ("null",), source(name)))
+
+  def flow(self, channel, handle, credit):
+    return frame(channel, FLOW, ("uint", 0), ("uint", 1024), ("uint", 0),
+                 ("uint", 1024), ("uint", handle), ("uint", 0),
+                 ("uint", credit))
+
+  def sender(self, name):
+    link = self.conn.link_head(0)
+    while link:
+      if link.remote_source.address == name: return link
+      link = link.next(0)
+    assert False, name
+
+  def invalid(self, bytes):
+    try:
+      self.transport.input(bytes)
+      assert False, "expected an error"
+    except TransportException:
+      pass
+
+  def testSparse(self):
+    channels = [0, 255, 256, 65535]
+    handles = [0, 255, 256, 2**31, 2**32 - 1]
+    for channel in channels:
+      self.begin(channel)
+      for handle in handles:
+        self.attach(channel, "link-%s-%s" % (channel, handle), handle)
+
+    for i, channel in enumerate(channels):
+      for j, handle in enumerate(handles):
+        self.input(self.flow(channel, handle, 10*i + j + 1))
+    for i, channel in enumerate(channels):
+      for j, handle in enumerate(handles):
+        snd = self.sender("link-%s-%s" % (channel, handle))
+        assert snd.credit == 10*i + j + 1, (channel, handle, snd.credit)
+
+  def testUnknownChannel(self):
+    self.begin(7)
+    self.invalid(self.flow(8, 0, 1))
+
+  def testUnknownHandle(self):
+    self.begin(7)
+    self.attach(7, "link", 2**32 - 1)
+    self.invalid(self.flow(7, 2**32 - 2, 1))
+
+  def testAttachUnknownChannel(self):
+    self.invalid(frame(3, ATTACH, ("string", "link"), ("uint", 0),
+                       ("bool", True)))
+
+  def testDetachUnmapsHandle(self):
+    self.begin(7)
+    self.attach(7, "link", 1000)
+    self.input(frame(7, DETACH, ("uint", 1000), ("bool", True)))
+    self.invalid(self.flow(7, 1000, 1))
+
+  def testDetachedHandleReused(self):
+    self.begin(7)
+    self.attach(7, "first", 1000)
+    self.input(frame(7, DETACH, ("uint", 1000), ("bool", True)))
+    self.attach(7, "second", 1000)
+    self.input(self.flow(7, 1000, 5))
+    assert self.sender("first").credit == 0
+    assert self.sender("second").credit == 5
+
+  def testEndUnmapsChannel(self):
+    self.begin(300)
+    self.attach(300, "link", 1000)
+    self.input(frame(300, END))
+    self.invalid(self.flow(300, 1000, 1))
+
+  def testEndedChannelReused(self):
+    self.begin(300)
+    self.attach(300, "first", 1000)
+    self.input(frame(300, END))
+    self.begin(300)
+    self.attach(300, "second", 1000)
+    self.input(self.flow(300, 1000, 5))
+    assert self.sender("first").credit == 0
+    assert self.sender("second").credit == 5